@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "analysis.h"
+#include "searchpool.h"
+#include "board.h"
+#include "connection.h"
+
+static void sliceDone(void* ctx, SearchResult* result);
+
+/* queue the next slice, a->mtx must be held */
+static void startSlice(Analysis* a) {
+  SearchLimits limits = {a->depth, ANALYSIS_SLICE_NODES, 0, 0, ANALYSIS_LINES};
+  a->running = 1;
+  a->sliceGeneration = a->generation;
+  submitSearch(a, &a->board, &limits, a->tt, sliceDone, a);
+}
+
+/* writes the lines in result as text, returns the length */
+static int formatLines(Analysis* a, SearchResult* result, char* buf, int sz) {
+  int wb = snprintf(buf, sz, "Analysis (depth %d):\n", result->depth);
+  for(int k = 0; k < result->lines && wb < sz; k++) {
+    /* scores are shown from white's point of view */
+    int score = (a->board.toMove == WHITE) ? result->pvScore[k] : -result->pvScore[k];
+    if(score > MATE_SCORE - MAX_PLY) {
+      wb += snprintf(buf+wb, sz-wb, "  %d. #%d ", k+1, (MATE_SCORE - score + 1) / 2);
+    } else if(score < -MATE_SCORE + MAX_PLY) {
+      wb += snprintf(buf+wb, sz-wb, "  %d. #-%d ", k+1, (MATE_SCORE + score + 1) / 2);
+    } else {
+      wb += snprintf(buf+wb, sz-wb, "  %d. %+.2f ", k+1, score / 100.0);
+    }
+    for(int i = 0; i < result->pvLength[k] && wb + 6 < sz; i++) {
+      char sq[3];
+      squareToString(sq, result->pv[k][i].start);
+      buf[wb++] = sq[0];
+      buf[wb++] = sq[1];
+      squareToString(sq, result->pv[k][i].end);
+      buf[wb++] = sq[0];
+      buf[wb++] = sq[1];
+      buf[wb++] = ' ';
+    }
+    if(wb < sz) {
+      buf[wb++] = '\n';
+    }
+  }
+  if(wb >= sz) {
+    wb = sz - 1;
+  }
+  buf[wb] = 0;
+  return wb;
+}
+
+/* called from a search pool thread when a slice completes */
+static void sliceDone(void* ctx, SearchResult* result) {
+  Analysis* a = ctx;
+  pthread_mutex_lock(&a->mtx);
+  if(a->sliceGeneration != a->generation) {
+    /* the position changed (or everyone left) while this slice ran */
+    pthread_mutex_unlock(&a->mtx);
+    return;
+  }
+
+  int finished = result->best.start < 0 || result->depth < a->depth;
+  if(result->lines > 0 && !finished) {
+    /* one search, sent to every subscriber, or dropped for one that is behind */
+    char buf[1024];
+    int len = formatLines(a, result, buf, sizeof(buf));
+    int binLen;
+    char* bin = frameText(buf, len, &binLen);
+    for(int i = 0; i < a->n_subscribers; i++) {
+      if(outputMode(a->subscribers[i]) & OUTPUT_BINARY) {
+	sendFrame(a->subscribers[i], bin, binLen);
+      } else {
+	sendFrame(a->subscribers[i], buf, len+1);
+      }
+    }
+    free(bin);
+  }
+
+  a->running = 0;
+  if(a->n_subscribers > 0 && !finished && a->depth < ANALYSIS_MAX_DEPTH) {
+    a->depth++;
+    startSlice(a);
+  }
+  pthread_mutex_unlock(&a->mtx);
+}
+
+Analysis* newAnalysis(Position* pos) {
+  Analysis* a = malloc(sizeof(Analysis));
+  pthread_mutex_init(&a->mtx, NULL);
+  a->tt = newTransTable(ANALYSIS_TT_BITS);
+  boardFromPosition(&a->board, pos);
+  a->generation = 0;
+  a->sliceGeneration = 0;
+  a->depth = 1;
+  a->running = 0;
+  a->n_subscribers = 0;
+  a->cap_subscribers = 4;
+  a->subscribers = malloc(sizeof(int) * a->cap_subscribers);
+  return a;
+}
+
+void freeAnalysis(Analysis* a) {
+  /* no slice can be running or queued after this */
+  pthread_mutex_lock(&a->mtx);
+  a->generation++;
+  pthread_mutex_unlock(&a->mtx);
+  cancelSearches(a);
+
+  freeTransTable(a->tt);
+  free(a->subscribers);
+  pthread_mutex_destroy(&a->mtx);
+  free(a);
+}
+
+int subscribeAnalysis(Analysis* a, int fd) {
+  pthread_mutex_lock(&a->mtx);
+  for(int i = 0; i < a->n_subscribers; i++) {
+    if(a->subscribers[i] == fd) {
+      pthread_mutex_unlock(&a->mtx);
+      return 0;
+    }
+  }
+  if(a->n_subscribers == a->cap_subscribers) {
+    a->cap_subscribers *= 2;
+    a->subscribers = realloc(a->subscribers, sizeof(int) * a->cap_subscribers);
+  }
+  a->subscribers[a->n_subscribers++] = fd;
+  if(!a->running) {
+    /* the first subscriber (re)starts the analysis */
+    a->depth = 1;
+    startSlice(a);
+  }
+  pthread_mutex_unlock(&a->mtx);
+  return 1;
+}
+
+int unsubscribeAnalysis(Analysis* a, int fd) {
+  pthread_mutex_lock(&a->mtx);
+  int found = 0;
+  for(int i = 0; i < a->n_subscribers; i++) {
+    if(a->subscribers[i] == fd) {
+      a->subscribers[i] = a->subscribers[--a->n_subscribers];
+      found = 1;
+      break;
+    }
+  }
+  int idle = a->n_subscribers == 0;
+  if(idle) {
+    /* pause: drop the slice that is on its way */
+    a->generation++;
+  }
+  pthread_mutex_unlock(&a->mtx);
+
+  if(idle) {
+    cancelSearches(a);
+    pthread_mutex_lock(&a->mtx);
+    a->running = 0;
+    pthread_mutex_unlock(&a->mtx);
+  }
+  return found;
+}
+
+void analysisNewPosition(Analysis* a, Position* pos) {
+  pthread_mutex_lock(&a->mtx);
+  a->generation++;
+  boardFromPosition(&a->board, pos);
+  a->depth = 1;
+  pthread_mutex_unlock(&a->mtx);
+
+  /* slices of the old position are dropped, the table is kept */
+  cancelSearches(a);
+
+  pthread_mutex_lock(&a->mtx);
+  a->running = 0;
+  if(a->n_subscribers > 0) {
+    startSlice(a);
+  }
+  pthread_mutex_unlock(&a->mtx);
+}
@@ -0,0 +1,51 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <pthread.h>
+#include "engine.h"
+
+/*
+ * A live analysis of one game, shared by every spectator that asks for it
+ *
+ * The analysis runs on the search pool as a chain of short slices, one depth
+ * per slice, each slice reusing the analysis's transposition table. After
+ * every slice the lines found are sent to all subscribers and the next depth
+ * is queued behind the other searches. The chain stops when nobody is
+ * subscribed and restarts from depth 1 (with the table kept) when the
+ * position changes.
+ */
+
+#define ANALYSIS_LINES 3 /* multi-PV lines shown to spectators */
+#define ANALYSIS_MAX_DEPTH 12
+#define ANALYSIS_SLICE_NODES 300000 /* node budget of one slice */
+#define ANALYSIS_TT_BITS 18
+
+typedef struct Analysis {
+  pthread_mutex_t mtx; /* protects everything below */
+  TransTable* tt;
+  EngineBoard board; /* the position being analysed */
+  int generation; /* bumped for every new position */
+  int sliceGeneration; /* generation of the slice in flight, there is at most one */
+  int depth; /* depth of the next slice */
+  int running; /* a slice is queued or running */
+  int* subscribers; /* subscribed spectator descriptors */
+  int n_subscribers;
+  int cap_subscribers;
+} Analysis;
+
+Analysis* newAnalysis(Position* pos);
+/* stops the analysis and frees it */
+void freeAnalysis(Analysis* a);
+
+/*
+ * add or remove a subscriber
+ * the analysis starts with the first subscriber and pauses after the last
+ * return 1 if the subscriber set changed, 0 otherwise
+ */
+int subscribeAnalysis(Analysis* a, int fd);
+int unsubscribeAnalysis(Analysis* a, int fd);
+
+/* restart the analysis from a new position */
+void analysisNewPosition(Analysis* a, Position* pos);
+
+#endif
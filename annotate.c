@@ -0,0 +1,169 @@
+#define _GNU_SOURCE /* SCHED_IDLE */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "annotate.h"
+#include "engine.h"
+#include "searchpool.h"
+#include "board.h"
+
+typedef struct Annotator {
+  pthread_mutex_t mtx;
+  pthread_cond_t work; /* a job was queued */
+  LList queue; /* AnnotationJob* */
+  char dir[256];
+  int running;
+} Annotator;
+
+static Annotator annotator = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* writes score (centipawns, white's point of view) as text */
+static void scoreToString(char* buf, int sz, int score) {
+  if(score > MATE_SCORE - MAX_PLY) {
+    snprintf(buf, sz, "#%d", (MATE_SCORE - score + 1) / 2);
+  } else if(score < -MATE_SCORE + MAX_PLY) {
+    snprintf(buf, sz, "#-%d", (MATE_SCORE + score + 1) / 2);
+  } else {
+    snprintf(buf, sz, "%+.2f", score / 100.0);
+  }
+}
+
+static void moveToString(char buf[5], Move* m) {
+  squareToString(buf, m->start);
+  squareToString(buf+2, m->end);
+  buf[4] = '\0';
+}
+
+/*
+ * search b while no live searches are running, a search that one
+ * interrupts is thrown away and started again once they are done
+ */
+static void idleSearch(EngineBoard* b, int depth, TransTable* tt, SearchResult* result) {
+  SearchLimits limits = {depth, ANNOTATE_NODES, 0, 0, 0};
+  while(!searchWhenIdle(b, &limits, tt, result)) {
+    usleep(ANNOTATE_BACKOFF_MS * 1000);
+  }
+}
+
+static void annotateGame(AnnotationJob* job, TransTable* tt, FILE* out) {
+  fprintf(out, "[Game \"%d\"]\n", job->id);
+  fprintf(out, "[White \"%s\"]\n", job->white);
+  fprintf(out, "[Black \"%s\"]\n", job->black);
+  fprintf(out, "[Result \"%s\"]\n", job->result);
+  fprintf(out, "[Termination \"%s\"]\n", job->termination);
+  fprintf(out, "[Annotator \"cantid, depth %d\"]\n\n", ANNOTATE_DEPTH);
+
+  Position* start = newPosition();
+  EngineBoard b;
+  boardFromPosition(&b, start);
+  freePosition(start);
+  free(start);
+  clearTransTable(tt);
+
+  int ply = 0;
+  for(LLNode* cur = job->moves.head; cur; cur = cur->next, ply++) {
+    Move* m = cur->data;
+    char played[5];
+    moveToString(played, m);
+    if(ply % 2 == 0) {
+      fprintf(out, "%d. ", ply/2 + 1);
+    }
+    fprintf(out, "%s", played);
+
+    /* the best score here against the score after the move that was played */
+    SearchResult best, reply;
+    idleSearch(&b, ANNOTATE_DEPTH, tt, &best);
+    int sign = (b.toMove == WHITE) ? 1 : -1;
+    applyMoveToBoard(&b, m);
+    if(best.best.start < 0 || (best.best.start == m->start && best.best.end == m->end)) {
+      fprintf(out, " ");
+      continue;
+    }
+    idleSearch(&b, ANNOTATE_DEPTH - 1, tt, &reply);
+    int loss = best.score + reply.score;
+    if(loss < INACCURACY) {
+      fprintf(out, " ");
+      continue;
+    }
+
+    char mark[] = "?!";
+    if(loss >= BLUNDER) {
+      strcpy(mark, "??");
+    } else if(loss >= MISTAKE) {
+      strcpy(mark, "?");
+    }
+    char bestMove[5], bestScore[16], playedScore[16];
+    moveToString(bestMove, &best.best);
+    scoreToString(bestScore, sizeof(bestScore), sign * best.score);
+    scoreToString(playedScore, sizeof(playedScore), -sign * reply.score);
+    fprintf(out, "%s {%s, best %s %s} ", mark, playedScore, bestMove, bestScore);
+  }
+  fprintf(out, "%s\n", job->result);
+}
+
+static void* annotatorThread(void* data) {
+  /* only run when the machine has nothing better to do */
+  struct sched_param param = {0};
+  if(pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  }
+  TransTable* tt = newTransTable(SEARCH_TT_BITS);
+
+  while(1) {
+    pthread_mutex_lock(&annotator.mtx);
+    while(annotator.queue.len == 0) {
+      pthread_cond_wait(&annotator.work, &annotator.mtx);
+    }
+    AnnotationJob* job = *(AnnotationJob**)peekFrontList(&annotator.queue);
+    removeIndex(&annotator.queue, 0);
+    pthread_mutex_unlock(&annotator.mtx);
+
+    char path[320];
+    snprintf(path, sizeof(path), "%s/game-%ld-%d.txt", annotator.dir, (long)time(NULL), job->id);
+    FILE* out = fopen(path, "w");
+    if(out) {
+      annotateGame(job, tt, out);
+      fclose(out);
+    } else {
+      printf("annotator: cannot write %s: %s\n", path, strerror(errno));
+    }
+    freeList(&job->moves);
+    free(job);
+  }
+  return NULL;
+}
+
+void startAnnotator(const char* dir) {
+  if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    printf("annotator: cannot create %s: %s\n", dir, strerror(errno));
+    return;
+  }
+  snprintf(annotator.dir, sizeof(annotator.dir), "%s", dir);
+  initList(&annotator.queue);
+  annotator.running = 1;
+  pthread_t pid;
+  pthread_create(&pid, NULL, annotatorThread, NULL);
+  pthread_detach(pid);
+}
+
+int queueAnnotation(AnnotationJob* job) {
+  pthread_mutex_lock(&annotator.mtx);
+  if(!annotator.running || annotator.queue.len >= ANNOTATE_MAX_QUEUE) {
+    pthread_mutex_unlock(&annotator.mtx);
+    freeList(&job->moves);
+    free(job);
+    return 0;
+  }
+  pushBackList(&annotator.queue, &job, sizeof(AnnotationJob*));
+  pthread_cond_signal(&annotator.work);
+  pthread_mutex_unlock(&annotator.mtx);
+  return 1;
+}
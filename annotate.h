@@ -0,0 +1,47 @@
+#ifndef ANNOTATE_H
+#define ANNOTATE_H
+
+#include "list.h"
+
+/*
+ * Post-game annotation
+ *
+ * Completed games are queued to a single background thread that runs at idle
+ * priority (SCHED_IDLE, or the highest niceness where that is not allowed).
+ * It replays each game, searches every position to a fixed depth, marks the
+ * inaccuracies, mistakes and blunders, and writes the annotated game to the
+ * archive directory. It only searches while the search pool is empty, and
+ * a search is given up as soon as a live one is queued, so the live games
+ * never wait for it.
+ */
+
+#define ANNOTATE_DEPTH 5 /* plies searched for each position */
+#define ANNOTATE_NODES 400000 /* node budget of one search */
+#define ANNOTATE_BACKOFF_MS 100 /* wait while live searches are running */
+#define ANNOTATE_MAX_QUEUE 32 /* games waiting beyond this are not archived */
+
+/* centipawns lost by a move for each mark */
+#define INACCURACY 40 /* ?! */
+#define MISTAKE 100 /* ? */
+#define BLUNDER 250 /* ?? */
+
+typedef struct AnnotationJob {
+  int id; /* the game's slot */
+  char white[24]; /* who played each side */
+  char black[24];
+  char result[8]; /* 1-0, 0-1, 1/2-1/2 or * */
+  char termination[64]; /* how the game ended */
+  LList moves; /* Move, in the order they were played */
+} AnnotationJob;
+
+/* start the annotation thread, games are archived in dir */
+void startAnnotator(const char* dir);
+
+/*
+ * queue a completed game, the annotator takes ownership of job and its
+ * move list
+ * return 0 (and free job) if the annotator is not running or too far behind
+ */
+int queueAnnotation(AnnotationJob* job);
+
+#endif
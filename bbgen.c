@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "bitbase.h"
+#include "board.h"
+
+/*
+ * cantibb: generates the KPK, KRK and KQK bitbases by retrograde analysis
+ *
+ * Usage: ./cantibb [directory]
+ *
+ * Every position is indexed with the stronger side as white (see bitbase.h).
+ * Starting from "no position is won", positions are repeatedly marked as won
+ * when either
+ *   - white is to move and has a move into a won position, or
+ *   - black is to move and is checkmated, or every black move leads into a
+ *     won position
+ * until nothing changes. What remains unmarked is a draw. The rules follow
+ * the server: no castling or en passant, and pawns always promote to queens,
+ * so KPK is generated after KQK.
+ */
+
+#define STM_STRONG 0
+#define STM_WEAK 1
+
+/* king steps, as (file, rank) offsets */
+static const int kingDf[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+static const int kingDr[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+
+static int getBit(const unsigned char* bits, int idx) {
+  return (bits[idx >> 3] >> (idx & 7)) & 1;
+}
+
+static void setBit(unsigned char* bits, int idx) {
+  bits[idx >> 3] |= 1 << (idx & 7);
+}
+
+/* return the square offset by (df, dr) from sq, or -1 if off the board */
+static int step(int sq, int df, int dr) {
+  int f = sq % 8 + df;
+  int r = sq / 8 + dr;
+  if(f < 0 || f > 7 || r < 0 || r > 7) {
+    return -1;
+  }
+  return r * 8 + f;
+}
+
+static int adjacent(int a, int b) {
+  int df = abs(a % 8 - b % 8);
+  int dr = abs(a / 8 - b / 8);
+  return df <= 1 && dr <= 1 && a != b;
+}
+
+/*
+ * return 1 if the white piece on from attacks target
+ * blocker is the only square that can stop a slider (the white king)
+ */
+static int pieceAttacks(int piece, int from, int target, int blocker) {
+  if(piece == PAWN) {
+    return target == step(from, -1, 1) || target == step(from, 1, 1);
+  }
+  for(int d = 0; d < 8; d++) {
+    int diagonal = kingDf[d] != 0 && kingDr[d] != 0;
+    if((piece == ROOK && diagonal) || (piece == BISHOP && !diagonal)) {
+      continue;
+    }
+    int sq = step(from, kingDf[d], kingDr[d]);
+    while(sq >= 0 && sq != blocker) {
+      if(sq == target) {
+	return 1;
+      }
+      sq = step(sq, kingDf[d], kingDr[d]);
+    }
+  }
+  return 0;
+}
+
+/* return 1 if the position is legal with the given side to move */
+static int legalPosition(int piece, int stm, int wk, int bk, int ps) {
+  if(wk == bk || wk == ps || bk == ps || adjacent(wk, bk)) {
+    return 0;
+  }
+  if(piece == PAWN && (ps < 8 || ps >= 56)) {
+    return 0;
+  }
+  /* the side that just moved cannot have left black in check */
+  if(stm == STM_STRONG && pieceAttacks(piece, ps, bk, wk)) {
+    return 0;
+  }
+  return 1;
+}
+
+/* return 1 if white to move can reach a won position */
+static int whiteWins(int piece, const unsigned char* bits, const unsigned char* queenBits, int wk, int bk, int ps) {
+  /* king moves */
+  for(int d = 0; d < 8; d++) {
+    int to = step(wk, kingDf[d], kingDr[d]);
+    if(to < 0 || to == ps || adjacent(to, bk)) {
+      continue;
+    }
+    if(getBit(bits, bitbaseIndex(STM_WEAK, to, bk, ps))) {
+      return 1;
+    }
+  }
+
+  /* pawn moves, promoting into KQK */
+  if(piece == PAWN) {
+    int to = ps + 8;
+    if(to == wk || to == bk) {
+      return 0;
+    }
+    if(to >= 56) {
+      return getBit(queenBits, bitbaseIndex(STM_WEAK, wk, bk, to));
+    }
+    if(getBit(bits, bitbaseIndex(STM_WEAK, wk, bk, to))) {
+      return 1;
+    }
+    to += 8;
+    if(ps < 16 && to != wk && to != bk && getBit(bits, bitbaseIndex(STM_WEAK, wk, bk, to))) {
+      return 1;
+    }
+    return 0;
+  }
+
+  /* rook and queen moves, which can only be blocked by the kings */
+  for(int d = 0; d < 8; d++) {
+    int diagonal = kingDf[d] != 0 && kingDr[d] != 0;
+    if(piece == ROOK && diagonal) {
+      continue;
+    }
+    int to = step(ps, kingDf[d], kingDr[d]);
+    while(to >= 0 && to != wk && to != bk) {
+      if(getBit(bits, bitbaseIndex(STM_WEAK, wk, bk, to))) {
+	return 1;
+      }
+      to = step(to, kingDf[d], kingDr[d]);
+    }
+  }
+  return 0;
+}
+
+/* return 1 if black to move loses against best play */
+static int blackLoses(int piece, const unsigned char* bits, int wk, int bk, int ps) {
+  int moves = 0;
+  for(int d = 0; d < 8; d++) {
+    int to = step(bk, kingDf[d], kingDr[d]);
+    if(to < 0 || adjacent(to, wk)) {
+      continue;
+    }
+    if(to == ps) {
+      /* capturing the piece draws (it is protected only by the white king) */
+      return 0;
+    }
+    /* the black king no longer blocks the piece once it moves */
+    if(pieceAttacks(piece, ps, to, wk)) {
+      continue;
+    }
+    moves++;
+    if(!getBit(bits, bitbaseIndex(STM_STRONG, wk, to, ps))) {
+      return 0;
+    }
+  }
+  if(moves == 0) {
+    /* checkmate wins, stalemate draws */
+    return pieceAttacks(piece, ps, bk, wk);
+  }
+  return 1;
+}
+
+/*
+ * fill bits (BB_BYTES, zeroed) with the bitbase for piece
+ * queenBits is the finished KQK bitbase, needed for KPK promotions
+ */
+void generateBitbase(int piece, unsigned char* bits, const unsigned char* queenBits) {
+  int changed = 1;
+  int passes = 0;
+  while(changed) {
+    changed = 0;
+    for(int stm = STM_STRONG; stm <= STM_WEAK; stm++) {
+      for(int wk = 0; wk < 64; wk++) {
+	for(int bk = 0; bk < 64; bk++) {
+	  for(int ps = 0; ps < 64; ps++) {
+	    int idx = bitbaseIndex(stm, wk, bk, ps);
+	    if(getBit(bits, idx) || !legalPosition(piece, stm, wk, bk, ps)) {
+	      continue;
+	    }
+	    int won = (stm == STM_STRONG) ? whiteWins(piece, bits, queenBits, wk, bk, ps) : blackLoses(piece, bits, wk, bk, ps);
+	    if(won) {
+	      setBit(bits, idx);
+	      changed = 1;
+	    }
+	  }
+	}
+      }
+    }
+    passes++;
+  }
+  printf("%s: %d passes\n", bitbaseFileName(piece), passes);
+}
+
+/* return 1 on success, 0 otherwise */
+int writeBitbase(const char* dir, int piece, const unsigned char* bits) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", dir, bitbaseFileName(piece));
+  FILE* f = fopen(path, "wb");
+  if(f == NULL) {
+    printf("could not open %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  BitbaseHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BB_MAGIC, 4);
+  h.version = BB_VERSION;
+  h.piece = piece;
+  h.entries = BB_ENTRIES;
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(bits, BB_BYTES, 1, f) == 1;
+  fclose(f);
+
+  int wins = 0;
+  for(int i = 0; i < BB_ENTRIES; i++) {
+    wins += getBit(bits, i);
+  }
+  printf("wrote %s (%d won positions)\n", path, wins);
+  return ok;
+}
+
+int main(int argc, char* argv[]) {
+  const char* dir = (argc > 1) ? argv[1] : "bitbases";
+  if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    printf("could not create %s: %s\n", dir, strerror(errno));
+    return 1;
+  }
+
+  unsigned char* queen = calloc(BB_BYTES, 1);
+  unsigned char* rook = calloc(BB_BYTES, 1);
+  unsigned char* pawn = calloc(BB_BYTES, 1);
+
+  /* KQK first, KPK promotes into it */
+  generateBitbase(QUEEN, queen, NULL);
+  generateBitbase(ROOK, rook, NULL);
+  generateBitbase(PAWN, pawn, queen);
+
+  int ok = writeBitbase(dir, QUEEN, queen) && writeBitbase(dir, ROOK, rook) && writeBitbase(dir, PAWN, pawn);
+
+  free(queen);
+  free(rook);
+  free(pawn);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bitbase.h"
+#include "board.h"
+
+typedef struct Bitbase {
+  void* map; /* whole mapped file, NULL if not loaded */
+  size_t len;
+  const unsigned char* bits; /* points just past the header */
+} Bitbase;
+
+/* indexed by piece id, only PAWN, ROOK and QUEEN are used */
+static Bitbase bitbases[KING+1];
+
+int bitbaseIndex(int stm, int strongKing, int weakKing, int piece) {
+  return ((stm * 64 + strongKing) * 64 + weakKing) * 64 + piece;
+}
+
+const char* bitbaseFileName(int piece) {
+  switch(piece) {
+    case PAWN: return "kpk.bb";
+    case ROOK: return "krk.bb";
+    case QUEEN: return "kqk.bb";
+    default: return NULL;
+  }
+}
+
+/* map one bitbase file, return 1 on success, 0 otherwise */
+static int loadBitbase(const char* dir, int piece) {
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", dir, bitbaseFileName(piece));
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size != sizeof(BitbaseHeader) + BB_BYTES) {
+    close(fd);
+    return 0;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd); /* the mapping keeps the file alive */
+  if(map == MAP_FAILED) {
+    return 0;
+  }
+
+  /* reject files that were not written by this version of cantibb */
+  BitbaseHeader* h = map;
+  if(memcmp(h->magic, BB_MAGIC, 4) != 0 || h->version != BB_VERSION || h->piece != piece || h->entries != BB_ENTRIES) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  bitbases[piece].map = map;
+  bitbases[piece].len = st.st_size;
+  bitbases[piece].bits = (const unsigned char*)map + sizeof(BitbaseHeader);
+  return 1;
+}
+
+int loadBitbases(const char* dir) {
+  int pieces[3] = {PAWN, ROOK, QUEEN};
+  int loaded = 0;
+  for(int i = 0; i < 3; i++) {
+    if(bitbases[pieces[i]].map == NULL) {
+      loaded += loadBitbase(dir, pieces[i]);
+    }
+  }
+  return loaded;
+}
+
+void unloadBitbases() {
+  for(int i = 0; i <= KING; i++) {
+    if(bitbases[i].map) {
+      munmap(bitbases[i].map, bitbases[i].len);
+      bitbases[i].map = NULL;
+      bitbases[i].bits = NULL;
+    }
+  }
+}
+
+int probeBitbasePieces(int n, const int ids[], const int colors[], const int squares[], int toMove) {
+  int kings[3] = {-1, -1, -1}; /* indexed by color */
+  int piece = EMPTY, pieceSquare = -1, strong = EMPTY;
+
+  if(n < 2 || n > 3) {
+    return BB_UNKNOWN;
+  }
+  for(int i = 0; i < n; i++) {
+    if(ids[i] == KING) {
+      kings[colors[i]] = squares[i];
+    } else {
+      piece = ids[i];
+      pieceSquare = squares[i];
+      strong = colors[i];
+    }
+  }
+  if(kings[WHITE] < 0 || kings[BLACK] < 0) {
+    return BB_UNKNOWN;
+  }
+
+  /* bare kings, or a single minor piece, cannot mate */
+  if(n == 2 || piece == KNIGHT || piece == BISHOP) {
+    return BB_DRAW;
+  }
+
+  const unsigned char* bits = bitbases[piece].bits;
+  if(bits == NULL) {
+    return BB_UNKNOWN;
+  }
+
+  /* put the stronger side on white, mirroring the ranks if it is black */
+  int flip = (strong == BLACK) ? 56 : 0;
+  int weak = (strong == WHITE) ? BLACK : WHITE;
+  int stm = (toMove == strong) ? 0 : 1;
+  int idx = bitbaseIndex(stm, kings[strong] ^ flip, kings[weak] ^ flip, pieceSquare ^ flip);
+
+  if(bits[idx >> 3] & (1 << (idx & 7))) {
+    return strong;
+  }
+  return BB_DRAW;
+}
+
+int probeBitbase(Position* pos) {
+  int ids[3], colors[3], squares[3];
+  int n = 0;
+  for(int i = 0; i < 64; i++) {
+    if(pos->board[i]->color != EMPTY) {
+      if(n == 3) {
+	return BB_UNKNOWN; /* too much material */
+      }
+      ids[n] = pos->board[i]->id;
+      colors[n] = pos->board[i]->color;
+      squares[n] = i;
+      n++;
+    }
+  }
+  return probeBitbasePieces(n, ids, colors, squares, pos->toMove);
+}
@@ -0,0 +1,63 @@
+#ifndef BITBASE_H
+#define BITBASE_H
+
+#include "game.h"
+
+/*
+ * Win/draw bitbases for endgames with a lone king against king and one piece
+ * (KPK, KRK, KQK)
+ *
+ * The bitbases are generated by retrograde analysis with cantibb and are
+ * stored as one bit per position. A set bit means the side with the extra
+ * piece can force mate, a clear bit means the position is a draw (the lone
+ * king can never win these endings).
+ *
+ * Every position is stored with the stronger side as white. Positions where
+ * black is the stronger side are mirrored vertically before probing.
+ */
+
+#define BB_MAGIC "CNBB"
+#define BB_VERSION 1
+
+/* 2 sides to move * 64 strong king * 64 weak king * 64 piece squares */
+#define BB_ENTRIES (2*64*64*64)
+#define BB_BYTES (BB_ENTRIES/8)
+
+/* probe results */
+#define BB_UNKNOWN -1 /* the position is not covered by a bitbase */
+#define BB_DRAW 0
+/* WHITE (1) and BLACK (2) are returned when that side wins */
+
+typedef struct BitbaseHeader {
+  char magic[4];
+  int version;
+  int piece; /* PAWN, ROOK or QUEEN */
+  int entries; /* BB_ENTRIES */
+} BitbaseHeader;
+
+/*
+ * index of a position with the stronger side as white
+ * stm is 0 when the stronger side is to move, 1 otherwise
+ */
+int bitbaseIndex(int stm, int strongKing, int weakKing, int piece);
+
+/* file name of the bitbase for piece (e.g. "kqk.bb"), NULL if there is none */
+const char* bitbaseFileName(int piece);
+
+/*
+ * mmap every bitbase file found in dir
+ * returns the number of bitbases loaded
+ */
+int loadBitbases(const char* dir);
+void unloadBitbases();
+
+/*
+ * Probe a position given as a list of n pieces
+ * Returns BB_UNKNOWN, BB_DRAW, WHITE or BLACK (the side that wins)
+ * Bare kings and king and minor piece against king are known draws and
+ * do not need a bitbase
+ */
+int probeBitbasePieces(int n, const int ids[], const int colors[], const int squares[], int toMove);
+int probeBitbase(Position* pos);
+
+#endif
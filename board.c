@@ -350,4 +350,16 @@ void boardToBufBlack(Board board, char buf[BOARD_STRLEN]) {
   buf[BOARD_STRLEN-1] = 0;
 }
 
+void packBoard(Board board, unsigned char buf[BOARD_PACKED]) {
+  for(int i = 0; i < BOARD_PACKED; i++) {
+    unsigned char b = 0;
+    for(int k = 0; k < 2; k++) {
+      Piece* p = board[2*i+k];
+      int nibble = (p->id == EMPTY) ? 0 : p->id | (p->color == BLACK ? 8 : 0);
+      b |= nibble << (4*k);
+    }
+    buf[i] = b;
+  }
+}
+
 
@@ -27,6 +27,7 @@
 #define H 8
 
 #define BOARD_STRLEN 773
+#define BOARD_PACKED 32 /* bytes of a packed board */
 
 /*
  * The squares of the chess board are numbered from 0 to 63
@@ -116,4 +117,11 @@ char* boardStrBlack(Board board);
 void boardToBufWhite(Board board, char buf[BOARD_STRLEN]);
 void boardToBufBlack(Board board, char buf[BOARD_STRLEN]);
 
+/*
+ * Pack the board into 32 bytes, one nibble per square, square n in the low
+ * nibble of byte n/2 if n is even and the high nibble if it is odd
+ * A nibble holds the piece id, plus 8 for a black piece, and 0 if empty
+ */
+void packBoard(Board board, unsigned char buf[BOARD_PACKED]);
+
 #endif
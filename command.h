@@ -1,6 +1,42 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+/*
+ * The binary protocol
+ *
+ * A client that sends the line "binary" in the game room switches its
+ * connection to binary frames in both directions. A frame is a two byte
+ * big-endian length, a one byte tag and the payload, the length counting the
+ * tag and the payload.
+ *
+ * A client's frames are tagged with a command code, with these payloads:
+ *   C_STARTGAME	optional engine level, minutes and increment, a byte each
+ *   C_JOINPLAY	the game id, four bytes big-endian
+ *   C_JOINSPEC	the game id, four bytes big-endian
+ *   C_QUICKPLAY	optional minutes and increment, a byte each
+ *   C_MOVE	the from and to squares, a byte each
+ *   C_SENDMSG	the text
+ *   C_ANALYZE	optional byte, 0 for off
+ *   C_DELTAS	optional byte, 0 for off
+ * and none for the others.
+ *
+ * The server's frames are tagged with a payload tag. Everything the text
+ * protocol sends as text is sent as PL_MSG frames.
+ *
+ * Boards as deltas
+ *
+ * A client that sends "deltas" (C_DELTAS), in either protocol, is sent each
+ * move instead of the whole board: its sequence number, which is the number
+ * of half-moves played, and its squares. Every DELTA_CHECKPOINT half-moves,
+ * and when the game starts, the full position follows as a checkpoint with
+ * the same sequence number. A client that finds a number missing, or has no
+ * position to apply a move to, asks for the position with "board"
+ * (C_GETPOS). In the text protocol these are the lines
+ *   delta <seq> <move>
+ *   position <seq>, followed by the board
+ * and in the binary one the PL_DELTA and PL_CHECKPOINT events.
+ */
+
 /*
  * Commands for users in the Game Room
  */
@@ -8,6 +44,7 @@
 #define C_JOINPLAY 1	/* join a game as a player */
 #define C_JOINSPEC 2	/* join a game as a spectator */
 #define C_GETGAMES 3	/* get a list of ongoing games */
+#define C_QUICKPLAY 4	/* join a waiting game with a time control, or create one */
 
 /*
  * Commands for users playing in a game
@@ -23,16 +60,27 @@
  * Commands for users spectating in a game
  */
 #define C_STOPSPEC 16	/* stop spectating */
+#define C_ANALYZE 17	/* follow the live analysis */
 
 /* Commands for ALL clients */
 #define C_DISCONNECT 24
+#define C_DELTAS 25	/* get boards as deltas */
+#define C_GETPOS 26	/* get the current position, in a game */
 
 /* other user commands? */
 
 /* Payload Tags */
-#define PL_MOVE 0
-#define PL_POS 1
-#define PL_MSG 2
+#define PL_MOVE 0	/* the move just played: from and to square, a byte each */
+#define PL_POS 1	/* the side to move, then the packed board (see board.h) */
+#define PL_MSG 2	/* text */
+#define PL_MOVES 3	/* the legal moves, two bytes each */
+#define PL_DELTA 4	/* sequence number, four bytes big-endian, then the PL_MOVE payload */
+#define PL_CHECKPOINT 5	/* sequence number, four bytes big-endian, then the PL_POS payload */
+
+#define DELTA_CHECKPOINT 16 /* half-moves between the checkpoints sent with deltas */
+
+#define FRAME_HEADER 3 /* length and tag */
+#define MAX_FRAME 65535 /* longest tag and payload */
 
 #define PORT_NUMBER 31415
 #endif
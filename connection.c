@@ -0,0 +1,813 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "connection.h"
+#include "reactor.h"
+#include "command.h"
+#include "board.h"
+
+#define RING_MASK (CONN_INPUT_SIZE - 1)
+
+typedef struct ConnectionTable {
+  pthread_mutex_t mtx;
+  Connection** conns; /* by descriptor, NULL if there is none */
+  int cap;
+} ConnectionTable;
+
+static ConnectionTable table = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+static int receivedInput; /* the reactor receives the input, see useReceivedInput */
+static int highWater = CONN_HIGH_WATER;
+static int maxQueued = CONN_MAX_QUEUED;
+static OutputStats stats; /* changed atomically */
+
+static void submitReply(Connection* conn);
+
+Connection* newConnection(int fd) {
+  Connection* conn = malloc(sizeof(Connection));
+  conn->fd = fd;
+  conn->head = conn->tail = 0;
+  conn->skipping = 0;
+  conn->pending = 0;
+  conn->closed = 0;
+  conn->binary = 0;
+  conn->deltas = 0;
+  conn->blocked = 0;
+  conn->lastInput = monotonicMs();
+  initTimer(&conn->idle, NULL, fd);
+  pthread_mutex_init(&conn->inMtx, NULL);
+  conn->staged = NULL;
+  conn->stagedStart = conn->stagedLen = conn->stagedCap = 0;
+  conn->stagedEnd = 0;
+  conn->receivePaused = 0;
+  conn->textFrame = -1;
+  pthread_mutex_init(&conn->outMtx, NULL);
+  conn->out = NULL;
+  conn->outStart = conn->outLen = conn->outCap = 0;
+  conn->shut = 0;
+  conn->reply = NULL;
+  conn->replyLen = conn->replyCap = 0;
+  conn->held = NULL;
+  conn->heldLen = conn->heldCap = 0;
+
+  pthread_mutex_lock(&table.mtx);
+  if(fd >= table.cap) {
+    int cap = table.cap ? table.cap : 64;
+    while(cap <= fd) {
+      cap *= 2;
+    }
+    table.conns = realloc(table.conns, sizeof(Connection*) * cap);
+    memset(table.conns + table.cap, 0, sizeof(Connection*) * (cap - table.cap));
+    table.cap = cap;
+  }
+  table.conns[fd] = conn;
+  pthread_mutex_unlock(&table.mtx);
+  return conn;
+}
+
+Connection* connectionOf(int fd) {
+  pthread_mutex_lock(&table.mtx);
+  Connection* conn = (fd >= 0 && fd < table.cap) ? table.conns[fd] : NULL;
+  pthread_mutex_unlock(&table.mtx);
+  return conn;
+}
+
+/* drop the queue, conn->outMtx must be held */
+static void dropOutput(Connection* conn) {
+  __sync_fetch_and_sub(&stats.queued, conn->outLen);
+  conn->outStart = conn->outLen = 0;
+}
+
+/* nothing more is sent: the owner reads an end of file and closes it, conn->outMtx must be held */
+static void shutOutput(Connection* conn) {
+  conn->shut = 1;
+  dropOutput(conn);
+  shutdown(conn->fd, SHUT_RDWR);
+}
+
+/* send the queue until the socket is full, conn->outMtx must be held */
+static void drainOutput(Connection* conn) {
+  while(conn->outLen > 0) {
+    ssize_t wb = send(conn->fd, conn->out + conn->outStart, conn->outLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(wb > 0) {
+      conn->outStart += wb;
+      conn->outLen -= wb;
+      __sync_fetch_and_sub(&stats.queued, wb);
+    } else if(wb < 0 && errno == EINTR) {
+      continue;
+    } else if(wb < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      /* failed, the queue can never be sent */
+      shutOutput(conn);
+      break;
+    } else {
+      /* full */
+      break;
+    }
+  }
+  if(conn->outLen == 0) {
+    conn->outStart = 0;
+  }
+}
+
+/*
+ * look up the connection of fd and lock its output queue
+ * the connection cannot be freed until it is unlocked
+ */
+static Connection* lockOutput(int fd) {
+  pthread_mutex_lock(&table.mtx);
+  Connection* conn = (fd >= 0 && fd < table.cap) ? table.conns[fd] : NULL;
+  if(conn) {
+    pthread_mutex_lock(&conn->outMtx);
+  }
+  pthread_mutex_unlock(&table.mtx);
+  return conn;
+}
+
+void freeConnection(int fd) {
+  pthread_mutex_lock(&table.mtx);
+  Connection* conn = NULL;
+  if(fd >= 0 && fd < table.cap) {
+    conn = table.conns[fd];
+    table.conns[fd] = NULL;
+  }
+  pthread_mutex_unlock(&table.mtx);
+  if(conn == NULL) {
+    return;
+  }
+  cancelTimer(&conn->idle);
+
+  /* wait out the reactor staging input */
+  pthread_mutex_lock(&conn->inMtx);
+  pthread_mutex_unlock(&conn->inMtx);
+  pthread_mutex_destroy(&conn->inMtx);
+  free(conn->staged);
+
+  /* wait out anyone sending, and send the last of the output if it fits */
+  pthread_mutex_lock(&conn->outMtx);
+  submitReply(conn);
+  if(!conn->shut) {
+    drainOutput(conn);
+  }
+  dropOutput(conn);
+  pthread_mutex_unlock(&conn->outMtx);
+  pthread_mutex_destroy(&conn->outMtx);
+  free(conn->out);
+  free(conn->reply);
+  free(conn->held);
+  free(conn);
+}
+
+/* the length of the frame at the head of the input, which must hold two bytes */
+static unsigned int frameLength(Connection* conn) {
+  return (unsigned char)conn->in[conn->head & RING_MASK] << 8 | (unsigned char)conn->in[(conn->head + 1) & RING_MASK];
+}
+
+/* return 1 if the unhandled input holds a complete line or frame */
+static int haveCommand(Connection* conn) {
+  if(conn->binary) {
+    return conn->tail - conn->head >= 2 && conn->tail - conn->head >= 2 + frameLength(conn);
+  }
+  for(unsigned int i = conn->head; i != conn->tail; i++) {
+    if(conn->in[i & RING_MASK] == '\n') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void useReceivedInput(int on) {
+  receivedInput = on;
+}
+
+static void reserve(char** buf, int* cap, int len, int need);
+
+int receiveInput(int fd, const void* buf, int len) {
+  pthread_mutex_lock(&table.mtx);
+  Connection* conn = (fd >= 0 && fd < table.cap) ? table.conns[fd] : NULL;
+  if(conn) {
+    pthread_mutex_lock(&conn->inMtx);
+  }
+  pthread_mutex_unlock(&table.mtx);
+  if(conn == NULL) {
+    return 0;
+  }
+  if(len > 0) {
+    if(conn->stagedStart + conn->stagedLen + len > conn->stagedCap) {
+      memmove(conn->staged, conn->staged + conn->stagedStart, conn->stagedLen);
+      conn->stagedStart = 0;
+      reserve(&conn->staged, &conn->stagedCap, conn->stagedLen, len);
+    }
+    memcpy(conn->staged + conn->stagedStart + conn->stagedLen, buf, len);
+    conn->stagedLen += len;
+  } else {
+    conn->stagedEnd = 1;
+  }
+  if(conn->stagedLen >= CONN_STAGED_LIMIT) {
+    conn->receivePaused = 1;
+  }
+  int full = conn->receivePaused;
+  pthread_mutex_unlock(&conn->inMtx);
+  return full;
+}
+
+/* take staged input into msg's buffers, returning what recvmsg would without blocking */
+static ssize_t takeReceived(Connection* conn, struct msghdr* msg) {
+  pthread_mutex_lock(&conn->inMtx);
+  ssize_t taken = 0;
+  for(int i = 0; i < msg->msg_iovlen && conn->stagedLen > 0; i++) {
+    int n = msg->msg_iov[i].iov_len;
+    if(n > conn->stagedLen) {
+      n = conn->stagedLen;
+    }
+    memcpy(msg->msg_iov[i].iov_base, conn->staged + conn->stagedStart, n);
+    conn->stagedStart += n;
+    conn->stagedLen -= n;
+    taken += n;
+  }
+  if(conn->stagedLen == 0) {
+    conn->stagedStart = 0;
+  }
+  int resume = conn->receivePaused && conn->stagedLen <= CONN_STAGED_LIMIT / 2;
+  if(resume) {
+    conn->receivePaused = 0;
+  }
+  int end = conn->stagedEnd;
+  pthread_mutex_unlock(&conn->inMtx);
+  if(resume) {
+    /* not under inMtx, the reactor takes it while holding its own lock */
+    reactorReceiveMore(conn->fd);
+  }
+  if(taken == 0 && !end) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return taken;
+}
+
+int readConnection(Connection* conn) {
+  conn->pending = 0;
+  while(!conn->closed) {
+    unsigned int used = conn->tail - conn->head;
+    if(used == CONN_INPUT_SIZE) {
+      if(haveCommand(conn)) {
+	/* handle these commands first, then read the rest */
+	conn->pending = 1;
+	break;
+      }
+      /* a full buffer without a newline: nothing in it can be a command */
+      conn->head = conn->tail;
+      conn->skipping = 1;
+      used = 0;
+    }
+    /* the free space may wrap around the end of the buffer */
+    struct iovec iov[2];
+    unsigned int start = conn->tail & RING_MASK;
+    unsigned int space = CONN_INPUT_SIZE - used;
+    unsigned int first = CONN_INPUT_SIZE - start;
+    if(first > space) {
+      first = space;
+    }
+    iov[0].iov_base = conn->in + start;
+    iov[0].iov_len = first;
+    iov[1].iov_base = conn->in;
+    iov[1].iov_len = space - first;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (space > first) ? 2 : 1;
+
+    ssize_t rb = receivedInput ? takeReceived(conn, &msg) : recvmsg(conn->fd, &msg, MSG_DONTWAIT);
+    if(rb > 0) {
+      conn->tail += rb;
+      conn->lastInput = monotonicMs();
+      if(rb < space) {
+	/* the socket is drained */
+	break;
+      }
+    } else if(rb == 0) {
+      conn->closed = 1;
+    } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if(errno != EINTR) {
+      conn->closed = 1;
+    }
+  }
+  return !conn->closed;
+}
+
+int takeUnread(Connection* conn, char* buf, int max) {
+  int n = 0;
+  while(n < max && conn->head != conn->tail) {
+    buf[n++] = conn->in[conn->head++ & RING_MASK];
+  }
+  pthread_mutex_lock(&conn->inMtx);
+  int staged = conn->stagedLen < max - n ? conn->stagedLen : max - n;
+  if(staged > 0) {
+    memcpy(buf + n, conn->staged + conn->stagedStart, staged);
+    conn->stagedStart += staged;
+    conn->stagedLen -= staged;
+  }
+  pthread_mutex_unlock(&conn->inMtx);
+  return n + staged;
+}
+
+void pushInput(Connection* conn, const char* buf, int len) {
+  for(int i = 0; i < len && conn->tail - conn->head < CONN_INPUT_SIZE; i++) {
+    conn->in[conn->tail++ & RING_MASK] = buf[i];
+  }
+}
+
+/* turn the binary command frame tag, payload into the text command it stands for */
+static void decodeFrame(int tag, unsigned char* payload, int n, Command* cmd) {
+  char* line = cmd->line;
+  int sz = sizeof(cmd->line);
+  if(tag == C_STARTGAME) {
+    int wb = snprintf(line, sz, "newgame");
+    if(n >= 1 && payload[0]) {
+      wb += snprintf(line+wb, sz-wb, " bot %d", payload[0]);
+    }
+    if(n >= 3 && payload[1]) {
+      snprintf(line+wb, sz-wb, " %d+%d", payload[1], payload[2]);
+    }
+  } else if(tag == C_JOINPLAY || tag == C_JOINSPEC) {
+    const char* name = (tag == C_JOINPLAY) ? "joinplay" : "joinspec";
+    if(n >= 4) {
+      unsigned long id = (unsigned long)payload[0] << 24 | payload[1] << 16 | payload[2] << 8 | payload[3];
+      snprintf(line, sz, "%s %lu", name, id);
+    } else {
+      snprintf(line, sz, "%s", name);
+    }
+  } else if(tag == C_QUICKPLAY) {
+    if(n >= 2 && payload[0]) {
+      snprintf(line, sz, "quickplay %d+%d", payload[0], payload[1]);
+    } else {
+      snprintf(line, sz, "quickplay");
+    }
+  } else if(tag == C_GETGAMES) {
+    snprintf(line, sz, "listgames");
+  } else if(tag == C_MOVE) {
+    char from[3] = "??", to[3] = "??";
+    if(n >= 2 && valid(payload[0]) && valid(payload[1])) {
+      squareToString(from, payload[0]);
+      squareToString(to, payload[1]);
+    }
+    snprintf(line, sz, "move %.2s%.2s", from, to);
+  } else if(tag == C_GETMOVES) {
+    snprintf(line, sz, "listmoves");
+  } else if(tag == C_SENDMSG) {
+    int wb = snprintf(line, sz, "message ");
+    for(int i = 0; i < n && wb < sz - 1; i++) {
+      /* one line of text */
+      line[wb++] = (payload[i] == '\n' || payload[i] == 0) ? ' ' : payload[i];
+    }
+    line[wb] = 0;
+  } else if(tag == C_RESIGN) {
+    snprintf(line, sz, "resign");
+  } else if(tag == C_STOPSPEC || tag == C_DISCONNECT) {
+    snprintf(line, sz, "disconnect");
+  } else if(tag == C_ANALYZE) {
+    snprintf(line, sz, "analyze %s", (n >= 1 && payload[0] == 0) ? "off" : "on");
+  } else if(tag == C_DELTAS) {
+    snprintf(line, sz, "deltas %s", (n >= 1 && payload[0] == 0) ? "off" : "on");
+  } else if(tag == C_GETPOS) {
+    snprintf(line, sz, "board");
+  } else {
+    /* not a command, or one the server does not have */
+    snprintf(line, sz, "#%d", tag);
+  }
+}
+
+/* take the next complete frame of a binary connection */
+static int nextFrame(Connection* conn, Command* cmd) {
+  if(conn->tail - conn->head < 2) {
+    return 0;
+  }
+  unsigned int len = frameLength(conn);
+  if(len == 0 || len > MAX_COMMAND_LINE) {
+    /* not a frame this server sends or accepts, there is no telling where the next one starts */
+    conn->closed = 1;
+    return 0;
+  }
+  if(conn->tail - conn->head < 2 + len) {
+    /* the rest of the frame has not arrived */
+    return 0;
+  }
+  unsigned char frame[MAX_COMMAND_LINE];
+  for(unsigned int i = 0; i < len; i++) {
+    frame[i] = conn->in[(conn->head + 2 + i) & RING_MASK];
+  }
+  conn->head += 2 + len;
+
+  decodeFrame(frame[0], frame + 1, len - 1, cmd);
+  cmd->name = cmd->line;
+  char* space = strchr(cmd->line, ' ');
+  if(space) {
+    *space = 0;
+    cmd->args = space + 1;
+  } else {
+    cmd->args = cmd->line + strlen(cmd->line);
+  }
+  return 1;
+}
+
+int nextCommand(Connection* conn, Command* cmd) {
+  if(conn->binary) {
+    return nextFrame(conn, cmd);
+  }
+  while(conn->head != conn->tail) {
+    /* find the end of the line */
+    unsigned int end = conn->head;
+    while(end != conn->tail && conn->in[end & RING_MASK] != '\n') {
+      end++;
+    }
+    if(end == conn->tail) {
+      /* the rest of the line has not arrived */
+      return 0;
+    }
+    if(conn->skipping || end - conn->head >= MAX_COMMAND_LINE) {
+      /* drop a line that was too long */
+      conn->skipping = 0;
+      conn->head = end + 1;
+      continue;
+    }
+
+    int len = 0;
+    for(unsigned int i = conn->head; i != end; i++) {
+      char c = conn->in[i & RING_MASK];
+      if(c != '\r' && c != 0) {
+	cmd->line[len++] = c;
+      }
+    }
+    cmd->line[len] = 0;
+    conn->head = end + 1;
+
+    /* the command name ends at the first space */
+    cmd->name = cmd->line;
+    char* space = strchr(cmd->line, ' ');
+    if(space) {
+      *space = 0;
+      cmd->args = space + 1;
+    } else {
+      cmd->args = cmd->line + len;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+void setOutputLimits(int high, int max) {
+  if(high > 0) {
+    highWater = high;
+  }
+  if(max > 0) {
+    maxQueued = max;
+  }
+}
+
+/* grow buf to hold need more bytes after *len */
+static void reserve(char** buf, int* cap, int len, int need) {
+  if(len + need > *cap) {
+    int c = *cap ? *cap : 4096;
+    while(c < len + need) {
+      c *= 2;
+    }
+    *buf = realloc(*buf, c);
+    *cap = c;
+  }
+}
+
+/*
+ * send len bytes without blocking and queue what the socket does not take
+ * conn->outMtx must be held and the connection must not be shut
+ */
+static void queueOutput(Connection* conn, const void* buf, int len) {
+  int sent = 0;
+  if(conn->outLen == 0) {
+    /* nothing is waiting, so try the socket first */
+    ssize_t wb = send(conn->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(wb > 0) {
+      sent = wb;
+    }
+  }
+  if(sent == len) {
+    return;
+  }
+
+  int need = len - sent;
+  if(conn->outStart + conn->outLen + need > conn->outCap) {
+    /* move the unsent bytes to the front and grow if that is not enough */
+    memmove(conn->out, conn->out + conn->outStart, conn->outLen);
+    conn->outStart = 0;
+    reserve(&conn->out, &conn->outCap, conn->outLen, need);
+  }
+  memcpy(conn->out + conn->outStart + conn->outLen, (const char*)buf + sent, need);
+  conn->outLen += need;
+  __sync_fetch_and_add(&stats.queued, need);
+
+  if(conn->outLen > maxQueued) {
+    /* too far behind */
+    shutOutput(conn);
+    __sync_fetch_and_add(&stats.shut, 1);
+  }
+}
+
+static int sendOutput(int fd, const void* buf, int len, int frame) {
+  Connection* conn = lockOutput(fd);
+  if(conn == NULL) {
+    return -1;
+  }
+  if(conn->shut) {
+    pthread_mutex_unlock(&conn->outMtx);
+    return -1;
+  }
+  if(frame && conn->outLen > highWater) {
+    /* the client is behind: keep only the newest frame until it catches up */
+    if(conn->heldLen > 0) {
+      __sync_fetch_and_add(&stats.dropped, 1);
+    }
+    reserve(&conn->held, &conn->heldCap, 0, len);
+    memcpy(conn->held, buf, len);
+    conn->heldLen = len;
+    pthread_mutex_unlock(&conn->outMtx);
+    return 0;
+  }
+  queueOutput(conn, buf, len);
+  pthread_mutex_unlock(&conn->outMtx);
+  return len;
+}
+
+int sendClient(int fd, const void* buf, int len) {
+  return sendOutput(fd, buf, len, 0);
+}
+
+int sendFrame(int fd, const void* buf, int len) {
+  return sendOutput(fd, buf, len, 1);
+}
+
+void flushConnection(int fd) {
+  Connection* conn = lockOutput(fd);
+  if(conn == NULL) {
+    return;
+  }
+  if(!conn->shut) {
+    drainOutput(conn);
+    if(conn->heldLen > 0 && conn->outLen <= highWater) {
+      /* caught up, send the frame that was held back */
+      int len = conn->heldLen;
+      conn->heldLen = 0;
+      queueOutput(conn, conn->held, len);
+    }
+  }
+  int resume = conn->blocked && (conn->shut || conn->outLen <= highWater);
+  if(resume) {
+    conn->blocked = 0;
+  }
+  pthread_mutex_unlock(&conn->outMtx);
+  if(resume) {
+    /* its owner stopped taking its commands, see outputBlocked */
+    reactorResume(fd);
+  }
+}
+
+int outputBlocked(Connection* conn) {
+  pthread_mutex_lock(&conn->outMtx);
+  if(!conn->shut) {
+    /* the client may have read some since the socket was last writable */
+    drainOutput(conn);
+  }
+  /* set under the lock, so flushConnection cannot miss it */
+  conn->blocked = !conn->shut && conn->outLen > highWater;
+  int blocked = conn->blocked;
+  pthread_mutex_unlock(&conn->outMtx);
+  return blocked;
+}
+
+int outputMode(int fd) {
+  Connection* conn = lockOutput(fd);
+  if(conn == NULL) {
+    return 0;
+  }
+  int mode = (conn->outLen > highWater ? OUTPUT_BEHIND : 0) | (conn->binary ? OUTPUT_BINARY : 0)
+    | (conn->deltas ? OUTPUT_DELTAS : 0);
+  pthread_mutex_unlock(&conn->outMtx);
+  return mode;
+}
+
+void outputStats(OutputStats* out) {
+  out->queued = __sync_fetch_and_add(&stats.queued, 0);
+  out->dropped = __sync_fetch_and_add(&stats.dropped, 0);
+  out->shut = __sync_fetch_and_add(&stats.shut, 0);
+}
+
+/* write the length of the open text frame at *open into its header and close it */
+static void closeText(char* buf, int len, int* open) {
+  if(*open >= 0) {
+    int n = len - *open - 2;
+    buf[*open] = n >> 8;
+    buf[*open + 1] = n & 0xff;
+    *open = -1;
+  }
+}
+
+/*
+ * append text to buf, as PL_MSG frames if binary
+ * *open is the offset of the open text frame, which further text joins, or -1
+ */
+static void appendText(char** buf, int* len, int* cap, int* open, int binary, const char* text, int n) {
+  if(!binary) {
+    reserve(buf, cap, *len, n);
+    memcpy(*buf + *len, text, n);
+    *len += n;
+    return;
+  }
+  reserve(buf, cap, *len, n + FRAME_HEADER * (n / (MAX_FRAME - 1) + 1));
+  for(int i = 0; i < n; i++) {
+    if(text[i] == 0) {
+      /* the text protocol's terminators */
+      continue;
+    }
+    if(*open < 0) {
+      *open = *len;
+      (*buf)[*len + 2] = PL_MSG;
+      *len += FRAME_HEADER;
+    }
+    (*buf)[(*len)++] = text[i];
+    if(*len - *open - 2 == MAX_FRAME) {
+      closeText(*buf, *len, open);
+    }
+  }
+}
+
+int putFrame(char* out, int tag, const void* payload, int len) {
+  out[0] = (len + 1) >> 8;
+  out[1] = (len + 1) & 0xff;
+  out[2] = tag;
+  memcpy(out + FRAME_HEADER, payload, len);
+  return FRAME_HEADER + len;
+}
+
+char* frameText(const char* text, int n, int* len) {
+  char* buf = NULL;
+  int cap = 0, open = -1;
+  *len = 0;
+  appendText(&buf, len, &cap, &open, 1, text, n);
+  closeText(buf, *len, &open);
+  return buf;
+}
+
+void setBinary(int fd) {
+  Connection* conn = lockOutput(fd);
+  if(conn) {
+    conn->binary = 1;
+    pthread_mutex_unlock(&conn->outMtx);
+  }
+}
+
+int connectionBinary(int fd) {
+  Connection* conn = lockOutput(fd);
+  if(conn == NULL) {
+    return 0;
+  }
+  int binary = conn->binary;
+  pthread_mutex_unlock(&conn->outMtx);
+  return binary;
+}
+
+void setDeltas(int fd, int on) {
+  Connection* conn = lockOutput(fd);
+  if(conn) {
+    conn->deltas = on;
+    pthread_mutex_unlock(&conn->outMtx);
+  }
+}
+
+void respond(int fd, const void* buf, int len) {
+  Connection* conn = lockOutput(fd);
+  if(conn == NULL) {
+    return;
+  }
+  if(!conn->shut) {
+    appendText(&conn->reply, &conn->replyLen, &conn->replyCap, &conn->textFrame, conn->binary, buf, len);
+  }
+  pthread_mutex_unlock(&conn->outMtx);
+}
+
+void respondf(int fd, const char* fmt, ...) {
+  char text[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(text, sizeof(text), fmt, ap);
+  va_end(ap);
+  char* buf = text;
+  if(len >= sizeof(text)) {
+    buf = malloc(len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
+  }
+  respond(fd, buf, len);
+  if(buf != text) {
+    free(buf);
+  }
+}
+
+void respondEvent(int fd, int tag, const void* payload, int len) {
+  Connection* conn = lockOutput(fd);
+  if(conn == NULL) {
+    return;
+  }
+  if(!conn->shut && conn->binary) {
+    closeText(conn->reply, conn->replyLen, &conn->textFrame);
+    reserve(&conn->reply, &conn->replyCap, conn->replyLen, FRAME_HEADER + len);
+    conn->replyLen += putFrame(conn->reply + conn->replyLen, tag, payload, len);
+  }
+  pthread_mutex_unlock(&conn->outMtx);
+}
+
+/* send the reply, conn->outMtx must be held */
+static void submitReply(Connection* conn) {
+  closeText(conn->reply, conn->replyLen, &conn->textFrame);
+  if(conn->replyLen > 0 && !conn->shut) {
+    queueOutput(conn, conn->reply, conn->replyLen);
+  }
+  conn->replyLen = 0;
+}
+
+void submitResponse(int fd) {
+  Connection* conn = lockOutput(fd);
+  if(conn == NULL) {
+    return;
+  }
+  submitReply(conn);
+  pthread_mutex_unlock(&conn->outMtx);
+}
+
+void saveConnection(Connection* conn, Snapshot* s) {
+  putInt(s, conn->binary);
+  putInt(s, conn->deltas);
+  putInt(s, conn->skipping);
+  putInt(s, conn->lastInput);
+  /* left as it is, in case the restart fails */
+  char in[CONN_INPUT_SIZE];
+  int n = 0;
+  for(unsigned int i = conn->head; i != conn->tail; i++) {
+    in[n++] = conn->in[i & RING_MASK];
+  }
+  putBytes(s, in, n);
+  pthread_mutex_lock(&conn->inMtx);
+  putBytes(s, conn->staged + conn->stagedStart, conn->stagedLen);
+  putInt(s, conn->stagedEnd);
+  pthread_mutex_unlock(&conn->inMtx);
+  pthread_mutex_lock(&conn->outMtx);
+  putBytes(s, conn->out + conn->outStart, conn->outLen);
+  putBytes(s, conn->held, conn->heldLen);
+  pthread_mutex_unlock(&conn->outMtx);
+}
+
+Connection* restoreConnection(int fd, Snapshot* s) {
+  Connection* conn = newConnection(fd);
+  conn->binary = getInt(s);
+  conn->deltas = getInt(s);
+  conn->skipping = getInt(s);
+  conn->lastInput = getInt(s);
+  int n;
+  const char* buf = getBytes(s, &n);
+  pushInput(conn, buf, n);
+  buf = getBytes(s, &n);
+  if(receivedInput) {
+    reserve(&conn->staged, &conn->stagedCap, 0, n);
+    memcpy(conn->staged, buf, n);
+    conn->stagedLen = n;
+    conn->receivePaused = n >= CONN_STAGED_LIMIT;
+  } else {
+    pushInput(conn, buf, n);
+  }
+  conn->stagedEnd = getInt(s);
+  pthread_mutex_lock(&conn->outMtx);
+  buf = getBytes(s, &n);
+  if(n > 0) {
+    queueOutput(conn, buf, n);
+  }
+  buf = getBytes(s, &n);
+  if(n > 0 && !conn->shut) {
+    reserve(&conn->held, &conn->heldCap, 0, n);
+    memcpy(conn->held, buf, n);
+    conn->heldLen = n;
+  }
+  pthread_mutex_unlock(&conn->outMtx);
+  return conn;
+}
+
+void forEachConnection(void (*fn)(Connection* conn, void* data), void* data) {
+  for(int fd = 0; fd < table.cap; fd++) {
+    if(table.conns[fd]) {
+      fn(table.conns[fd], data);
+    }
+  }
+}
@@ -0,0 +1,218 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+/*
+ * Per-connection state of the server's clients
+ *
+ * Each client descriptor has a Connection holding the input read from it
+ * but not handled yet. Input is read in large chunks into a ring buffer and
+ * cut into complete lines by nextCommand, so a handler never reads the
+ * socket itself and a client may send several commands at once.
+ *
+ * A connection's input is only used by whoever owns its descriptor in the
+ * reactor (the hub room or the worker serving its game).
+ *
+ * When the reactor uses io_uring (see reactor.h) the owner does not read the
+ * socket: the reactor hands what it received to receiveInput, which stages
+ * it on the connection, and readConnection takes the staged input as it
+ * would read the socket. Once more than CONN_STAGED_LIMIT is staged the
+ * reactor stops receiving, and readConnection has it receive again once the
+ * owner has taken half of it.
+ *
+ * No handler ever waits on a client. The owner runs a connection's commands
+ * until it has to stop, and it picks up where it stopped when the reactor
+ * posts the descriptor again: a command that has not fully arrived stays in
+ * the buffer until the rest does, and a client more than the high-water mark
+ * behind on its output gets no more commands run (outputBlocked) until
+ * flushConnection has sent enough of it, which posts the descriptor to its
+ * owner again. So a client that sends slowly, or does not read its replies,
+ * only holds up itself, and a few threads can serve any number of them.
+ *
+ * Output to a client never blocks. sendClient writes what the socket takes
+ * and queues the rest on the connection, and the queue is flushed by the
+ * reactor when the socket becomes writable again, so a slow client only
+ * slows itself. Above the high-water mark, frames sent with sendFrame (the
+ * boards and analysis sent to spectators, which the next frame replaces) are
+ * held back, only the newest one is kept, and it is sent once the client has
+ * caught up. A client whose queue grows past the output limit is shut down
+ * and leaves as if it had disconnected.
+ *
+ * A command handler does not send its reply piece by piece. It appends the
+ * pieces with respond and respondf to a reply buffer kept on
+ * the connection, and whoever runs the command submits the whole reply with
+ * one send once the command is done. A reply not yet submitted when the
+ * connection is freed is sent then.
+ *
+ * A connection speaks the text protocol until the client asks for the binary
+ * one (see command.h). From then on its input is cut into frames instead of
+ * lines, each decoded into the Command its text form would be, and the text
+ * its replies are built from is sent as PL_MSG frames, so the handlers serve
+ * both protocols alike. respondEvent adds the binary events, which a text
+ * client does not get.
+ */
+
+#include <pthread.h>
+#include "timer.h"
+#include "restart.h"
+
+#define CONN_INPUT_SIZE 4096 /* bytes of unhandled input kept, a power of two */
+#define MAX_COMMAND_LINE 512 /* longer lines are dropped */
+#define CONN_HIGH_WATER (64*1024) /* queued bytes above which frames are dropped */
+#define CONN_MAX_QUEUED (1024*1024) /* queued bytes above which a client is disconnected */
+#define CONN_STAGED_LIMIT (4*CONN_INPUT_SIZE) /* received bytes staged before receiving stops */
+
+typedef struct Connection {
+  int fd;
+  char in[CONN_INPUT_SIZE]; /* ring buffer of input */
+  unsigned int head; /* next byte to handle */
+  unsigned int tail; /* where the next read goes, head == tail when empty */
+  int skipping; /* dropping the rest of a line that was too long */
+  int pending; /* readConnection stopped at a full buffer, more input may be waiting */
+  int closed; /* the client has closed its side, the connection failed or it broke the protocol */
+  int binary; /* speaks the binary protocol */
+  int deltas; /* gets boards as deltas (see command.h) */
+  int blocked; /* its commands wait for its output to drain, protected by outMtx */
+  long long lastInput; /* when the client last sent anything, see monotonicMs */
+  Timer idle; /* armed by the hub room while the client is in it, cancelled when freed */
+  pthread_mutex_t inMtx; /* protects the staged input, which the reactor adds to */
+  char* staged; /* input received by the reactor and not read yet */
+  int stagedStart;
+  int stagedLen;
+  int stagedCap;
+  int stagedEnd; /* the reactor received the end of the input */
+  int receivePaused; /* the reactor was told the connection is full */
+  pthread_mutex_t outMtx; /* protects the output queue, which any thread may send to */
+  char* out; /* output the socket has not taken yet */
+  int outStart; /* first unsent byte in out */
+  int outLen; /* unsent bytes */
+  int outCap;
+  int shut; /* shut down for falling too far behind */
+  char* reply; /* the reply being built, also protected by outMtx */
+  int replyLen;
+  int replyCap;
+  int textFrame; /* offset in reply of the PL_MSG frame text is added to, -1 if none */
+  char* held; /* the newest frame held back while the client is behind */
+  int heldLen;
+  int heldCap;
+} Connection;
+
+/* counters of the output queues of all connections */
+typedef struct OutputStats {
+  long queued; /* bytes waiting in output queues */
+  long dropped; /* frames superseded while held back above the high-water mark */
+  long shut; /* clients disconnected for reaching the output limit */
+} OutputStats;
+
+/* one line sent by a client: the command name and the rest of the line */
+typedef struct Command {
+  char line[MAX_COMMAND_LINE];
+  char* name;
+  char* args; /* "" if there are none */
+} Command;
+
+/* create and look up the connection of fd */
+Connection* newConnection(int fd);
+Connection* connectionOf(int fd);
+/* call this before closing fd */
+void freeConnection(int fd);
+
+/* switch fd to the binary protocol */
+void setBinary(int fd);
+int connectionBinary(int fd);
+/* have fd get boards as deltas, or as full boards again */
+void setDeltas(int fd, int on);
+
+/* have readConnection take the input the reactor receives, see receiveInput */
+void useReceivedInput(int on);
+
+/* the reactor's ReceiveFunc: stage what it received for fd, return 1 if the connection is full */
+int receiveInput(int fd, const void* buf, int len);
+
+/*
+ * read everything the client has sent so far without blocking, or until the
+ * buffer is full, in which case pending is set and the caller should take
+ * the commands and read again
+ * return 0 once the client has closed the connection, 1 otherwise
+ */
+int readConnection(Connection* conn);
+
+/* take the next complete line or frame, return 0 if there is none */
+int nextCommand(Connection* conn, Command* cmd);
+
+/*
+ * take up to max bytes of the input read or received and not handled yet,
+ * return how many were taken, for handing the client to another process
+ */
+int takeUnread(Connection* conn, char* buf, int max);
+/* add input, as if it had been read, as far as it fits */
+void pushInput(Connection* conn, const char* buf, int len);
+
+/*
+ * for a hot restart: write the connection's protocol, when the client last
+ * sent anything, the input not handled yet and the output not sent yet, and
+ * set the connection of fd up again from that in the new process
+ * input staged beyond what the buffer holds is only kept with io_uring
+ */
+void saveConnection(Connection* conn, Snapshot* s);
+Connection* restoreConnection(int fd, Snapshot* s);
+/* call fn with every connection, only while no other thread adds or frees one */
+void forEachConnection(void (*fn)(Connection* conn, void* data), void* data);
+
+/*
+ * return 1 if more than the high-water mark is still queued for the client
+ * once the socket has taken what it can, in which case the owner stops
+ * taking its commands: the descriptor is posted to the owner again once the
+ * client has caught up
+ */
+int outputBlocked(Connection* conn);
+
+/*
+ * set the high-water mark and the output limit in bytes
+ * 0 keeps the default
+ */
+void setOutputLimits(int highWater, int maxQueued);
+
+/*
+ * send to the client of fd without blocking, queueing what the socket does
+ * not take
+ * return len, or -1 if fd has no connection or it was shut down
+ */
+int sendClient(int fd, const void* buf, int len);
+
+/*
+ * like sendClient, but if the client is already behind by more than the
+ * high-water mark the frame is held back in place of the one held before
+ * and 0 is returned
+ */
+int sendFrame(int fd, const void* buf, int len);
+
+#define OUTPUT_BEHIND 1 /* more than the high-water mark is queued */
+#define OUTPUT_BINARY 2 /* speaks the binary protocol */
+#define OUTPUT_DELTAS 4 /* gets boards as deltas */
+
+/* the OUTPUT_ flags of fd */
+int outputMode(int fd);
+
+/*
+ * send what is queued for fd, called when the socket becomes writable
+ * resumes a client whose commands were waiting for its output to drain
+ */
+void flushConnection(int fd);
+
+/* append to the reply being built for fd */
+void respond(int fd, const void* buf, int len);
+/* append formatted text, without a terminating null */
+void respondf(int fd, const char* fmt, ...);
+/* append a binary event with the tag and payload, for binary clients only */
+void respondEvent(int fd, int tag, const void* payload, int len);
+/* send the reply built for fd at once */
+void submitResponse(int fd);
+
+void outputStats(OutputStats* stats);
+
+/* write a frame to out, return its length */
+int putFrame(char* out, int tag, const void* payload, int len);
+/* text as PL_MSG frames, the caller frees the result */
+char* frameText(const char* text, int n, int* len);
+
+#endif
@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <sched.h>
+#include "directory.h"
+
+#define DIRECTORY_PAGES (DIRECTORY_MAX_SLOTS / DIRECTORY_PAGE)
+#define HEAD_SLOT(h) ((int)((h) & 0xffffffff) - 1)
+#define HEAD_COUNT(h) ((h) >> 32)
+#define MAKE_HEAD(count, slot) (((unsigned long long)(count) << 32) | (unsigned int)((slot) + 1))
+#define READ_SPINS 1000 /* a reader spins this long on a write in progress before it yields */
+#define READ_YIELDS 100 /* and yields this often before it takes the writer for dead */
+
+static DirectorySlot* slotAt(Directory* d, int slot) {
+  return &d->pages[slot >> DIRECTORY_PAGE_BITS][slot & (DIRECTORY_PAGE - 1)];
+}
+
+static int slotId(Directory* d, DirectorySlot* s, int slot) {
+  return (s->gen << DIRECTORY_SLOT_BITS) | (slot << d->shardBits) | d->shard;
+}
+
+/* the slot of an id, -1 if the id is not one of this directory's */
+static int idSlot(Directory* d, int id) {
+  if(id < 0 || (id & ((1 << d->shardBits) - 1)) != d->shard) {
+    return -1;
+  }
+  return (id & (DIRECTORY_MAX_SLOTS - 1)) >> d->shardBits;
+}
+
+/* a summary is only written by one thread at a time, between these */
+static void beginWrite(DirectorySlot* s) {
+  s->seq++;
+  __sync_synchronize();
+}
+
+static void endWrite(DirectorySlot* s) {
+  __sync_synchronize();
+  s->seq++;
+}
+
+void initDirectory(Directory* d, int limit) {
+  d->pages = calloc(DIRECTORY_PAGES, sizeof(DirectorySlot*));
+  d->cap = 0;
+  d->freeHead = 0;
+  d->len = 0;
+  d->limit = limit;
+  pthread_mutex_init(&d->growMtx, NULL);
+  d->shard = 0;
+  d->shardBits = 0;
+  d->shared = 0;
+}
+
+void freeDirectory(Directory* d) {
+  if(!d->shared) {
+    for(int i = 0; i < DIRECTORY_PAGES; i++) {
+      free(d->pages[i]);
+    }
+    free(d->pages);
+  }
+  pthread_mutex_destroy(&d->growMtx);
+}
+
+size_t sharedDirectorySize(int shardBits) {
+  int pages = DIRECTORY_PAGES >> shardBits;
+  size_t size = sizeof(Directory) + pages * sizeof(DirectorySlot*) + (size_t)pages * DIRECTORY_PAGE * sizeof(DirectorySlot);
+  /* the next one starts on a cache line */
+  return (size + 63) & ~(size_t)63;
+}
+
+void initSharedDirectory(Directory* d, int limit, int shard, int shardBits) {
+  /* the readers in other processes stop at cap, so it goes first */
+  *(volatile int*)&d->cap = 0;
+  __sync_synchronize();
+  d->freeHead = 0;
+  d->len = 0;
+  d->limit = limit;
+  pthread_mutex_init(&d->growMtx, NULL);
+  d->shard = shard;
+  d->shardBits = shardBits;
+  d->shared = 1;
+  /* every page is there from the start, the memory is only used once touched */
+  int pages = DIRECTORY_PAGES >> shardBits;
+  d->pages = (DirectorySlot**)(d + 1);
+  DirectorySlot* slots = (DirectorySlot*)(d->pages + pages);
+  for(int i = 0; i < pages; i++) {
+    d->pages[i] = slots + (size_t)i * DIRECTORY_PAGE;
+  }
+}
+
+/* push the chain of free slots from first to last onto the free list */
+static void pushFree(Directory* d, int first, int last) {
+  DirectorySlot* s = slotAt(d, last);
+  while(1) {
+    unsigned long long head = *(volatile unsigned long long*)&d->freeHead;
+    s->nextFree = HEAD_SLOT(head);
+    if(__sync_bool_compare_and_swap(&d->freeHead, head, MAKE_HEAD(HEAD_COUNT(head) + 1, first))) {
+      return;
+    }
+  }
+}
+
+/* take a free slot, -1 if there is none */
+static int popFree(Directory* d) {
+  while(1) {
+    unsigned long long head = *(volatile unsigned long long*)&d->freeHead;
+    int slot = HEAD_SLOT(head);
+    if(slot < 0) {
+      return -1;
+    }
+    /* may be stale if another thread takes the slot first, then the swap fails */
+    int next = *(volatile int*)&slotAt(d, slot)->nextFree;
+    if(__sync_bool_compare_and_swap(&d->freeHead, head, MAKE_HEAD(HEAD_COUNT(head) + 1, next))) {
+      return slot;
+    }
+  }
+}
+
+/* add a page of free slots, return 0 if the directory cannot grow */
+static int growDirectory(Directory* d) {
+  pthread_mutex_lock(&d->growMtx);
+  if(HEAD_SLOT(*(volatile unsigned long long*)&d->freeHead) >= 0) {
+    /* another thread added one meanwhile */
+    pthread_mutex_unlock(&d->growMtx);
+    return 1;
+  }
+  int cap = d->cap;
+  if(cap == DIRECTORY_MAX_SLOTS >> d->shardBits) {
+    pthread_mutex_unlock(&d->growMtx);
+    return 0;
+  }
+  if(d->shared) {
+    /* the page may hold what a process that died left, its readers see it
+       change as if it were written */
+    DirectorySlot* page = d->pages[cap >> DIRECTORY_PAGE_BITS];
+    for(int i = 0; i < DIRECTORY_PAGE; i++) {
+      page[i].seq |= 1;
+      __sync_synchronize();
+      page[i].item = NULL;
+      page[i].gen = (page[i].gen + 1) & DIRECTORY_GEN_MASK;
+      page[i].nextFree = cap + i + 1;
+      page[i].summary.id = -1;
+      __sync_synchronize();
+      page[i].seq++;
+    }
+  } else {
+    DirectorySlot* page = malloc(sizeof(DirectorySlot) * DIRECTORY_PAGE);
+    for(int i = 0; i < DIRECTORY_PAGE; i++) {
+      page[i].item = NULL;
+      page[i].gen = 0;
+      page[i].nextFree = cap + i + 1;
+      page[i].seq = 0;
+      page[i].summary.id = -1;
+    }
+    d->pages[cap >> DIRECTORY_PAGE_BITS] = page;
+  }
+  /* readers see the page before they see the slots in it */
+  __sync_synchronize();
+  *(volatile int*)&d->cap = cap + DIRECTORY_PAGE;
+  pushFree(d, cap, cap + DIRECTORY_PAGE - 1);
+  pthread_mutex_unlock(&d->growMtx);
+  return 1;
+}
+
+int directoryAdd(Directory* d, void* item) {
+  if(__sync_add_and_fetch(&d->len, 1) > d->limit && d->limit > 0) {
+    __sync_sub_and_fetch(&d->len, 1);
+    return -1;
+  }
+  int slot;
+  while((slot = popFree(d)) < 0) {
+    if(!growDirectory(d)) {
+      __sync_sub_and_fetch(&d->len, 1);
+      return -1;
+    }
+  }
+  DirectorySlot* s = slotAt(d, slot);
+  int id = slotId(d, s, slot);
+  beginWrite(s);
+  s->item = item;
+  s->summary.id = id;
+  s->summary.status = s->summary.players = s->summary.spectators = s->summary.bot = 0;
+  endWrite(s);
+  return id;
+}
+
+void* directoryGet(Directory* d, int id) {
+  int slot = idSlot(d, id);
+  if(slot < 0 || slot >= directorySlots(d)) {
+    return NULL;
+  }
+  DirectorySlot* s = slotAt(d, slot);
+  if(slotId(d, s, slot) != id) {
+    return NULL;
+  }
+  return s->item;
+}
+
+void* directoryRemove(Directory* d, int id) {
+  void* item = directoryGet(d, id);
+  if(item == NULL) {
+    return NULL;
+  }
+  int slot = idSlot(d, id);
+  DirectorySlot* s = slotAt(d, slot);
+  beginWrite(s);
+  s->item = NULL;
+  s->summary.id = -1;
+  /* ids of the removed entry are stale from now on */
+  s->gen = (s->gen + 1) & DIRECTORY_GEN_MASK;
+  endWrite(s);
+  pushFree(d, slot, slot);
+  __sync_sub_and_fetch(&d->len, 1);
+  return item;
+}
+
+void publishSummary(Directory* d, int id, const GameSummary* summary) {
+  if(directoryGet(d, id) == NULL) {
+    return;
+  }
+  DirectorySlot* s = slotAt(d, idSlot(d, id));
+  beginWrite(s);
+  s->summary = *summary;
+  s->summary.id = id;
+  endWrite(s);
+}
+
+int directorySlots(Directory* d) {
+  int cap = *(volatile int*)&d->cap;
+  __sync_synchronize();
+  return cap;
+}
+
+int readSummary(Directory* d, int slot, GameSummary* summary) {
+  DirectorySlot* s = slotAt(d, slot);
+  unsigned int seq;
+  int waited = 0;
+  do {
+    /* wait out a write in progress, it is only a few stores */
+    while((seq = *(volatile unsigned int*)&s->seq) & 1) {
+      if(++waited % READ_SPINS == 0) {
+	if(waited == READ_SPINS * READ_YIELDS) {
+	  /* a shard that died in the middle of a write, until it is restarted */
+	  return 0;
+	}
+	sched_yield();
+      }
+    }
+    __sync_synchronize();
+    *summary = s->summary;
+    __sync_synchronize();
+  } while(*(volatile unsigned int*)&s->seq != seq);
+  return summary->id >= 0;
+}
+
+int findSummary(Directory* d, int id, GameSummary* summary) {
+  /* the directory may be another process's, so only the summary is read */
+  int slot = idSlot(d, id);
+  if(slot < 0 || slot >= directorySlots(d)) {
+    return 0;
+  }
+  return readSummary(d, slot, summary) && summary->id == id;
+}
+
+int* directoryGenerations(Directory* d) {
+  int slots = directorySlots(d);
+  int* gens = malloc(sizeof(int) * (slots + 1));
+  for(int i = 0; i < slots; i++) {
+    gens[i] = slotAt(d, i)->gen;
+  }
+  return gens;
+}
+
+void restoreDirectory(Directory* d, const int* gens, int slots, void** items, const int* ids, int n) {
+  if(slots > DIRECTORY_MAX_SLOTS) {
+    slots = DIRECTORY_MAX_SLOTS;
+  }
+  int pages = (slots + DIRECTORY_PAGE - 1) >> DIRECTORY_PAGE_BITS;
+  for(int p = 0; p < pages; p++) {
+    DirectorySlot* page = malloc(sizeof(DirectorySlot) * DIRECTORY_PAGE);
+    for(int i = 0; i < DIRECTORY_PAGE; i++) {
+      int slot = (p << DIRECTORY_PAGE_BITS) + i;
+      page[i].item = NULL;
+      /* so the ids handed out before are not handed out again */
+      page[i].gen = slot < slots ? gens[slot] & DIRECTORY_GEN_MASK : 0;
+      page[i].seq = 0;
+      page[i].summary.id = -1;
+    }
+    d->pages[p] = page;
+  }
+  d->cap = pages * DIRECTORY_PAGE;
+  for(int k = 0; k < n; k++) {
+    int slot = idSlot(d, ids[k]);
+    if(slot < 0 || slot >= d->cap) {
+      continue;
+    }
+    DirectorySlot* s = slotAt(d, slot);
+    s->gen = ids[k] >> DIRECTORY_SLOT_BITS;
+    s->item = items[k];
+    s->summary.id = ids[k];
+    s->summary.status = s->summary.players = s->summary.spectators = s->summary.bot = 0;
+    d->len++;
+  }
+  /* pushed from the top, so the lowest free slot is taken first as before */
+  for(int slot = d->cap - 1; slot >= 0; slot--) {
+    if(slotAt(d, slot)->item == NULL) {
+      pushFree(d, slot, slot);
+    }
+  }
+}
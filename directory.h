@@ -0,0 +1,119 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <pthread.h>
+
+/*
+ * The directory of the server's games, read by the lobby without locks
+ *
+ * The directory hands out slots from a free list, and the id of a game
+ * carries its slot and the slot's generation, which changes each time the
+ * slot is freed: an id kept after its game was removed never finds the game
+ * that reuses the slot. Slots are taken and freed with a compare-and-swap on
+ * the head of the free list, and they live in pages that are added as
+ * needed and never moved or freed, so a reader can visit them while the
+ * directory grows.
+ *
+ * Each slot holds a summary of its game behind a seqlock. The game writes it
+ * whenever what the lobby sees changes, and a reader copies it and tries
+ * again if it changed meanwhile. Listing the games or looking for one to
+ * join never takes a game's lock and never waits for a move.
+ *
+ * A game's summary is only written by whoever holds the game's lock, and a
+ * game is only added and removed while no one else can reach it, so each
+ * slot has one writer at a time.
+ *
+ * When the server runs as several processes (see shard.h) each one's
+ * directory lives in memory they all map at the same address, set up with
+ * initSharedDirectory. Its pages are laid out in advance, so another process
+ * can read the summaries the same way, and the low bits of each id are the
+ * number of the process that owns the game.
+ */
+
+#define DIRECTORY_SLOT_BITS 20
+#define DIRECTORY_MAX_SLOTS (1 << DIRECTORY_SLOT_BITS)
+#define DIRECTORY_GEN_MASK ((1 << (31 - DIRECTORY_SLOT_BITS)) - 1)
+#define DIRECTORY_PAGE_BITS 8
+#define DIRECTORY_PAGE (1 << DIRECTORY_PAGE_BITS) /* slots added at a time */
+
+/* what the lobby sees of a game */
+typedef struct GameSummary {
+  int id; /* -1 if the slot is free */
+  int status;
+  int players;
+  int spectators;
+  int bot; /* level of the engine in the second seat, 0 if none */
+} GameSummary;
+
+typedef struct DirectorySlot {
+  void* item; /* NULL if the slot is free */
+  int gen; /* generation of the slot */
+  int nextFree; /* the next slot on the free list, -1 if none */
+  unsigned int seq; /* odd while the summary is being written */
+  GameSummary summary;
+} DirectorySlot;
+
+typedef struct Directory {
+  DirectorySlot** pages; /* NULL until the page is added, unless shared */
+  int cap; /* slots in the pages added so far */
+  /* the first free slot plus one in the low half, 0 if none, and a count of
+     the changes in the high half so a stale compare-and-swap fails */
+  unsigned long long freeHead;
+  int len; /* slots in use */
+  int limit; /* most games at once, 0 for no limit */
+  pthread_mutex_t growMtx; /* only taken to add a page */
+  int shard; /* the low bits of the ids */
+  int shardBits; /* how many there are */
+  int shared; /* the pages follow the directory in shared memory */
+} Directory;
+
+void initDirectory(Directory* d, int limit);
+void freeDirectory(Directory* d);
+
+/* bytes to keep for a shared directory, which is followed by its pages */
+size_t sharedDirectorySize(int shardBits);
+/*
+ * set up the directory of shard in the sharedDirectorySize bytes at d, or
+ * set it up again after the process that had it died, keeping the slots'
+ * generations so the ids it handed out are not handed out again
+ */
+void initSharedDirectory(Directory* d, int limit, int shard, int shardBits);
+
+/*
+ * add item (not NULL), return its id or -1 if the directory is full
+ * the summary is empty apart from the id until it is published
+ */
+int directoryAdd(Directory* d, void* item);
+
+/* the item with id, NULL if there is none, only while no one can remove it */
+void* directoryGet(Directory* d, int id);
+
+/* remove the item with id and return it, NULL if there is none */
+void* directoryRemove(Directory* d, int id);
+
+/* replace the summary of the item with id */
+void publishSummary(Directory* d, int id, const GameSummary* summary);
+
+/* to read every summary, for slot from 0 to directorySlots: */
+int directorySlots(Directory* d);
+/*
+ * copy the summary in slot, return 0 if the slot is free, or if it is
+ * another process's and that process stopped in the middle of writing it
+ */
+int readSummary(Directory* d, int slot, GameSummary* summary);
+/* copy the summary of the game with id, return 0 if there is none */
+int findSummary(Directory* d, int id, GameSummary* summary);
+
+/*
+ * for a hot restart: the generation of each slot, directorySlots of them,
+ * which the caller frees
+ */
+int* directoryGenerations(Directory* d);
+/*
+ * set up a new directory that is not shared as the one the generations of
+ * slots slots were taken from, holding the n items with the ids they had
+ * there, before anyone else uses it
+ */
+void restoreDirectory(Directory* d, const int* gens, int slots, void** items, const int* ids, int n);
+
+#endif
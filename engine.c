@@ -0,0 +1,781 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "engine.h"
+#include "bitbase.h"
+#include "board.h"
+
+#define INF 32000
+#define BB_WIN_SCORE 20000 /* below any mate score */
+#define MAX_MOVES 256
+
+#define MOVE_OVERHEAD 50 /* milliseconds kept back for network latency */
+#define STABLE_ITERATIONS 3 /* iterations with the same best move to stop early */
+
+/* TT entry bounds */
+#define TT_EXACT 0
+#define TT_LOWER 1
+#define TT_UPPER 2
+
+typedef struct TTEntry {
+  unsigned long long key;
+  short score;
+  unsigned char depth;
+  unsigned char flag;
+  unsigned char from;
+  unsigned char to;
+} TTEntry;
+
+struct TransTable {
+  TTEntry* entries;
+  unsigned long mask;
+};
+
+typedef struct EMove {
+  unsigned char from;
+  unsigned char to;
+  int score; /* ordering score */
+} EMove;
+
+typedef struct Undo {
+  unsigned char moved;
+  unsigned char captured;
+  unsigned long long hash;
+} Undo;
+
+typedef struct Search {
+  EngineBoard* b;
+  TransTable* tt;
+  SearchLimits* limits;
+  SearchSignals* signals;
+  long nodes;
+  long long start;
+  int mayAbort; /* limits only apply once depth 1 is complete */
+  int pondered; /* the search started as a ponder search */
+  int aborted;
+} Search;
+
+/*
+ * Precomputed move tables, filled once by initTables
+ * rays are listed N, E, S, W, NE, SE, SW, NW and end with -1
+ */
+static int knightTargets[64][9];
+static int kingTargets[64][9];
+static int rays[64][8][8];
+static unsigned long long zobrist[23][64];
+static unsigned long long zobristSide;
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static const int pieceValue[7] = {0, 100, 320, 330, 500, 900, 0};
+
+static int offBoard(int f, int r) {
+  return f < 0 || f > 7 || r < 0 || r > 7;
+}
+
+static unsigned long long nextRandom(unsigned long long* s) {
+  /* xorshift64, with a fixed seed so hashes are reproducible */
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+static void initTables() {
+  int kdf[8] = {1, 2, 2, 1, -1, -2, -2, -1};
+  int kdr[8] = {2, 1, -1, -2, -2, -1, 1, 2};
+  int df[8] = {0, 1, 0, -1, 1, 1, -1, -1};
+  int dr[8] = {1, 0, -1, 0, 1, -1, -1, 1};
+  for(int sq = 0; sq < 64; sq++) {
+    int f = sq % 8, r = sq / 8;
+    int nk = 0, nq = 0;
+    for(int d = 0; d < 8; d++) {
+      if(!offBoard(f + kdf[d], r + kdr[d])) {
+	knightTargets[sq][nk++] = (r + kdr[d]) * 8 + f + kdf[d];
+      }
+      if(!offBoard(f + df[d], r + dr[d])) {
+	kingTargets[sq][nq++] = (r + dr[d]) * 8 + f + df[d];
+      }
+      int n = 0;
+      for(int s = 1; !offBoard(f + s*df[d], r + s*dr[d]); s++) {
+	rays[sq][d][n++] = (r + s*dr[d]) * 8 + f + s*df[d];
+      }
+      rays[sq][d][n] = -1;
+    }
+    knightTargets[sq][nk] = -1;
+    kingTargets[sq][nq] = -1;
+  }
+
+  unsigned long long seed = 0x9e3779b97f4a7c15ULL;
+  for(int p = 0; p < 23; p++) {
+    for(int sq = 0; sq < 64; sq++) {
+      zobrist[p][sq] = nextRandom(&seed);
+    }
+  }
+  zobristSide = nextRandom(&seed);
+}
+
+long long nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TransTable* newTransTable(int bits) {
+  pthread_once(&tablesOnce, initTables);
+  TransTable* tt = malloc(sizeof(TransTable));
+  tt->entries = calloc(1UL << bits, sizeof(TTEntry));
+  tt->mask = (1UL << bits) - 1;
+  return tt;
+}
+
+void freeTransTable(TransTable* tt) {
+  free(tt->entries);
+  free(tt);
+}
+
+void clearTransTable(TransTable* tt) {
+  memset(tt->entries, 0, (tt->mask + 1) * sizeof(TTEntry));
+}
+
+void boardFromPosition(EngineBoard* b, Position* pos) {
+  pthread_once(&tablesOnce, initTables);
+  b->toMove = pos->toMove;
+  b->pieces = 0;
+  b->hash = (pos->toMove == BLACK) ? zobristSide : 0;
+  b->kings[WHITE] = b->kings[BLACK] = -1;
+  for(int i = 0; i < 64; i++) {
+    Piece* p = pos->board[i];
+    b->sq[i] = (p->color == EMPTY) ? 0 : EPIECE(p->id, p->color);
+    if(b->sq[i]) {
+      b->pieces++;
+      b->hash ^= zobrist[b->sq[i]][i];
+      if(p->id == KING) {
+	b->kings[p->color] = i;
+      }
+    }
+  }
+}
+
+/* return 1 if square sq is attacked by a piece of color by */
+static int attacked(EngineBoard* b, int sq, int by) {
+  int f = sq % 8;
+  int pawn = EPIECE(PAWN, by);
+  if(by == WHITE) {
+    if(f > 0 && sq >= 9 && b->sq[sq-9] == pawn) return 1;
+    if(f < 7 && sq >= 7 && b->sq[sq-7] == pawn) return 1;
+  } else {
+    if(f < 7 && sq <= 54 && b->sq[sq+9] == pawn) return 1;
+    if(f > 0 && sq <= 56 && b->sq[sq+7] == pawn) return 1;
+  }
+
+  for(int i = 0; knightTargets[sq][i] >= 0; i++) {
+    if(b->sq[knightTargets[sq][i]] == EPIECE(KNIGHT, by)) return 1;
+  }
+  for(int i = 0; kingTargets[sq][i] >= 0; i++) {
+    if(b->sq[kingTargets[sq][i]] == EPIECE(KING, by)) return 1;
+  }
+
+  for(int d = 0; d < 8; d++) {
+    int slider = (d < 4) ? ROOK : BISHOP;
+    for(int i = 0; rays[sq][d][i] >= 0; i++) {
+      int p = b->sq[rays[sq][d][i]];
+      if(p) {
+	if(ECOLOR(p) == by && (EID(p) == slider || EID(p) == QUEEN)) return 1;
+	break;
+      }
+    }
+  }
+  return 0;
+}
+
+static int inCheckSide(EngineBoard* b, int color) {
+  return attacked(b, b->kings[color], (color == WHITE) ? BLACK : WHITE);
+}
+
+static void addMove(EMove* list, int* n, int from, int to) {
+  list[*n].from = from;
+  list[*n].to = to;
+  list[*n].score = 0;
+  (*n)++;
+}
+
+/*
+ * generate pseudo-legal moves for the side to move
+ * only captures and promotions if capturesOnly is set
+ * returns the number of moves
+ */
+static int genMoves(EngineBoard* b, EMove* list, int capturesOnly) {
+  int n = 0;
+  int us = b->toMove;
+  for(int from = 0; from < 64; from++) {
+    int p = b->sq[from];
+    if(!p || ECOLOR(p) != us) {
+      continue;
+    }
+    int id = EID(p);
+    if(id == PAWN) {
+      int dir = (us == WHITE) ? 8 : -8;
+      int to = from + dir;
+      int f = from % 8;
+      int promo = to >= 56 || to < 8;
+      if(!b->sq[to] && (!capturesOnly || promo)) {
+	addMove(list, &n, from, to);
+	int start = (us == WHITE) ? (from < 16) : (from >= 48);
+	if(start && !b->sq[to + dir] && !capturesOnly) {
+	  addMove(list, &n, from, to + dir);
+	}
+      }
+      if(f > 0 && b->sq[to-1] && ECOLOR(b->sq[to-1]) != us) {
+	addMove(list, &n, from, to - 1);
+      }
+      if(f < 7 && b->sq[to+1] && ECOLOR(b->sq[to+1]) != us) {
+	addMove(list, &n, from, to + 1);
+      }
+    } else if(id == KNIGHT || id == KING) {
+      int* targets = (id == KNIGHT) ? knightTargets[from] : kingTargets[from];
+      for(int i = 0; targets[i] >= 0; i++) {
+	int q = b->sq[targets[i]];
+	if(q ? ECOLOR(q) != us : !capturesOnly) {
+	  addMove(list, &n, from, targets[i]);
+	}
+      }
+    } else {
+      int first = (id == BISHOP) ? 4 : 0;
+      int last = (id == ROOK) ? 4 : 8;
+      for(int d = first; d < last; d++) {
+	for(int i = 0; rays[from][d][i] >= 0; i++) {
+	  int to = rays[from][d][i];
+	  int q = b->sq[to];
+	  if(q) {
+	    if(ECOLOR(q) != us) {
+	      addMove(list, &n, from, to);
+	    }
+	    break;
+	  }
+	  if(!capturesOnly) {
+	    addMove(list, &n, from, to);
+	  }
+	}
+      }
+    }
+  }
+  return n;
+}
+
+static void makeMove(EngineBoard* b, int from, int to, Undo* u) {
+  int moved = b->sq[from];
+  int captured = b->sq[to];
+  int placed = moved;
+  u->moved = moved;
+  u->captured = captured;
+  u->hash = b->hash;
+
+  /* pawns always promote to queens */
+  if(EID(moved) == PAWN && (to >= 56 || to < 8)) {
+    placed = EPIECE(QUEEN, ECOLOR(moved));
+  }
+  if(captured) {
+    b->hash ^= zobrist[captured][to];
+    b->pieces--;
+  }
+  b->hash ^= zobrist[moved][from] ^ zobrist[placed][to] ^ zobristSide;
+  b->sq[to] = placed;
+  b->sq[from] = 0;
+  if(EID(moved) == KING) {
+    b->kings[ECOLOR(moved)] = to;
+  }
+  b->toMove = (b->toMove == WHITE) ? BLACK : WHITE;
+}
+
+static void unmakeMove(EngineBoard* b, int from, int to, Undo* u) {
+  b->sq[from] = u->moved;
+  b->sq[to] = u->captured;
+  if(u->captured) {
+    b->pieces++;
+  }
+  if(EID(u->moved) == KING) {
+    b->kings[ECOLOR(u->moved)] = from;
+  }
+  b->hash = u->hash;
+  b->toMove = (b->toMove == WHITE) ? BLACK : WHITE;
+}
+
+/* distance from the centre, 0 for the four central squares up to 6 in the corners */
+static int centreDistance(int sq) {
+  int f = sq % 8, r = sq / 8;
+  int df = (f < 4) ? 3 - f : f - 4;
+  int dr = (r < 4) ? 3 - r : r - 4;
+  return df + dr;
+}
+
+int evaluate(EngineBoard* b) {
+  int score[3] = {0, 0, 0};
+  int material = 0; /* non-pawn material of both sides, for the king */
+  for(int sq = 0; sq < 64; sq++) {
+    int p = b->sq[sq];
+    if(p && EID(p) != PAWN && EID(p) != KING) {
+      material += pieceValue[EID(p)];
+    }
+  }
+  int endgame = material <= 1300;
+
+  for(int sq = 0; sq < 64; sq++) {
+    int p = b->sq[sq];
+    if(!p) {
+      continue;
+    }
+    int color = ECOLOR(p);
+    int centre = 6 - centreDistance(sq);
+    int advance = (color == WHITE) ? sq / 8 - 1 : 6 - sq / 8;
+    int s = pieceValue[EID(p)];
+    switch(EID(p)) {
+      case PAWN: s += advance * (endgame ? 12 : 4) + ((sq % 8 == 3 || sq % 8 == 4) ? advance * 6 : 0); break;
+      case KNIGHT: s += centre * 5 - 10; break;
+      case BISHOP: s += centre * 3; break;
+      case ROOK: s += (advance == 5) ? 15 : 0; break;
+      case QUEEN: s += centre; break;
+      case KING: s += endgame ? centre * 6 : -centre * 4; break;
+    }
+    score[color] += s;
+  }
+  int us = b->toMove, them = (us == WHITE) ? BLACK : WHITE;
+  return score[us] - score[them];
+}
+
+static long softLimit(SearchLimits* limits) {
+  return limits->softMs ? limits->softMs : limits->timeMs;
+}
+
+static int pondering(Search* s) {
+  return s->signals && s->signals->pondering;
+}
+
+/* return 1 if the search should stop */
+static int checkLimits(Search* s) {
+  if(s->signals && s->signals->stop) {
+    s->aborted = 1;
+  } else if(s->mayAbort) {
+    long elapsed = nowMs() - s->start;
+    if(s->limits->nodes && s->nodes >= s->limits->nodes) {
+      s->aborted = 1;
+    } else if(!pondering(s) && s->limits->timeMs && elapsed >= s->limits->timeMs) {
+      s->aborted = 1;
+    } else if(s->pondered && !pondering(s) && softLimit(s->limits) && elapsed >= softLimit(s->limits)) {
+      /* a ponder hit after pondering long enough plays at once */
+      s->aborted = 1;
+    }
+  }
+  return s->aborted;
+}
+
+/* mate scores are stored relative to the node, not the root */
+static int scoreToTT(int score, int ply) {
+  if(score > MATE_SCORE - MAX_PLY) return score + ply;
+  if(score < -MATE_SCORE + MAX_PLY) return score - ply;
+  return score;
+}
+
+static int scoreFromTT(int score, int ply) {
+  if(score > MATE_SCORE - MAX_PLY) return score - ply;
+  if(score < -MATE_SCORE + MAX_PLY) return score + ply;
+  return score;
+}
+
+static TTEntry* probeTT(TransTable* tt, unsigned long long key) {
+  TTEntry* e = &tt->entries[key & tt->mask];
+  return (e->key == key) ? e : NULL;
+}
+
+static void storeTT(TransTable* tt, unsigned long long key, int depth, int score, int flag, int from, int to) {
+  TTEntry* e = &tt->entries[key & tt->mask];
+  /* always replace, except deeper results for the same position */
+  if(e->key == key && e->depth > depth && flag != TT_EXACT) {
+    return;
+  }
+  e->key = key;
+  e->depth = depth;
+  e->score = score;
+  e->flag = flag;
+  e->from = from;
+  e->to = to;
+}
+
+/* order: hash move, then captures by most valuable victim / least valuable attacker */
+static void scoreMoves(EngineBoard* b, EMove* list, int n, TTEntry* e) {
+  for(int i = 0; i < n; i++) {
+    int victim = b->sq[list[i].to];
+    list[i].score = 0;
+    if(victim) {
+      list[i].score = 1000 + pieceValue[EID(victim)] * 10 - pieceValue[EID(b->sq[list[i].from])] / 10;
+    }
+    if(e && list[i].from == e->from && list[i].to == e->to) {
+      list[i].score = 100000;
+    }
+  }
+}
+
+/* move the best scored move remaining into position i */
+static void pickMove(EMove* list, int n, int i) {
+  int best = i;
+  for(int j = i + 1; j < n; j++) {
+    if(list[j].score > list[best].score) {
+      best = j;
+    }
+  }
+  EMove tmp = list[i];
+  list[i] = list[best];
+  list[best] = tmp;
+}
+
+/* probe the bitbases from the side to move's point of view */
+static int probeBoard(EngineBoard* b, int ply, int* score) {
+  int ids[3], colors[3], squares[3];
+  int n = 0;
+  for(int sq = 0; sq < 64 && n < 3; sq++) {
+    if(b->sq[sq]) {
+      ids[n] = EID(b->sq[sq]);
+      colors[n] = ECOLOR(b->sq[sq]);
+      squares[n] = sq;
+      n++;
+    }
+  }
+  int result = probeBitbasePieces(n, ids, colors, squares, b->toMove);
+  if(result == BB_UNKNOWN) {
+    return 0;
+  }
+  if(result == BB_DRAW) {
+    *score = 0;
+  } else {
+    *score = (result == b->toMove) ? BB_WIN_SCORE - ply : -BB_WIN_SCORE + ply;
+  }
+  return 1;
+}
+
+static int quiesce(Search* s, int alpha, int beta, int ply) {
+  EngineBoard* b = s->b;
+  s->nodes++;
+  if((s->nodes & 1023) == 0 && checkLimits(s)) {
+    return 0;
+  }
+  int standPat = evaluate(b);
+  if(standPat >= beta || ply >= MAX_PLY - 1) {
+    return standPat;
+  }
+  if(standPat > alpha) {
+    alpha = standPat;
+  }
+
+  EMove list[MAX_MOVES];
+  int n = genMoves(b, list, 1);
+  scoreMoves(b, list, n, NULL);
+  int us = b->toMove;
+  for(int i = 0; i < n; i++) {
+    pickMove(list, n, i);
+    Undo u;
+    makeMove(b, list[i].from, list[i].to, &u);
+    if(inCheckSide(b, us)) {
+      unmakeMove(b, list[i].from, list[i].to, &u);
+      continue;
+    }
+    int score = -quiesce(s, -beta, -alpha, ply + 1);
+    unmakeMove(b, list[i].from, list[i].to, &u);
+    if(s->aborted) {
+      return 0;
+    }
+    if(score >= beta) {
+      return score;
+    }
+    if(score > alpha) {
+      alpha = score;
+    }
+  }
+  return alpha;
+}
+
+static int alphaBeta(Search* s, int depth, int alpha, int beta, int ply) {
+  EngineBoard* b = s->b;
+  s->nodes++;
+  if((s->nodes & 1023) == 0 && checkLimits(s)) {
+    return 0;
+  }
+
+  int score;
+  if(ply > 0 && b->pieces <= 3 && probeBoard(b, ply, &score)) {
+    return score;
+  }
+
+  TTEntry* e = probeTT(s->tt, b->hash);
+  if(e && ply > 0 && e->depth >= depth) {
+    int ttScore = scoreFromTT(e->score, ply);
+    if(e->flag == TT_EXACT
+       || (e->flag == TT_LOWER && ttScore >= beta)
+       || (e->flag == TT_UPPER && ttScore <= alpha)) {
+      return ttScore;
+    }
+  }
+
+  int us = b->toMove;
+  int check = inCheckSide(b, us);
+  if(depth <= 0 && !check) {
+    return quiesce(s, alpha, beta, ply);
+  }
+  if(ply >= MAX_PLY - 1) {
+    return evaluate(b);
+  }
+
+  EMove list[MAX_MOVES];
+  int n = genMoves(b, list, 0);
+  scoreMoves(b, list, n, e);
+
+  int alphaStart = alpha;
+  int best = -INF, bestFrom = 0, bestTo = 0, legal = 0;
+  for(int i = 0; i < n; i++) {
+    pickMove(list, n, i);
+    Undo u;
+    makeMove(b, list[i].from, list[i].to, &u);
+    if(inCheckSide(b, us)) {
+      unmakeMove(b, list[i].from, list[i].to, &u);
+      continue;
+    }
+    legal++;
+    /* checks are extended by a ply */
+    score = -alphaBeta(s, depth - 1 + check, -beta, -alpha, ply + 1);
+    unmakeMove(b, list[i].from, list[i].to, &u);
+    if(s->aborted) {
+      return 0;
+    }
+    if(score > best) {
+      best = score;
+      bestFrom = list[i].from;
+      bestTo = list[i].to;
+    }
+    if(score > alpha) {
+      alpha = score;
+    }
+    if(alpha >= beta) {
+      break;
+    }
+  }
+
+  if(!legal) {
+    /* checkmate or stalemate */
+    return check ? -MATE_SCORE + ply : 0;
+  }
+
+  int flag = (best >= beta) ? TT_LOWER : (best > alphaStart) ? TT_EXACT : TT_UPPER;
+  storeTT(s->tt, b->hash, depth, scoreToTT(best, ply), flag, bestFrom, bestTo);
+  return best;
+}
+
+/* search the root moves to depth, return the index of the best move or -1 if aborted */
+static int searchRoot(Search* s, EMove* list, int n, int depth, int* bestScore) {
+  EngineBoard* b = s->b;
+  int alpha = -INF, bestIdx = -1;
+  for(int i = 0; i < n; i++) {
+    Undo u;
+    makeMove(b, list[i].from, list[i].to, &u);
+    int score = -alphaBeta(s, depth - 1, -INF, -alpha, 1);
+    unmakeMove(b, list[i].from, list[i].to, &u);
+    if(s->aborted) {
+      return -1;
+    }
+    if(score > alpha) {
+      alpha = score;
+      bestIdx = i;
+    }
+  }
+  *bestScore = alpha;
+  return bestIdx;
+}
+
+void applyMoveToBoard(EngineBoard* b, Move* m) {
+  Undo u;
+  makeMove(b, m->start, m->end, &u);
+}
+
+void allocateTime(long remainingMs, long incrementMs, int moveNumber, long* softMs, long* hardMs) {
+  /* assume the game lasts at least another 20 moves */
+  int movesToGo = (moveNumber < 20) ? 40 - moveNumber : 20;
+  long available = remainingMs - MOVE_OVERHEAD;
+  if(available < 10) {
+    available = 10;
+  }
+  *softMs = available / movesToGo + incrementMs * 3 / 4;
+  *hardMs = *softMs * 4;
+  /* never risk more than a third of the clock on one move */
+  if(*hardMs > available / 3) {
+    *hardMs = available / 3;
+  }
+  if(*hardMs < 5) {
+    *hardMs = 5;
+  }
+  if(*softMs > *hardMs) {
+    *softMs = *hardMs;
+  }
+}
+
+/* return 1 if from-to is a legal move on b */
+static int legalMove(EngineBoard* b, int from, int to) {
+  EMove list[MAX_MOVES];
+  int n = genMoves(b, list, 0);
+  int us = b->toMove;
+  for(int i = 0; i < n; i++) {
+    if(list[i].from == from && list[i].to == to) {
+      Undo u;
+      makeMove(b, from, to, &u);
+      int legal = !inCheckSide(b, us);
+      unmakeMove(b, from, to, &u);
+      return legal;
+    }
+  }
+  return 0;
+}
+
+/*
+ * follow the transposition table from the root move first to build a
+ * principal variation of at most PV_LENGTH moves, returns its length
+ */
+static int extractPV(EngineBoard* b, TransTable* tt, EMove* first, Move pv[PV_LENGTH]) {
+  Undo undo[PV_LENGTH];
+  int n = 0;
+  int from = first->from, to = first->to;
+  while(1) {
+    pv[n].start = from;
+    pv[n].end = to;
+    makeMove(b, from, to, &undo[n]);
+    n++;
+    if(n == PV_LENGTH) {
+      break;
+    }
+    TTEntry* e = probeTT(tt, b->hash);
+    if(!e || e->from == e->to || !legalMove(b, e->from, e->to)) {
+      break;
+    }
+    from = e->from;
+    to = e->to;
+  }
+  for(int i = n - 1; i >= 0; i--) {
+    unmakeMove(b, pv[i].start, pv[i].end, &undo[i]);
+  }
+  return n;
+}
+
+void searchBoard(EngineBoard* b, SearchLimits* limits, TransTable* tt, SearchSignals* signals, SearchResult* result) {
+  Search s;
+  s.b = b;
+  s.tt = tt;
+  s.limits = limits;
+  s.signals = signals;
+  s.nodes = 0;
+  s.start = limits->start ? limits->start : nowMs();
+  s.mayAbort = 0;
+  s.pondered = signals && signals->pondering;
+  s.aborted = 0;
+
+  result->best.start = result->best.end = -1;
+  result->ponder.start = result->ponder.end = -1;
+  result->score = 0;
+  result->depth = 0;
+  result->lines = 0;
+
+  /* keep only the legal root moves */
+  EMove list[MAX_MOVES];
+  int n = 0, us = b->toMove;
+  int total = genMoves(b, list, 0);
+  for(int i = 0; i < total; i++) {
+    Undo u;
+    makeMove(b, list[i].from, list[i].to, &u);
+    if(!inCheckSide(b, us)) {
+      list[n++] = list[i];
+    }
+    unmakeMove(b, list[i].from, list[i].to, &u);
+  }
+  if(n == 0) {
+    result->nodes = 0;
+    return;
+  }
+  scoreMoves(b, list, n, probeTT(tt, b->hash));
+  for(int i = 0; i < n; i++) {
+    pickMove(list, n, i);
+  }
+  result->best.start = list[0].from;
+  result->best.end = list[0].to;
+
+  int maxDepth = (limits->depth > 0 && limits->depth < MAX_PLY) ? limits->depth : MAX_PLY - 1;
+  int multiPV = (limits->multiPV > 1) ? limits->multiPV : 1;
+  if(multiPV > MAX_PV) {
+    multiPV = MAX_PV;
+  }
+  if(multiPV > n) {
+    multiPV = n;
+  }
+  int stable = 0;
+  for(int depth = 1; depth <= maxDepth; depth++) {
+    /*
+     * line k is the best move among the root moves not already chosen by
+     * lines 0 to k-1, which are kept at the front of the list
+     */
+    int scores[MAX_PV];
+    int firstIdx = 0, k;
+    for(k = 0; k < multiPV; k++) {
+      int idx = searchRoot(&s, list + k, n - k, depth, &scores[k]);
+      if(idx < 0) {
+	break;
+      }
+      if(k == 0) {
+	firstIdx = idx;
+      }
+      /* search this line's move first in the next iteration */
+      EMove bestMove = list[k + idx];
+      memmove(list + k + 1, list + k, idx * sizeof(EMove));
+      list[k] = bestMove;
+    }
+    if(k < multiPV) {
+      /* aborted, keep the last complete iteration */
+      break;
+    }
+    int score = scores[0];
+    stable = (depth > 1 && firstIdx == 0) ? stable + 1 : 0;
+    result->best.start = list[0].from;
+    result->best.end = list[0].to;
+    result->score = score;
+    result->depth = depth;
+    storeTT(tt, b->hash, depth, scoreToTT(score, 0), TT_EXACT, list[0].from, list[0].to);
+    result->lines = multiPV;
+    for(k = 0; k < multiPV; k++) {
+      result->pvScore[k] = scores[k];
+      result->pvLength[k] = extractPV(b, tt, &list[k], result->pv[k]);
+    }
+
+    /* stop early once a forced mate is found */
+    if(score > MATE_SCORE - MAX_PLY || score < -MATE_SCORE + MAX_PLY) {
+      break;
+    }
+    s.mayAbort = 1;
+    if(checkLimits(&s)) {
+      break;
+    }
+
+    /* time management between iterations */
+    long soft = softLimit(limits);
+    if(soft && !pondering(&s)) {
+      long elapsed = nowMs() - s.start;
+      if(elapsed >= soft) {
+	break;
+      }
+      /* a best move that survives several deeper searches is trusted early */
+      if(stable >= STABLE_ITERATIONS && elapsed >= soft / 3) {
+	break;
+      }
+      /* the next iteration would most likely not finish in time */
+      if(limits->timeMs && elapsed * 3 >= limits->timeMs) {
+	break;
+      }
+    }
+  }
+  result->nodes = s.nodes;
+  if(result->lines > 0 && result->pvLength[0] > 1) {
+    result->ponder = result->pv[0][1];
+  }
+}
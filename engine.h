@@ -0,0 +1,97 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "game.h"
+
+/*
+ * A small alpha-beta engine used for bot opponents
+ *
+ * The engine searches on its own compact copy of a Position (EngineBoard) so
+ * that searches can run on other threads while the game carries on. It plays
+ * by the same rules as game.c: no castling or en passant, and pawns always
+ * promote to queens.
+ */
+
+#define MATE_SCORE 30000
+#define MAX_PLY 64
+#define MAX_PV 4 /* most lines a multi-PV search reports */
+#define PV_LENGTH 8 /* most moves reported per line */
+
+/* piece codes on an EngineBoard, 0 is an empty square */
+#define EPIECE(id, color) ((id) | ((color) << 3))
+#define EID(p) ((p) & 7)
+#define ECOLOR(p) ((p) >> 3)
+
+typedef struct EngineBoard {
+  unsigned char sq[64];
+  int toMove; /* WHITE or BLACK */
+  int kings[3]; /* king square by color */
+  int pieces; /* number of pieces on the board, kings included */
+  unsigned long long hash;
+} EngineBoard;
+
+typedef struct SearchLimits {
+  int depth; /* maximum depth in plies */
+  long nodes; /* node budget, 0 for no limit */
+  long timeMs; /* hard time limit in milliseconds, 0 for no limit */
+  long softMs; /* no iteration is started after this, 0 to use timeMs */
+  int multiPV; /* number of best lines to find, 0 or 1 for just the best move */
+  long long start; /* nowMs() the time limits count from, 0 for when the search begins */
+} SearchLimits;
+
+/* set by the thread that owns a search while it runs */
+typedef struct SearchSignals {
+  volatile int stop; /* give up as soon as possible */
+  volatile int pondering; /* time limits are ignored until this is cleared */
+} SearchSignals;
+
+typedef struct SearchResult {
+  Move best; /* best.start is -1 if there is no legal move */
+  Move ponder; /* the expected reply, ponder.start is -1 if unknown */
+  int score; /* centipawns for the side to move */
+  int depth; /* last completed depth */
+  long nodes;
+  /* the principal variations of the last completed depth, best first */
+  int lines;
+  int pvScore[MAX_PV];
+  int pvLength[MAX_PV];
+  Move pv[MAX_PV][PV_LENGTH];
+} SearchResult;
+
+typedef struct TransTable TransTable;
+
+/* allocate a transposition table with 2^bits entries */
+TransTable* newTransTable(int bits);
+void freeTransTable(TransTable* tt);
+void clearTransTable(TransTable* tt);
+
+void boardFromPosition(EngineBoard* b, Position* pos);
+
+/* plays m on b, m must be legal */
+void applyMoveToBoard(EngineBoard* b, Move* m);
+
+/* static evaluation in centipawns for the side to move */
+int evaluate(EngineBoard* b);
+
+/*
+ * Iterative deepening search of b within limits
+ * tt may be shared between searches of the same game, but not between threads
+ * signals may be NULL. While pondering only the depth and node limits apply;
+ * once pondering is cleared the time spent so far counts against the time
+ * limits, so a long ponder turns into an instant move
+ * b is left unchanged
+ */
+void searchBoard(EngineBoard* b, SearchLimits* limits, TransTable* tt, SearchSignals* signals, SearchResult* result);
+
+/*
+ * Time management: splits the remaining clock time into the soft and hard
+ * limits for one move. The search stops at the soft limit once an iteration
+ * is complete (earlier if the best move has been stable for a few
+ * iterations) and never runs past the hard limit
+ */
+void allocateTime(long remainingMs, long incrementMs, int moveNumber, long* softMs, long* hardMs);
+
+/* milliseconds on a monotonic clock */
+long long nowMs();
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "fanout.h"
+#include "connection.h"
+
+/* shards with messages waiting for a fan-out thread */
+typedef struct FanoutQueue {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;
+  LList shards; /* Shard*, each at most once */
+} FanoutQueue;
+
+static FanoutQueue fanq = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static void releaseMessage(Message* m) {
+  if(__sync_sub_and_fetch(&m->refs, 1) == 0) {
+    free(m);
+  }
+}
+
+/* release every message in list and empty it */
+static void releaseAll(LList* list) {
+  while(list->len > 0) {
+    Message** mp = popFrontList(list);
+    releaseMessage(*mp);
+    free(mp);
+  }
+}
+
+/* a->mtx must be held */
+static void runShard(Shard* s) {
+  s->queued = 1;
+  pthread_mutex_lock(&fanq.mtx);
+  pushBackList(&fanq.shards, &s, sizeof(Shard*));
+  pthread_cond_signal(&fanq.work);
+  pthread_mutex_unlock(&fanq.mtx);
+}
+
+/* close the shard's subscribers, a->mtx must be held */
+static void closeShard(Shard* s) {
+  for(int i = 0; i < s->fds.len; i++) {
+    s->audience->close(s->fds.fds[i]);
+  }
+  s->fds.len = 0;
+}
+
+void initAudience(Audience* a) {
+  pthread_mutex_init(&a->mtx, NULL);
+  pthread_cond_init(&a->delivered, NULL);
+  a->shards = NULL;
+  a->n_shards = 0;
+  a->close = NULL;
+}
+
+void destroyAudience(Audience* a) {
+  for(int i = 0; i < a->n_shards; i++) {
+    releaseAll(&a->shards[i]->pending);
+    freeFdSet(&a->shards[i]->fds);
+    free(a->shards[i]);
+  }
+  free(a->shards);
+  pthread_cond_destroy(&a->delivered);
+  pthread_mutex_destroy(&a->mtx);
+}
+
+void joinAudience(Audience* a, int fd) {
+  pthread_mutex_lock(&a->mtx);
+  Shard* s = NULL;
+  for(int i = 0; i < a->n_shards && s == NULL; i++) {
+    if(a->shards[i]->fds.len < FANOUT_SHARD) {
+      s = a->shards[i];
+    }
+  }
+  if(s == NULL) {
+    s = malloc(sizeof(Shard));
+    s->audience = a;
+    initFdSet(&s->fds);
+    initList(&s->pending);
+    s->queued = 0;
+    s->delivering = 0;
+    a->shards = realloc(a->shards, sizeof(Shard*) * (a->n_shards + 1));
+    a->shards[a->n_shards++] = s;
+  }
+  addFd(&s->fds, fd);
+  pthread_mutex_unlock(&a->mtx);
+}
+
+void leaveAudience(Audience* a, int fd) {
+  pthread_mutex_lock(&a->mtx);
+  for(int i = 0; i < a->n_shards; i++) {
+    Shard* s = a->shards[i];
+    if(removeFd(&s->fds, fd)) {
+      /* a delivery under way took fd before it was removed */
+      while(s->delivering) {
+	pthread_cond_wait(&a->delivered, &a->mtx);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&a->mtx);
+}
+
+void publish(Audience* a, const void* text, int len, const void* bin, int binLen, int frame) {
+  char* framed = NULL;
+  if(bin == NULL) {
+    bin = framed = frameText(text, len, &binLen);
+  }
+  /* deltas only change how boards are sent */
+  const void* form[FORMS] = {text, bin, text, bin};
+  int formLen[FORMS] = {len, binLen, len, binLen};
+  publishForms(a, form, formLen, frame);
+  free(framed);
+}
+
+void publishForms(Audience* a, const void* form[FORMS], const int formLen[FORMS], int frame) {
+  int total = 0;
+  for(int k = 0; k < FORMS; k++) {
+    total += formLen[k];
+  }
+  Message* m = malloc(sizeof(Message) + total);
+  m->frame = frame;
+  total = 0;
+  for(int k = 0; k < FORMS; k++) {
+    m->form[k] = m->data + total;
+    m->formLen[k] = formLen[k];
+    memcpy(m->form[k], form[k], formLen[k]);
+    total += formLen[k];
+  }
+  /* held by the publisher until every shard has it */
+  m->refs = 1;
+
+  pthread_mutex_lock(&a->mtx);
+  for(int i = 0; i < a->n_shards; i++) {
+    Shard* s = a->shards[i];
+    if(s->fds.len == 0) {
+      continue;
+    }
+    if(frame) {
+      /* a board that has not gone out yet is superseded by this one */
+      LLNode* cur = s->pending.head;
+      int k = 0;
+      while(cur) {
+	Message* old = *(Message**)cur->data;
+	cur = cur->next;
+	if(old->frame) {
+	  removeIndex(&s->pending, k);
+	  releaseMessage(old);
+	} else {
+	  k++;
+	}
+      }
+    }
+    __sync_add_and_fetch(&m->refs, 1);
+    pushBackList(&s->pending, &m, sizeof(Message*));
+    if(!s->queued) {
+      runShard(s);
+    }
+  }
+  pthread_mutex_unlock(&a->mtx);
+  releaseMessage(m);
+}
+
+void closeAudience(Audience* a, void (*close)(int fd)) {
+  pthread_mutex_lock(&a->mtx);
+  a->close = close;
+  /* shards being delivered to are closed by their thread when it is done */
+  for(int i = 0; i < a->n_shards; i++) {
+    if(!a->shards[i]->queued) {
+      closeShard(a->shards[i]);
+    }
+  }
+  pthread_mutex_unlock(&a->mtx);
+}
+
+int audienceBusy(Audience* a) {
+  pthread_mutex_lock(&a->mtx);
+  int busy = 0;
+  for(int i = 0; i < a->n_shards && !busy; i++) {
+    busy = a->shards[i]->queued;
+  }
+  pthread_mutex_unlock(&a->mtx);
+  return busy;
+}
+
+/* a batch of messages in one protocol */
+typedef struct Batch {
+  const char* all;
+  int allLen;
+  const char* essential; /* all but the board, for subscribers that are behind */
+  int essentialLen;
+  const char* board; /* the board in the batch, if any */
+  int boardLen;
+  int copied; /* all and essential were allocated */
+} Batch;
+
+static void buildBatch(LList* messages, int form, Batch* b) {
+  memset(b, 0, sizeof(Batch));
+  if(messages->len == 1) {
+    /* the usual case, nothing to copy */
+    Message* m = *(Message**)messages->head->data;
+    b->all = m->form[form];
+    b->allLen = m->formLen[form];
+    if(b->allLen == 0) {
+      return;
+    }
+    if(m->frame) {
+      b->board = b->all;
+      b->boardLen = b->allLen;
+    } else {
+      b->essential = b->all;
+      b->essentialLen = b->allLen;
+    }
+    return;
+  }
+
+  int total = 0;
+  for(LLNode* cur = messages->head; cur; cur = cur->next) {
+    Message* m = *(Message**)cur->data;
+    total += m->formLen[form];
+  }
+  char* all = malloc(total);
+  char* essential = malloc(total);
+  for(LLNode* cur = messages->head; cur; cur = cur->next) {
+    Message* m = *(Message**)cur->data;
+    const char* data = m->form[form];
+    int len = m->formLen[form];
+    if(len == 0) {
+      continue;
+    }
+    memcpy(all + b->allLen, data, len);
+    b->allLen += len;
+    if(m->frame) {
+      b->board = data;
+      b->boardLen = len;
+    } else {
+      memcpy(essential + b->essentialLen, data, len);
+      b->essentialLen += len;
+    }
+  }
+  b->all = all;
+  b->essential = essential;
+  b->copied = 1;
+}
+
+static void freeBatch(Batch* b) {
+  if(b->copied) {
+    free((char*)b->all);
+    free((char*)b->essential);
+  }
+}
+
+/* send the messages to the descriptors in fds */
+static void deliver(LList* messages, int* fds, int n) {
+  /* a batch for each form, built when the first subscriber needs it */
+  Batch batches[FORMS];
+  int built[FORMS] = {0};
+
+  for(int i = 0; i < n; i++) {
+    int mode = outputMode(fds[i]);
+    int form = (mode & OUTPUT_BINARY ? FORM_BINARY : FORM_TEXT) | (mode & OUTPUT_DELTAS ? FORM_TEXT_DELTAS : 0);
+    if(!built[form]) {
+      buildBatch(messages, form, &batches[form]);
+      built[form] = 1;
+    }
+    Batch* b = &batches[form];
+    if(mode & OUTPUT_BEHIND) {
+      if(b->essentialLen > 0) {
+	sendClient(fds[i], b->essential, b->essentialLen);
+      }
+      if(b->board) {
+	sendFrame(fds[i], b->board, b->boardLen);
+      }
+    } else if(b->allLen > 0) {
+      sendClient(fds[i], b->all, b->allLen);
+    }
+  }
+
+  for(int k = 0; k < FORMS; k++) {
+    if(built[k]) {
+      freeBatch(&batches[k]);
+    }
+  }
+}
+
+static void* fanoutThread(void* data) {
+  /* the players come first, the spectators get the rest of the machine */
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), FANOUT_NICE);
+  int* fds = malloc(sizeof(int) * FANOUT_SHARD);
+  while(1) {
+    pthread_mutex_lock(&fanq.mtx);
+    while(fanq.shards.len == 0) {
+      pthread_cond_wait(&fanq.work, &fanq.mtx);
+    }
+    Shard** entry = popFrontList(&fanq.shards);
+    Shard* s = *entry;
+    free(entry);
+    pthread_mutex_unlock(&fanq.mtx);
+
+    /* take the pending messages and the subscribers, and deliver without the lock */
+    Audience* a = s->audience;
+    pthread_mutex_lock(&a->mtx);
+    LList batch = s->pending;
+    initList(&s->pending);
+    int n = s->fds.len;
+    memcpy(fds, s->fds.fds, sizeof(int) * n);
+    s->delivering = 1;
+    pthread_mutex_unlock(&a->mtx);
+
+    if(batch.len > 0) {
+      deliver(&batch, fds, n);
+    }
+    releaseAll(&batch);
+
+    pthread_mutex_lock(&a->mtx);
+    s->delivering = 0;
+    pthread_cond_broadcast(&a->delivered);
+    if(s->pending.len > 0) {
+      /* back of the queue, behind the other shards */
+      runShard(s);
+    } else {
+      s->queued = 0;
+      if(a->close) {
+	/* everything was sent before the audience was closed */
+	closeShard(s);
+      }
+    }
+    pthread_mutex_unlock(&a->mtx);
+  }
+  return NULL;
+}
+
+void startFanout(int nthreads) {
+  if(nthreads <= 0) {
+    nthreads = (sysconf(_SC_NPROCESSORS_ONLN) + 1) / 2;
+  }
+  if(nthreads < 1) {
+    nthreads = 1;
+  }
+  if(nthreads > MAX_FANOUT_THREADS) {
+    nthreads = MAX_FANOUT_THREADS;
+  }
+  initList(&fanq.shards);
+  for(int i = 0; i < nthreads; i++) {
+    pthread_t pid;
+    pthread_create(&pid, NULL, fanoutThread, NULL);
+    pthread_detach(pid);
+  }
+}
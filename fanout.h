@@ -0,0 +1,102 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <pthread.h>
+#include "list.h"
+#include "registry.h"
+
+/*
+ * The fan-out stage, which delivers what a game broadcasts to its spectators
+ *
+ * A game publishes each board and message once, as an immutable Message
+ * shared by every recipient, and goes on at once. The messages are sent by
+ * a pool of fan-out threads separate from the game workers, so the number
+ * of spectators does not change how long a move takes.
+ *
+ * An audience is split into shards of at most FANOUT_SHARD subscribers,
+ * which are delivered to in parallel. A fan-out thread takes every message
+ * a shard has pending and sends them to each subscriber as one batch. A
+ * board that has not gone out when the next one is published is superseded
+ * and dropped, and a subscriber that is behind only gets the newest board
+ * once it has caught up (see sendFrame).
+ *
+ * Each message has a form for each protocol a subscriber may speak, and a
+ * subscriber gets the form of its connection's output mode. A form may be
+ * empty, so a board is published as a full board for the subscribers
+ * without deltas and, separately, as a delta that is never superseded for
+ * the ones with deltas.
+ */
+
+#define FANOUT_SHARD 256 /* subscribers delivered to by one thread at a time */
+#define MAX_FANOUT_THREADS 16
+#define FANOUT_NICE 5 /* niceness of the fan-out threads, below the game workers */
+
+/* the forms of a message, by the OUTPUT_BINARY and OUTPUT_DELTAS bits of a subscriber */
+#define FORM_TEXT 0
+#define FORM_BINARY 1
+#define FORM_TEXT_DELTAS 2
+#define FORM_BINARY_DELTAS 3
+#define FORMS 4
+
+typedef struct Message {
+  int refs; /* shards still holding it, changed atomically */
+  int frame; /* a board, superseded by the next one */
+  char* form[FORMS]; /* each form, in data */
+  int formLen[FORMS]; /* 0 if the form is empty */
+  char data[];
+} Message;
+
+struct Audience;
+
+typedef struct Shard {
+  struct Audience* audience;
+  FdSet fds;
+  LList pending; /* Message*, published and not delivered yet */
+  int queued; /* queued to or being delivered by a fan-out thread */
+  int delivering; /* a fan-out thread is sending to a copy of fds */
+} Shard;
+
+typedef struct Audience {
+  pthread_mutex_t mtx; /* protects everything below, and the shards */
+  pthread_cond_t delivered; /* a shard is no longer being delivered to */
+  Shard** shards;
+  int n_shards;
+  void (*close)(int fd); /* set once the audience is closed */
+} Audience;
+
+void initAudience(Audience* a);
+/* only once audienceBusy is 0 */
+void destroyAudience(Audience* a);
+
+void joinAudience(Audience* a, int fd);
+/*
+ * when this returns nothing is being sent to fd for a, so it may be closed
+ * without a message going to whoever gets the descriptor next
+ */
+void leaveAudience(Audience* a, int fd);
+
+/*
+ * send text to every text subscriber and bin to every binary one
+ * bin NULL sends the text as PL_MSG frames
+ * frame is 1 for a board, which the next board supersedes
+ */
+void publish(Audience* a, const void* text, int len, const void* bin, int binLen, int frame);
+/* send each subscriber the form for its protocol, nothing if that is empty */
+void publishForms(Audience* a, const void* form[FORMS], const int formLen[FORMS], int frame);
+
+/*
+ * have close called on every subscriber once what was published to them has
+ * been sent
+ */
+void closeAudience(Audience* a, void (*close)(int fd));
+
+/* return 1 while messages are pending or being delivered */
+int audienceBusy(Audience* a);
+
+/*
+ * start the fan-out threads
+ * 0 uses one per two cores
+ */
+void startFanout(int nthreads);
+
+#endif
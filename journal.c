@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+/* records in a segment, none crosses into the next */
+#define SEGMENT_RECORDS (JOURNAL_SEGMENT_SIZE / (int)sizeof(JournalRecord))
+#define READ_RECORDS 1024 /* read back at a time */
+
+typedef struct Journal {
+  pthread_mutex_t mtx;
+  pthread_cond_t work; /* records were appended */
+  pthread_cond_t synced; /* a group was synced */
+  int running; /* cleared for good if the journal cannot be written */
+  char dir[256];
+  int interval; /* milliseconds the writer waits after each sync */
+  JournalRecord* pending; /* appended since the writer last took them */
+  int len;
+  int cap;
+  JournalRecord* writing; /* the writer's, the buffers are swapped */
+  int writingCap;
+  int segment; /* the segment the next record appended goes in */
+  int filled; /* records appended to it */
+  long long appended; /* records appended so far */
+  long long done; /* records synced so far */
+  int first; /* the oldest segment not deleted */
+  int* live; /* the games kept by each segment from first on */
+  int liveCap;
+  /* the writer's own, it writes where the records were appended in order */
+  int fd; /* the segment written */
+  int fdSegment;
+  int fdFilled;
+  int next; /* the segment after it, allocated in advance, -1 if not yet, -2 if that failed */
+} Journal;
+
+static Journal journal = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* FNV-1a of the record after its check, never 0 so an unwritten record does not pass */
+static unsigned int checkRecord(JournalRecord* r) {
+  const unsigned char* p = (const unsigned char*)r + sizeof(r->check);
+  unsigned int h = 2166136261u;
+  for(int i = sizeof(r->check); i < sizeof(JournalRecord); i++, p++) {
+    h = (h ^ *p) * 16777619u;
+  }
+  return h ? h : 1;
+}
+
+static void segmentPath(char* path, int len, const char* dir, int segment) {
+  snprintf(path, len, "%s/segment-%08d", dir, segment);
+}
+
+/* the segment a file in the journal's directory is, -1 if it is not one */
+static int segmentNumber(const char* name) {
+  int segment;
+  char end;
+  if(sscanf(name, "segment-%d%c", &segment, &end) != 1 || segment < 0) {
+    return -1;
+  }
+  return segment;
+}
+
+static int compareSegments(const void* a, const void* b) {
+  int x = *(const int*)a, y = *(const int*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* the segments in dir, in order, with their number in n */
+static int* listSegments(const char* dir, int* n) {
+  *n = 0;
+  DIR* d = opendir(dir);
+  if(d == NULL) {
+    return NULL;
+  }
+  int* segments = NULL;
+  int cap = 0;
+  struct dirent* e;
+  while((e = readdir(d))) {
+    int segment = segmentNumber(e->d_name);
+    if(segment < 0) {
+      continue;
+    }
+    if(*n == cap) {
+      cap = cap ? cap * 2 : 16;
+      segments = realloc(segments, sizeof(int) * cap);
+    }
+    segments[(*n)++] = segment;
+  }
+  closedir(d);
+  qsort(segments, *n, sizeof(int), compareSegments);
+  return segments;
+}
+
+/* the directory's entries are synced, so a segment made or deleted stays so */
+static void syncDirectory() {
+  int fd = open(journal.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/* make a segment, allocated in full, and return its descriptor, -1 if it failed */
+static int makeSegment(int segment) {
+  char path[300];
+  segmentPath(path, sizeof(path), journal.dir, segment);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd < 0) {
+    printf("journal: cannot create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  int err = posix_fallocate(fd, 0, JOURNAL_SEGMENT_SIZE);
+  if(err != 0) {
+    printf("journal: cannot allocate %s: %s\n", path, strerror(err));
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  fsync(fd);
+  syncDirectory();
+  return fd;
+}
+
+int readJournal(const char* dir, JournalFunc f, void* data) {
+  int n;
+  int* segments = listSegments(dir, &n);
+  JournalRecord* buf = malloc(sizeof(JournalRecord) * READ_RECORDS);
+  int records = 0;
+  for(int k = 0; k < n; k++) {
+    char path[300];
+    segmentPath(path, sizeof(path), dir, segments[k]);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+      continue;
+    }
+    int whole = 1;
+    ssize_t rb;
+    while(whole && (rb = read(fd, buf, sizeof(JournalRecord) * READ_RECORDS)) > 0) {
+      int got = rb / sizeof(JournalRecord);
+      for(int i = 0; i < got; i++) {
+	if(buf[i].check != checkRecord(&buf[i])) {
+	  /* the end of what was written, or what a crash cut short */
+	  whole = 0;
+	  break;
+	}
+	f(&buf[i], data);
+	records++;
+      }
+    }
+    close(fd);
+  }
+  free(buf);
+  free(segments);
+  return records;
+}
+
+/* delete the segments before keep, oldest first, so a crash meanwhile leaves the newer ones */
+static void deleteSegments(int first, int keep) {
+  for(int segment = first; segment < keep; segment++) {
+    char path[300];
+    segmentPath(path, sizeof(path), journal.dir, segment);
+    unlink(path);
+    syncDirectory();
+  }
+}
+
+/*
+ * write n records where they were appended, moving on to the next segment
+ * when one fills, return -1 if they could not all be written
+ */
+static int writeRecords(JournalRecord* records, int n) {
+  int i = 0;
+  while(i < n) {
+    if(journal.fdFilled == SEGMENT_RECORDS) {
+      /* the full segment is synced before it is left */
+      if(fdatasync(journal.fd) < 0) {
+	printf("journal: cannot sync segment %d: %s\n", journal.fdSegment, strerror(errno));
+	return -1;
+      }
+      close(journal.fd);
+      journal.fdSegment++;
+      journal.fd = journal.next >= 0 ? journal.next : makeSegment(journal.fdSegment);
+      journal.next = -1;
+      journal.fdFilled = 0;
+      if(journal.fd < 0) {
+	return -1;
+      }
+    }
+    int run = SEGMENT_RECORDS - journal.fdFilled;
+    if(run > n - i) {
+      run = n - i;
+    }
+    const char* p = (const char*)(records + i);
+    size_t left = sizeof(JournalRecord) * run;
+    off_t off = (off_t)journal.fdFilled * sizeof(JournalRecord);
+    while(left > 0) {
+      ssize_t wb = pwrite(journal.fd, p, left, off);
+      if(wb < 0 && errno == EINTR) {
+	continue;
+      }
+      if(wb < 0) {
+	printf("journal: cannot write segment %d: %s\n", journal.fdSegment, strerror(errno));
+	return -1;
+      }
+      p += wb;
+      off += wb;
+      left -= wb;
+    }
+    journal.fdFilled += run;
+    i += run;
+  }
+  return 0;
+}
+
+/*
+ * the records taken could not be written: journaling stops without counting
+ * them as synced, and the segments go, as after a crash they would set the
+ * games up as they were when it stopped
+ */
+static void stopJournal() {
+  printf("journal: stopped, the games are no longer journaled\n");
+  pthread_mutex_lock(&journal.mtx);
+  journal.running = 0;
+  journal.len = 0;
+  int first = journal.first;
+  pthread_cond_broadcast(&journal.synced);
+  pthread_mutex_unlock(&journal.mtx);
+  if(journal.fd >= 0) {
+    close(journal.fd);
+  }
+  if(journal.next >= 0) {
+    close(journal.next);
+  }
+  deleteSegments(first, journal.fdSegment + 2);
+}
+
+static void* writerThread(void* data) {
+  while(1) {
+    pthread_mutex_lock(&journal.mtx);
+    while(journal.len == 0) {
+      pthread_cond_wait(&journal.work, &journal.mtx);
+    }
+    /* take every record appended since the last group */
+    JournalRecord* records = journal.pending;
+    int n = journal.len;
+    int cap = journal.cap;
+    journal.pending = journal.writing;
+    journal.cap = journal.writingCap;
+    journal.len = 0;
+    journal.writing = records;
+    journal.writingCap = cap;
+    /* the segments no game keeps; the ends that released them are in this group */
+    int first = journal.first;
+    int keep = first;
+    while(keep < journal.segment && journal.live[keep - first] == 0) {
+      keep++;
+    }
+    pthread_mutex_unlock(&journal.mtx);
+
+    if(writeRecords(records, n) < 0) {
+      stopJournal();
+      break;
+    }
+    if(fdatasync(journal.fd) < 0) {
+      printf("journal: cannot sync segment %d: %s\n", journal.fdSegment, strerror(errno));
+      stopJournal();
+      break;
+    }
+    deleteSegments(first, keep);
+    /* so rolling over to the next segment never waits for it to be allocated */
+    if(journal.next == -1) {
+      journal.next = makeSegment(journal.fdSegment + 1);
+      if(journal.next < 0) {
+	/* tried again when the segment is needed */
+	journal.next = -2;
+      }
+    }
+
+    pthread_mutex_lock(&journal.mtx);
+    int left = journal.segment - keep + 1;
+    memmove(journal.live, journal.live + (keep - first), sizeof(int) * left);
+    memset(journal.live + left, 0, sizeof(int) * (keep - first));
+    journal.first = keep;
+    journal.done += n;
+    pthread_cond_broadcast(&journal.synced);
+    pthread_mutex_unlock(&journal.mtx);
+
+    /* gather the next group */
+    usleep(journal.interval * 1000);
+  }
+  return NULL;
+}
+
+int startJournal(const char* dir, int interval) {
+  if(mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    printf("journal: cannot create %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  snprintf(journal.dir, sizeof(journal.dir), "%s", dir);
+  journal.interval = interval;
+  int n;
+  int* segments = listSegments(dir, &n);
+  journal.segment = n ? segments[n - 1] + 1 : 0;
+  journal.first = n ? segments[0] : journal.segment;
+  free(segments);
+  journal.filled = 0;
+  journal.fdSegment = journal.segment;
+  journal.fdFilled = 0;
+  journal.fd = makeSegment(journal.segment);
+  journal.next = -1;
+  if(journal.fd < 0) {
+    return -1;
+  }
+  journal.liveCap = journal.segment - journal.first + 16;
+  journal.live = calloc(journal.liveCap, sizeof(int));
+  /* the old segments stay until the games read from them are written again */
+  journal.live[0] = 1;
+  journal.cap = journal.writingCap = 1024;
+  journal.pending = malloc(sizeof(JournalRecord) * journal.cap);
+  journal.writing = malloc(sizeof(JournalRecord) * journal.writingCap);
+  journal.len = 0;
+  journal.running = 1;
+  pthread_t pid;
+  pthread_create(&pid, NULL, writerThread, NULL);
+  pthread_detach(pid);
+  return journal.first;
+}
+
+/* append r with the journal locked and return its segment */
+static int append(JournalRecord* r) {
+  if(journal.filled == SEGMENT_RECORDS) {
+    journal.segment++;
+    journal.filled = 0;
+    int need = journal.segment - journal.first + 1;
+    if(need > journal.liveCap) {
+      journal.live = realloc(journal.live, sizeof(int) * need * 2);
+      memset(journal.live + journal.liveCap, 0, sizeof(int) * (need * 2 - journal.liveCap));
+      journal.liveCap = need * 2;
+    }
+  }
+  if(journal.len == journal.cap) {
+    /* the writer has fallen behind: the buffer grows rather than make a move wait */
+    journal.cap *= 2;
+    journal.pending = realloc(journal.pending, sizeof(JournalRecord) * journal.cap);
+  }
+  r->check = checkRecord(r);
+  journal.pending[journal.len++] = *r;
+  journal.filled++;
+  journal.appended++;
+  pthread_cond_signal(&journal.work);
+  return journal.segment;
+}
+
+int journalBegin(JournalRecord* r) {
+  if(!journal.running) {
+    return -1;
+  }
+  pthread_mutex_lock(&journal.mtx);
+  int segment = -1;
+  if(journal.running) {
+    segment = append(r);
+    journal.live[segment - journal.first]++;
+  }
+  pthread_mutex_unlock(&journal.mtx);
+  return segment;
+}
+
+void journalAppend(JournalRecord* r) {
+  if(!journal.running) {
+    return;
+  }
+  pthread_mutex_lock(&journal.mtx);
+  if(journal.running) {
+    append(r);
+  }
+  pthread_mutex_unlock(&journal.mtx);
+}
+
+void journalEnd(JournalRecord* r, int segment) {
+  if(!journal.running) {
+    return;
+  }
+  pthread_mutex_lock(&journal.mtx);
+  if(journal.running) {
+    append(r);
+    journal.live[segment - journal.first]--;
+  }
+  pthread_mutex_unlock(&journal.mtx);
+}
+
+void releaseJournal(int segment) {
+  if(!journal.running) {
+    return;
+  }
+  pthread_mutex_lock(&journal.mtx);
+  if(journal.running) {
+    journal.live[segment - journal.first]--;
+  }
+  /* the writer deletes what no game keeps once it has something to sync */
+  pthread_mutex_unlock(&journal.mtx);
+}
+
+void flushJournal() {
+  if(!journal.running) {
+    return;
+  }
+  pthread_mutex_lock(&journal.mtx);
+  long long target = journal.appended;
+  while(journal.running && journal.done < target) {
+    pthread_cond_wait(&journal.synced, &journal.mtx);
+  }
+  pthread_mutex_unlock(&journal.mtx);
+}
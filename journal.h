@@ -0,0 +1,94 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*
+ * The game journal: what a crash would otherwise lose
+ *
+ * With -j the server writes each game that begins, each move played in it
+ * and its end to an append-only journal in journal/, so the games in
+ * progress can be set up again when the server is started after a crash.
+ * The game workers only copy a record into a buffer under a lock, and a
+ * writer thread of its own takes the buffer, writes it and calls fdatasync,
+ * once for the records of every game gathered since the last time. It
+ * waits the group commit interval after each sync, so a crash loses at most
+ * that many milliseconds of moves and the disk sees one sync per interval
+ * however many games there are. A move never waits for the disk.
+ *
+ * The journal is a series of segment files of JOURNAL_SEGMENT_SIZE bytes,
+ * numbered in the order they are written. Each segment is allocated in full
+ * before it is used, the next one while the current one fills, so writing
+ * never grows a file and a sync has no size to update. Records are of one
+ * size, never cross a segment and carry a checksum, so reading stops at
+ * the end of what was written, or at a record a crash cut short.
+ *
+ * A segment is deleted once every game that began in it or before has
+ * ended, and the syncs that wrote the ends are done. On startup the journal
+ * is read from its oldest segment on and the games that did not end are
+ * set up again, then written to a new segment as if they had just begun,
+ * after which the old segments are deleted. A hot restart does the same
+ * with the games it takes over, the old process having synced everything
+ * before it handed them over.
+ *
+ * If a segment cannot be made, written or synced, journaling stops for good
+ * and the segments are deleted, so a crash later on does not set up games
+ * as they were long before.
+ */
+
+#define JOURNAL_SEGMENT_SIZE (4*1024*1024) /* bytes, allocated in full before they are written */
+
+/* the record types */
+#define JOURNAL_BEGIN 1 /* a game began, with the seats and clocks */
+#define JOURNAL_MOVE 2 /* a move was played, with the clocks after it */
+#define JOURNAL_END 3 /* the game is over */
+
+typedef struct JournalRecord {
+  unsigned int check; /* of the rest of the record, never 0 where one was written */
+  int type;
+  int game; /* the id */
+  int bot; /* BEGIN: the engine's level, 0 if both players are human */
+  int botWhite; /* BEGIN: the engine has the white pieces */
+  int timed; /* BEGIN: the game is played with a clock */
+  int start; /* MOVE: the squares */
+  int end;
+  long long white; /* BEGIN and MOVE: milliseconds left on each clock */
+  long long black;
+  long long increment; /* BEGIN: milliseconds added after each move */
+} JournalRecord;
+
+/* called for each record read back, in the order they were written */
+typedef void (*JournalFunc)(JournalRecord* r, void* data);
+
+/*
+ * read the journal in dir from its oldest segment on, skipping what a
+ * crash cut short, return the number of records read
+ */
+int readJournal(const char* dir, JournalFunc f, void* data);
+
+/*
+ * start writing the journal in dir, in a new segment after those there,
+ * and the writer thread, which syncs every interval milliseconds
+ * the segments already there are kept until releaseJournal with the
+ * segment returned, so the games read back can be written again first
+ * return -1 if the journal cannot be written
+ */
+int startJournal(const char* dir, int interval);
+
+/*
+ * append a record for the writer thread, and return the segment it goes
+ * in, -1 if the journal is not written
+ * a BEGIN keeps its segment until the game's END is appended with it
+ */
+int journalBegin(JournalRecord* r);
+void journalAppend(JournalRecord* r);
+void journalEnd(JournalRecord* r, int segment);
+
+/* stop keeping segment, see startJournal */
+void releaseJournal(int segment);
+
+/*
+ * wait until everything appended so far is synced, or the journal has
+ * stopped because it could not be written, in which case it never will be
+ */
+void flushJournal();
+
+#endif
@@ -174,6 +174,9 @@ void removeIndex(LList* list, int i) {
   } else {
     list->head = cur->next;
   }
+  if(cur == list->tail) {
+    list->tail = prv;
+  }
   free(cur->data);
   free(cur);
   list->len -= 1;
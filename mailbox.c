@@ -0,0 +1,45 @@
+#include <stddef.h>
+#include "mailbox.h"
+
+void initMailbox(Mailbox* m) {
+  m->stub.next = NULL;
+  m->head = &m->stub;
+  m->tail = &m->stub;
+}
+
+void mailboxPush(Mailbox* m, MailboxNode* node) {
+  node->next = NULL;
+  __sync_synchronize();
+  MailboxNode* prev = __sync_lock_test_and_set(&m->head, node);
+  /* the consumer cannot get past prev until this store */
+  *(MailboxNode* volatile*)&prev->next = node;
+}
+
+MailboxNode* mailboxPop(Mailbox* m) {
+  MailboxNode* tail = m->tail;
+  MailboxNode* next = *(MailboxNode* volatile*)&tail->next;
+  if(tail == &m->stub) {
+    if(next == NULL) {
+      return NULL;
+    }
+    /* step over the stub */
+    m->tail = tail = next;
+    next = *(MailboxNode* volatile*)&next->next;
+  }
+  if(next) {
+    m->tail = next;
+    return tail;
+  }
+  if(tail != *(MailboxNode* volatile*)&m->head) {
+    /* a push has swapped the head but not linked its node yet */
+    return NULL;
+  }
+  /* tail is the last node, put the stub behind it so it can be taken */
+  mailboxPush(m, &m->stub);
+  next = *(MailboxNode* volatile*)&tail->next;
+  if(next) {
+    m->tail = next;
+    return tail;
+  }
+  return NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+/*
+ * A lock-free queue with any number of producers and a single consumer
+ *
+ * The nodes are linked through a MailboxNode embedded in whatever is
+ * queued, so pushing allocates nothing. A push is one atomic exchange and
+ * never waits, however many threads push at once. Only one thread at a time
+ * may pop.
+ *
+ * A push is complete only once it has linked its node, so for a moment the
+ * consumer may find nothing to pop although the push has begun; a consumer
+ * that knows a node is coming simply tries again.
+ */
+
+typedef struct MailboxNode {
+  struct MailboxNode* next;
+} MailboxNode;
+
+typedef struct Mailbox {
+  MailboxNode* head; /* the last node pushed, swapped atomically by the producers */
+  MailboxNode* tail; /* the next node to pop, only used by the consumer */
+  MailboxNode stub; /* keeps the queue from ever being empty of nodes */
+} Mailbox;
+
+void initMailbox(Mailbox* m);
+
+/* queue node, from any thread */
+void mailboxPush(Mailbox* m, MailboxNode* node);
+
+/* take the oldest node, NULL if there is none, from the consumer only */
+MailboxNode* mailboxPop(Mailbox* m);
+
+#endif
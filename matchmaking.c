@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include "matchmaking.h"
+
+void initMatchmaker(Matchmaker* mm, int nkeys) {
+  pthread_mutex_init(&mm->mtx, NULL);
+  mm->buckets = calloc(nkeys, sizeof(MatchBucket));
+  mm->nkeys = nkeys;
+  mm->all.oldest = mm->all.newest = NULL;
+}
+
+void initMatchEntry(MatchEntry* e) {
+  e->prev = e->next = e->older = e->newer = NULL;
+  e->id = -1;
+  e->key = 0;
+  e->queued = 0;
+}
+
+/* mm->mtx must be held */
+static void linkEntry(Matchmaker* mm, MatchEntry* e) {
+  MatchBucket* b = &mm->buckets[e->key];
+  e->next = NULL;
+  e->prev = b->newest;
+  if(b->newest) {
+    b->newest->next = e;
+  } else {
+    b->oldest = e;
+  }
+  b->newest = e;
+
+  e->newer = NULL;
+  e->older = mm->all.newest;
+  if(mm->all.newest) {
+    mm->all.newest->newer = e;
+  } else {
+    mm->all.oldest = e;
+  }
+  mm->all.newest = e;
+  e->queued = 1;
+}
+
+/* mm->mtx must be held */
+static void unlinkEntry(Matchmaker* mm, MatchEntry* e) {
+  MatchBucket* b = &mm->buckets[e->key];
+  if(e->prev) {
+    e->prev->next = e->next;
+  } else {
+    b->oldest = e->next;
+  }
+  if(e->next) {
+    e->next->prev = e->prev;
+  } else {
+    b->newest = e->prev;
+  }
+
+  if(e->older) {
+    e->older->newer = e->newer;
+  } else {
+    mm->all.oldest = e->newer;
+  }
+  if(e->newer) {
+    e->newer->older = e->older;
+  } else {
+    mm->all.newest = e->older;
+  }
+  e->queued = 0;
+}
+
+/* mm->mtx must be held */
+static int take(Matchmaker* mm, int key) {
+  MatchEntry* e = (key == MATCH_ANY) ? mm->all.oldest : mm->buckets[key].oldest;
+  if(e == NULL) {
+    return -1;
+  }
+  unlinkEntry(mm, e);
+  return e->id;
+}
+
+void queueGame(Matchmaker* mm, MatchEntry* e, int id, int key) {
+  pthread_mutex_lock(&mm->mtx);
+  e->id = id;
+  e->key = key;
+  linkEntry(mm, e);
+  pthread_mutex_unlock(&mm->mtx);
+}
+
+int takeGame(Matchmaker* mm, int key) {
+  pthread_mutex_lock(&mm->mtx);
+  int id = take(mm, key);
+  pthread_mutex_unlock(&mm->mtx);
+  return id;
+}
+
+int quickMatch(Matchmaker* mm, int key, MatchEntry* (*create)(void* ctx), void* ctx) {
+  pthread_mutex_lock(&mm->mtx);
+  int id = take(mm, key);
+  if(id < 0) {
+    MatchEntry* e = create(ctx);
+    if(e) {
+      e->key = key;
+      linkEntry(mm, e);
+    }
+  }
+  pthread_mutex_unlock(&mm->mtx);
+  return id;
+}
+
+void withdrawGame(Matchmaker* mm, MatchEntry* e) {
+  pthread_mutex_lock(&mm->mtx);
+  if(e->queued) {
+    unlinkEntry(mm, e);
+  }
+  pthread_mutex_unlock(&mm->mtx);
+}
@@ -0,0 +1,65 @@
+#ifndef MATCHMAKING_H
+#define MATCHMAKING_H
+
+#include <pthread.h>
+
+/*
+ * The queue of games waiting for a second player
+ *
+ * Each waiting game is queued twice, in the queue of every waiting game
+ * and in the bucket of its key (the server's key is the time control), both
+ * oldest first. A player looking for any game or for a game with a given
+ * key takes the oldest one in O(1), and a game that stops waiting for
+ * another reason withdraws in O(1), so joining never scans the games.
+ *
+ * The entries are linked into the queues in place, so a game embeds its
+ * MatchEntry and nothing is allocated.
+ */
+
+#define MATCH_ANY -1 /* take a game with any key */
+
+typedef struct MatchEntry {
+  struct MatchEntry* prev; /* in the bucket of the key */
+  struct MatchEntry* next;
+  struct MatchEntry* older; /* in the queue of every game */
+  struct MatchEntry* newer;
+  int id; /* the game's id */
+  int key;
+  int queued;
+} MatchEntry;
+
+typedef struct MatchBucket {
+  MatchEntry* oldest;
+  MatchEntry* newest;
+} MatchBucket;
+
+typedef struct Matchmaker {
+  pthread_mutex_t mtx; /* protects everything below, and the queued entries */
+  MatchBucket* buckets; /* by key */
+  int nkeys;
+  MatchBucket all;
+} Matchmaker;
+
+/* keys are from 0 to nkeys - 1 */
+void initMatchmaker(Matchmaker* mm, int nkeys);
+
+void initMatchEntry(MatchEntry* e);
+
+/* queue the waiting game with id */
+void queueGame(Matchmaker* mm, MatchEntry* e, int id, int key);
+
+/* take the oldest game waiting with key (or MATCH_ANY), return its id or -1 if none waits */
+int takeGame(Matchmaker* mm, int key);
+
+/*
+ * take the oldest game waiting with key and return its id, or if none waits
+ * call create with ctx, which returns the entry of a new game to queue or
+ * NULL, and return -1
+ * no other player can take a game or create one for key in between
+ */
+int quickMatch(Matchmaker* mm, int key, MatchEntry* (*create)(void* ctx), void* ctx);
+
+/* take the game out of the queue if it is still in it */
+void withdrawGame(Matchmaker* mm, MatchEntry* e);
+
+#endif
@@ -0,0 +1,700 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "reactor.h"
+#include "timer.h"
+#include "uring.h"
+#include "list.h"
+
+#define REACTOR_EVENTS 64 /* events taken per epoll_wait */
+
+#define URING_ENTRIES 4096
+#define URING_COMPLETIONS 16384
+#define URING_BUFFERS 4096 /* provided receive buffers, a power of two */
+#define URING_BUFFER_SIZE 2048
+
+/* a completion's user data: the operation, the generation of the watch it was for and the descriptor */
+#define OP_RECV 1ULL
+#define OP_POLL 2ULL
+#define OP_WAKE 3ULL
+#define OP_CANCEL 4ULL
+#define GEN_MASK 0xffffff
+#define USER_DATA(op, gen, fd) ((op) << 56 | (unsigned long long)((gen) & GEN_MASK) << 32 | (unsigned)(fd))
+#define DATA_OP(d) ((d) >> 56)
+#define DATA_GEN(d) (((d) >> 32) & GEN_MASK)
+#define DATA_FD(d) ((int)((d) & 0xffffffff))
+
+#define RECV_OFF 0 /* no receive, the connection is full until reactorReceiveMore */
+#define RECV_ARMED 1
+#define RECV_CANCELLING 2 /* the connection is full and the receive is being cancelled */
+#define RECV_ENDED 3 /* the client closed its side or the socket failed */
+
+typedef struct Watch {
+  Inbox* owner; /* NULL if not watched */
+  unsigned gen; /* bumped when it is removed, so completions for the old descriptor are told apart */
+  int socket; /* a socket, received from by the ring, and not a pipe it only polls */
+  int recv; /* RECV_, with io_uring */
+  int resume; /* receive again once the cancelled receive has ended */
+  unsigned posted; /* the batch in which input was last posted */
+} Watch;
+
+typedef struct Reactor {
+  pthread_mutex_t mtx; /* protects watches */
+  int epfd;
+  Watch* watches; /* by descriptor */
+  int cap; /* length of watches */
+  WritableFunc writable;
+  int wakefd; /* an eventfd written to wake the reactor thread */
+  int uring; /* io_uring is used in place of epoll */
+  Ring ring; /* its mtx is taken after mtx */
+  BufferRing buffers;
+  ReceiveFunc received;
+  unsigned batch; /* completions handled in one go */
+} Reactor;
+
+static Reactor reactor = {PTHREAD_MUTEX_INITIALIZER, -1, NULL, 0, NULL, -1};
+
+/* served inboxes waiting for a game worker */
+typedef struct RunQueue {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;
+  LList inboxes; /* Inbox*, each at most once */
+} RunQueue;
+
+static RunQueue runq = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* the reactor thread waits here while the server is frozen, see reactorFreeze */
+typedef struct Freeze {
+  pthread_mutex_t mtx;
+  pthread_cond_t changed;
+  volatile int on;
+  int parked; /* the reactor thread is waiting for the thaw */
+  long posts; /* events posted since it froze, changed atomically */
+} Freeze;
+
+static Freeze freeze = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+void initInbox(Inbox* inbox) {
+  initMailbox(&inbox->events);
+  pthread_mutex_init(&inbox->mtx, NULL);
+  pthread_cond_init(&inbox->ready, NULL);
+  inbox->serve = NULL;
+  inbox->owner = NULL;
+  inbox->pending = 0;
+  inbox->waiting = 0;
+}
+
+void serveInbox(Inbox* inbox, ServeFunc serve, void* owner) {
+  inbox->serve = serve;
+  inbox->owner = owner;
+}
+
+int inboxBusy(Inbox* inbox) {
+  return __sync_fetch_and_add(&inbox->pending, 0) != 0;
+}
+
+static void runInbox(Inbox* inbox) {
+  pthread_mutex_lock(&runq.mtx);
+  pushBackList(&runq.inboxes, &inbox, sizeof(Inbox*));
+  pthread_cond_signal(&runq.work);
+  pthread_mutex_unlock(&runq.mtx);
+}
+
+void destroyInbox(Inbox* inbox) {
+  InboxEvent* event;
+  while((event = (InboxEvent*)mailboxPop(&inbox->events))) {
+    free(event);
+  }
+  pthread_mutex_destroy(&inbox->mtx);
+  pthread_cond_destroy(&inbox->ready);
+}
+
+void postEvent(Inbox* inbox, int type, int fd) {
+  InboxEvent* event = malloc(sizeof(InboxEvent));
+  event->type = type;
+  event->fd = fd;
+  mailboxPush(&inbox->events, &event->node);
+  if(inbox->serve == NULL) {
+    /* the waiter checks for events under the lock, so it cannot miss this */
+    pthread_mutex_lock(&inbox->mtx);
+    inbox->waiting = 0;
+    pthread_cond_signal(&inbox->ready);
+    pthread_mutex_unlock(&inbox->mtx);
+  } else if(__sync_fetch_and_add(&inbox->pending, 1) == 0) {
+    /* the inbox was idle, the rest are served after this one */
+    runInbox(inbox);
+  }
+  /* counted once the inbox is seen to be busy, see inboxIdle */
+  if(freeze.on) {
+    __sync_fetch_and_add(&freeze.posts, 1);
+  }
+}
+
+int waitInbox(Inbox* inbox, int* fds, int max) {
+  pthread_mutex_lock(&inbox->mtx);
+  InboxEvent* event;
+  while((event = (InboxEvent*)mailboxPop(&inbox->events)) == NULL) {
+    inbox->waiting = 1;
+    pthread_cond_wait(&inbox->ready, &inbox->mtx);
+  }
+  inbox->waiting = 0;
+  pthread_mutex_unlock(&inbox->mtx);
+  /* then whatever else is ready, without waiting for more */
+  int n = 0;
+  do {
+    int fd = event->fd;
+    free(event);
+    /* a descriptor posted twice is read once */
+    int k = 0;
+    while(k < n && fds[k] != fd) {
+      k++;
+    }
+    if(k == n) {
+      fds[n++] = fd;
+    }
+  } while(n < max && (event = (InboxEvent*)mailboxPop(&inbox->events)) != NULL);
+  return n;
+}
+
+static void* gameWorker(void* data) {
+  while(1) {
+    pthread_mutex_lock(&runq.mtx);
+    while(runq.inboxes.len == 0) {
+      pthread_cond_wait(&runq.work, &runq.mtx);
+    }
+    Inbox** entry = popFrontList(&runq.inboxes);
+    Inbox* inbox = *entry;
+    free(entry);
+    pthread_mutex_unlock(&runq.mtx);
+
+    /* one event per turn, so a busy game cannot hold a worker */
+    InboxEvent* event = (InboxEvent*)mailboxPop(&inbox->events);
+    if(event == NULL) {
+      /* counted, but its post has not linked it yet */
+      runInbox(inbox);
+      continue;
+    }
+    inbox->serve(inbox->owner, event);
+    free(event);
+
+    /* the inbox may be destroyed once the count is 0, so this is the last use of it */
+    if(__sync_sub_and_fetch(&inbox->pending, 1) > 0) {
+      /* back of the queue, behind the other games */
+      runInbox(inbox);
+    }
+  }
+  return NULL;
+}
+
+void startGameWorkers(int nthreads) {
+  if(nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if(nthreads < 1) {
+    nthreads = 1;
+  }
+  if(nthreads > MAX_GAME_WORKERS) {
+    nthreads = MAX_GAME_WORKERS;
+  }
+  initList(&runq.inboxes);
+  for(int i = 0; i < nthreads; i++) {
+    pthread_t pid;
+    pthread_create(&pid, NULL, gameWorker, NULL);
+    pthread_detach(pid);
+  }
+}
+
+/* a growable list of descriptors */
+static void pushFd(int** fds, int* n, int* cap, int fd) {
+  if(*n == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *fds = realloc(*fds, sizeof(int) * *cap);
+  }
+  (*fds)[(*n)++] = fd;
+}
+
+/* called by the reactor thread: wait while the server is frozen */
+static void parkReactor() {
+  pthread_mutex_lock(&freeze.mtx);
+  freeze.parked = 1;
+  pthread_cond_broadcast(&freeze.changed);
+  while(freeze.on) {
+    pthread_cond_wait(&freeze.changed, &freeze.mtx);
+  }
+  freeze.parked = 0;
+  pthread_mutex_unlock(&freeze.mtx);
+}
+
+static void* reactorThread(void* data) {
+  struct epoll_event events[REACTOR_EVENTS];
+  int writable[REACTOR_EVENTS];
+  while(1) {
+    if(freeze.on) {
+      /* what arrives meanwhile waits in the epoll instance */
+      parkReactor();
+    }
+    int n = epoll_wait(reactor.epfd, events, REACTOR_EVENTS, timerTimeout());
+    if(n < 0) {
+      if(errno != EINTR) {
+	printf("epoll_wait: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    runTimers();
+    /* the owner is looked up and posted to under the lock, so an owner
+       that has removed its descriptors never receives them */
+    int nw = 0;
+    pthread_mutex_lock(&reactor.mtx);
+    for(int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if(fd == reactor.wakefd) {
+	eventfd_t count;
+	eventfd_read(fd, &count);
+	continue;
+      }
+      if(fd >= reactor.cap || reactor.watches[fd].owner == NULL) {
+	continue;
+      }
+      if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+	postEvent(reactor.watches[fd].owner, EVENT_INPUT, fd);
+      }
+      if(events[i].events & EPOLLOUT) {
+	writable[nw++] = fd;
+      }
+    }
+    pthread_mutex_unlock(&reactor.mtx);
+
+    /* sending may take a while, so not under the lock */
+    for(int i = 0; i < nw; i++) {
+      reactor.writable(writable[i]);
+    }
+  }
+  return NULL;
+}
+
+/* a submission entry, reactor.ring.mtx must be held */
+static struct io_uring_sqe* takeSqe(unsigned long long data) {
+  struct io_uring_sqe* sqe = ringSqe(&reactor.ring);
+  if(sqe) {
+    sqe->user_data = data;
+  }
+  return sqe;
+}
+
+/* queue a multishot receive of fd into the provided buffers, reactor.mtx must be held */
+static void armReceive(int fd) {
+  Watch* w = &reactor.watches[fd];
+  if(freeze.on) {
+    /* armed again at the thaw */
+    w->recv = RECV_OFF;
+    return;
+  }
+  pthread_mutex_lock(&reactor.ring.mtx);
+  struct io_uring_sqe* sqe = takeSqe(USER_DATA(OP_RECV, w->gen, fd));
+  if(sqe) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = reactor.buffers.group;
+    w->recv = RECV_ARMED;
+  }
+  pthread_mutex_unlock(&reactor.ring.mtx);
+}
+
+/* queue a multishot poll of fd, reactor.mtx must be held */
+static void armPoll(int fd, int events) {
+  pthread_mutex_lock(&reactor.ring.mtx);
+  struct io_uring_sqe* sqe = takeSqe(USER_DATA(OP_POLL, reactor.watches[fd].gen, fd));
+  if(sqe) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_ADD_MULTI;
+  }
+  pthread_mutex_unlock(&reactor.ring.mtx);
+}
+
+/* queue the cancellation of fd's receive, reactor.mtx must be held */
+static void cancelReceive(int fd) {
+  pthread_mutex_lock(&reactor.ring.mtx);
+  struct io_uring_sqe* sqe = takeSqe(USER_DATA(OP_CANCEL, 0, fd));
+  if(sqe) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = USER_DATA(OP_RECV, reactor.watches[fd].gen, fd);
+  }
+  pthread_mutex_unlock(&reactor.ring.mtx);
+}
+
+static void submitRing() {
+  pthread_mutex_lock(&reactor.ring.mtx);
+  ringSubmit(&reactor.ring);
+  pthread_mutex_unlock(&reactor.ring.mtx);
+}
+
+/* the watch a completion is for, NULL if its descriptor was removed since */
+static Watch* watchOf(unsigned long long data) {
+  int fd = DATA_FD(data);
+  if(fd < 0 || fd >= reactor.cap) {
+    return NULL;
+  }
+  Watch* w = &reactor.watches[fd];
+  return (w->owner && (w->gen & GEN_MASK) == DATA_GEN(data)) ? w : NULL;
+}
+
+/* input for fd is posted once the batch is done, at most once per batch */
+static void readyInput(Watch* w, int fd, int** ready, int* nr, int* cap) {
+  if(w->posted != reactor.batch) {
+    w->posted = reactor.batch;
+    pushFd(ready, nr, cap, fd);
+  }
+}
+
+/* a receive completed, reactor.mtx must be held */
+static void completeReceive(Watch* w, int fd, int res, unsigned flags, int** ready, int* nr, int* cap) {
+  int full = 0;
+  if(flags & IORING_CQE_F_BUFFER) {
+    int id = flags >> IORING_CQE_BUFFER_SHIFT;
+    if(w && res > 0) {
+      full = reactor.received(fd, bufferData(&reactor.buffers, id), res);
+    }
+    /* the data was copied, the kernel can fill the buffer again */
+    recycleBuffer(&reactor.buffers, id);
+  }
+  if(w == NULL) {
+    return;
+  }
+  if(res > 0) {
+    readyInput(w, fd, ready, nr, cap);
+  } else if(res != -ENOBUFS && res != -ECANCELED) {
+    /* the end of the input, or the socket failed */
+    reactor.received(fd, NULL, res);
+    w->recv = RECV_ENDED;
+    readyInput(w, fd, ready, nr, cap);
+    return;
+  }
+  if(flags & IORING_CQE_F_MORE) {
+    if(full && w->recv == RECV_ARMED) {
+      /* stop receiving until the owner has taken some of it */
+      cancelReceive(fd);
+      w->recv = RECV_CANCELLING;
+    }
+    return;
+  }
+  /* the receive has ended: out of buffers, cancelled, or the kernel stopped it */
+  if(w->recv == RECV_CANCELLING ? w->resume : !full) {
+    armReceive(fd);
+  } else {
+    w->recv = RECV_OFF;
+  }
+  w->resume = 0;
+}
+
+/*
+ * cancel every socket's receive while the server freezes, and return how
+ * many have not ended yet
+ */
+static int stopReceiving() {
+  int receiving = 0;
+  pthread_mutex_lock(&reactor.mtx);
+  for(int fd = 0; fd < reactor.cap; fd++) {
+    Watch* w = &reactor.watches[fd];
+    if(w->owner == NULL || !w->socket) {
+      continue;
+    }
+    if(w->recv == RECV_ARMED) {
+      cancelReceive(fd);
+      w->recv = RECV_CANCELLING;
+    }
+    if(w->recv == RECV_CANCELLING) {
+      w->resume = 0;
+      receiving++;
+    }
+  }
+  submitRing();
+  pthread_mutex_unlock(&reactor.mtx);
+  return receiving;
+}
+
+/* receive from every socket again after a thaw */
+static void resumeReceiving() {
+  pthread_mutex_lock(&reactor.mtx);
+  for(int fd = 0; fd < reactor.cap; fd++) {
+    Watch* w = &reactor.watches[fd];
+    if(w->owner && w->socket && w->recv == RECV_OFF) {
+      /* one that is still full is cancelled again with the first data */
+      armReceive(fd);
+    }
+  }
+  submitRing();
+  pthread_mutex_unlock(&reactor.mtx);
+}
+
+static void* uringThread(void* data) {
+  int* ready = NULL;
+  int* writable = NULL;
+  int readyCap = 0, writableCap = 0;
+  while(1) {
+    /* everything received before the receives ended is handed on first */
+    if(freeze.on && stopReceiving() == 0) {
+      parkReactor();
+      resumeReceiving();
+    }
+    ringWait(&reactor.ring, timerTimeout());
+    if(!freeze.on) {
+      runTimers();
+    }
+    int nr = 0, nw = 0;
+    /* as with epoll, the owner is looked up and posted to under the lock */
+    pthread_mutex_lock(&reactor.mtx);
+    reactor.batch++;
+    struct io_uring_cqe* cqe;
+    while((cqe = ringPeek(&reactor.ring))) {
+      unsigned long long user = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      ringSeen(&reactor.ring);
+      int fd = DATA_FD(user);
+      Watch* w = watchOf(user);
+      if(DATA_OP(user) == OP_RECV) {
+	completeReceive(w, fd, res, flags, &ready, &nr, &readyCap);
+      } else if(DATA_OP(user) == OP_POLL && w) {
+	if(res > 0 && (res & POLLIN) && !w->socket) {
+	  readyInput(w, fd, &ready, &nr, &readyCap);
+	}
+	if(res > 0 && (res & (POLLERR | POLLHUP))) {
+	  readyInput(w, fd, &ready, &nr, &readyCap);
+	}
+	if(res > 0 && (res & (POLLOUT | POLLERR | POLLHUP)) && w->socket) {
+	  pushFd(&writable, &nw, &writableCap, fd);
+	}
+	if(res >= 0 && !(flags & IORING_CQE_F_MORE)) {
+	  armPoll(fd, w->socket ? POLLOUT : POLLIN);
+	}
+      }
+    }
+    for(int i = 0; i < nr; i++) {
+      postEvent(reactor.watches[ready[i]].owner, EVENT_INPUT, ready[i]);
+    }
+    /* everything the batch re-armed or cancelled goes in one system call */
+    submitRing();
+    pthread_mutex_unlock(&reactor.mtx);
+
+    for(int i = 0; i < nw; i++) {
+      reactor.writable(writable[i]);
+    }
+  }
+  return NULL;
+}
+
+/* set up io_uring, return 0 if it cannot be used */
+static int startUring() {
+  if(!uringSupported()) {
+    return 0;
+  }
+  if(initRing(&reactor.ring, URING_ENTRIES, URING_COMPLETIONS) < 0) {
+    return 0;
+  }
+  if(initBufferRing(&reactor.ring, &reactor.buffers, 0, URING_BUFFERS, URING_BUFFER_SIZE) < 0) {
+    freeRing(&reactor.ring);
+    return 0;
+  }
+  reactor.uring = 1;
+  pthread_t pid;
+  pthread_create(&pid, NULL, uringThread, NULL);
+  pthread_detach(pid);
+  return 1;
+}
+
+int startReactor(WritableFunc writable, ReceiveFunc received, int useUring) {
+  reactor.writable = writable;
+  reactor.received = received;
+  if(useUring) {
+    if(startUring()) {
+      printf("Watching connections with io_uring\n");
+      return 1;
+    }
+    printf("io_uring is not available, watching connections with epoll\n");
+  }
+  reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(reactor.epfd < 0) {
+    printf("epoll_create1: %s\n", strerror(errno));
+    exit(-1);
+  }
+  reactor.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = reactor.wakefd;
+  epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, reactor.wakefd, &ev);
+  pthread_t pid;
+  pthread_create(&pid, NULL, reactorThread, NULL);
+  pthread_detach(pid);
+  return 0;
+}
+
+void reactorFreeze() {
+  pthread_mutex_lock(&freeze.mtx);
+  freeze.posts = 0;
+  __sync_synchronize();
+  freeze.on = 1;
+  pthread_mutex_unlock(&freeze.mtx);
+  reactorWake();
+  pthread_mutex_lock(&freeze.mtx);
+  while(!freeze.parked) {
+    pthread_cond_wait(&freeze.changed, &freeze.mtx);
+  }
+  pthread_mutex_unlock(&freeze.mtx);
+}
+
+void reactorThaw() {
+  pthread_mutex_lock(&freeze.mtx);
+  freeze.on = 0;
+  pthread_cond_broadcast(&freeze.changed);
+  pthread_mutex_unlock(&freeze.mtx);
+}
+
+long reactorPosts() {
+  return __sync_fetch_and_add(&freeze.posts, 0);
+}
+
+int inboxIdle(Inbox* inbox) {
+  if(inbox->serve) {
+    return !inboxBusy(inbox);
+  }
+  /* cleared by every post before it signals */
+  pthread_mutex_lock(&inbox->mtx);
+  int idle = inbox->waiting;
+  pthread_mutex_unlock(&inbox->mtx);
+  return idle;
+}
+
+void reactorAdd(int fd, Inbox* owner) {
+  pthread_mutex_lock(&reactor.mtx);
+  if(fd >= reactor.cap) {
+    /* grow the table to fit any descriptor number */
+    int cap = reactor.cap ? reactor.cap : 64;
+    while(cap <= fd) {
+      cap *= 2;
+    }
+    reactor.watches = realloc(reactor.watches, sizeof(Watch) * cap);
+    memset(reactor.watches + reactor.cap, 0, sizeof(Watch) * (cap - reactor.cap));
+    reactor.cap = cap;
+  }
+  Watch* w = &reactor.watches[fd];
+  w->owner = owner;
+  if(reactor.uring) {
+    struct stat st;
+    w->socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+    w->recv = RECV_OFF;
+    w->resume = 0;
+    w->posted = reactor.batch - 1;
+    if(w->socket) {
+      armReceive(fd);
+      armPoll(fd, POLLOUT);
+    } else {
+      armPoll(fd, POLLIN);
+    }
+    submitRing();
+    pthread_mutex_unlock(&reactor.mtx);
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = fd;
+  if(epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    printf("epoll_ctl add %d: %s\n", fd, strerror(errno));
+    w->owner = NULL;
+  }
+  pthread_mutex_unlock(&reactor.mtx);
+}
+
+void reactorSetOwner(int fd, Inbox* owner) {
+  reactorHandOff(fd, owner, EVENT_INPUT);
+}
+
+void reactorHandOff(int fd, Inbox* owner, int type) {
+  pthread_mutex_lock(&reactor.mtx);
+  if(fd < reactor.cap && reactor.watches[fd].owner) {
+    reactor.watches[fd].owner = owner;
+    /* the last edge may have gone to the old owner, and the event goes
+       before any input posted once the lock is released */
+    postEvent(owner, type, fd);
+  }
+  pthread_mutex_unlock(&reactor.mtx);
+}
+
+void reactorResume(int fd) {
+  pthread_mutex_lock(&reactor.mtx);
+  if(fd < reactor.cap && reactor.watches[fd].owner) {
+    postEvent(reactor.watches[fd].owner, EVENT_INPUT, fd);
+  }
+  pthread_mutex_unlock(&reactor.mtx);
+}
+
+void reactorReceiveMore(int fd) {
+  pthread_mutex_lock(&reactor.mtx);
+  if(reactor.uring && fd < reactor.cap && reactor.watches[fd].owner) {
+    Watch* w = &reactor.watches[fd];
+    if(w->recv == RECV_OFF) {
+      armReceive(fd);
+      submitRing();
+    } else if(w->recv == RECV_CANCELLING) {
+      /* the reactor thread arms it again once the cancelled one has ended */
+      w->resume = 1;
+    }
+  }
+  pthread_mutex_unlock(&reactor.mtx);
+}
+
+void reactorWake() {
+  if(!reactor.uring) {
+    eventfd_write(reactor.wakefd, 1);
+    return;
+  }
+  /* a no-op completes at once and ends the wait */
+  pthread_mutex_lock(&reactor.ring.mtx);
+  struct io_uring_sqe* sqe = takeSqe(USER_DATA(OP_WAKE, 0, 0));
+  if(sqe) {
+    sqe->opcode = IORING_OP_NOP;
+  }
+  ringSubmit(&reactor.ring);
+  pthread_mutex_unlock(&reactor.ring.mtx);
+}
+
+void reactorRemove(int fd) {
+  pthread_mutex_lock(&reactor.mtx);
+  if(fd < reactor.cap && reactor.watches[fd].owner) {
+    Watch* w = &reactor.watches[fd];
+    w->owner = NULL;
+    if(reactor.uring) {
+      w->gen++;
+      /* submitted at once: the descriptor is looked up now, before the caller
+	 closes it, and the ring lets go of the socket */
+      pthread_mutex_lock(&reactor.ring.mtx);
+      struct io_uring_sqe* sqe = takeSqe(USER_DATA(OP_CANCEL, 0, fd));
+      if(sqe) {
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      }
+      ringSubmit(&reactor.ring);
+      pthread_mutex_unlock(&reactor.ring.mtx);
+    } else {
+      epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+  }
+  pthread_mutex_unlock(&reactor.mtx);
+}
+
+Inbox* reactorOwner(int fd) {
+  pthread_mutex_lock(&reactor.mtx);
+  Inbox* owner = (fd >= 0 && fd < reactor.cap) ? reactor.watches[fd].owner : NULL;
+  pthread_mutex_unlock(&reactor.mtx);
+  return owner;
+}
@@ -0,0 +1,167 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include "mailbox.h"
+
+/*
+ * The reactor: one thread and one edge-triggered epoll instance watching
+ * every client socket (and the engine pipes)
+ *
+ * Each watched descriptor has an owner, the Inbox of the hub or of the game
+ * it belongs to. When input arrives the reactor posts an EVENT_INPUT for the
+ * descriptor to its owner's inbox and the owner's thread, which sleeps in
+ * waitInbox until then, reads it. Because the epoll is edge-triggered an owner must keep
+ * reading a descriptor until dataToRead reports nothing is left. Nothing
+ * polls on a timeout, so idle games cost nothing and there is no limit on
+ * descriptor numbers.
+ *
+ * The reactor also watches for sockets becoming writable again and then
+ * calls the writable function given to startReactor from its own thread,
+ * which sends the output that was queued while the socket was full, and it
+ * advances the timer wheel (see timer.h), waking each tick while a timer is
+ * armed.
+ *
+ * An inbox is either read by a thread of its own with waitInbox (each of
+ * the hub room's threads) or served by the shared pool of game workers (the games). A served
+ * inbox is queued to the workers when an event is posted to it, and a worker
+ * hands its events to the owner's serve function one at a time. An inbox is
+ * never served by two workers at once, so its owner needs no thread of its
+ * own and its events are handled in the order they were posted.
+ *
+ * With io_uring (startReactor's useUring) the reactor thread waits on a
+ * ring in place of the epoll instance. Each socket has a multishot receive
+ * into a ring of provided buffers and a multishot poll for it becoming
+ * writable, and each pipe a multishot poll, so nothing is submitted per
+ * event: the reactor thread hands the data it receives to the receive
+ * function given to startReactor, which keeps it on the connection for the
+ * owner to read, gives the buffer back and posts the descriptor as before,
+ * and submits whatever a batch of completions re-armed with one system call.
+ * When a connection has more staged than its owner takes, the receive
+ * function says it is full and the socket's receive is cancelled until the
+ * owner has caught up and calls reactorReceiveMore, so a client that floods
+ * the server is held back by TCP, as with epoll.
+ *
+ * Anyone may post an event of the owner's own to a served inbox with
+ * postEvent, which is how the hub room hands clients to a game: the game's
+ * state is only ever touched by whoever serves its inbox, and nothing is
+ * locked to post. The events are queued on a lock-free mailbox and counted
+ * atomically, and only a post that finds the count at 0 queues the inbox to
+ * the workers.
+ */
+
+#define MAX_GAME_WORKERS 64
+
+#define EVENT_INPUT 0 /* the descriptor has input, or was handed to the owner */
+#define EVENT_TIMER 1 /* a timer of the owner's expired, see timer.h */
+#define EVENT_OWNER 2 /* the owner's own events are numbered from here */
+
+typedef struct InboxEvent {
+  MailboxNode node;
+  int type;
+  int fd;
+} InboxEvent;
+
+/* called by a game worker for each event posted to a served inbox */
+typedef void (*ServeFunc)(void* owner, InboxEvent* event);
+
+/* called by the reactor when a descriptor can take more output */
+typedef void (*WritableFunc)(int fd);
+
+/*
+ * called by the reactor with data it received for fd, with io_uring only
+ * len is 0 at the end of the input and -errno if the socket failed
+ * return 1 if the connection is full and the reactor should stop receiving
+ */
+typedef int (*ReceiveFunc)(int fd, const void* buf, int len);
+
+typedef struct Inbox {
+  Mailbox events; /* InboxEvent, in the order they were posted */
+  pthread_mutex_t mtx; /* only for waitInbox to sleep on */
+  pthread_cond_t ready; /* an event was posted */
+  ServeFunc serve; /* NULL if the inbox is read with waitInbox */
+  void* owner; /* passed to serve */
+  int pending; /* events posted to a served inbox and not served yet, changed atomically */
+  int waiting; /* its thread waits in waitInbox with nothing posted, protected by mtx */
+} Inbox;
+
+void initInbox(Inbox* inbox);
+void destroyInbox(Inbox* inbox);
+
+/* have inbox served by the game workers with serve(owner, fd) */
+void serveInbox(Inbox* inbox, ServeFunc serve, void* owner);
+
+/*
+ * return 1 if events posted to inbox are waiting or being served
+ * an inbox whose descriptors are all removed can be destroyed once this is 0
+ */
+int inboxBusy(Inbox* inbox);
+
+/* post an event for fd to a served inbox, from any thread */
+void postEvent(Inbox* inbox, int type, int fd);
+
+/*
+ * start the game workers
+ * 0 uses one per core
+ */
+void startGameWorkers(int nthreads);
+
+/*
+ * block until input is posted to inbox, then take every descriptor posted
+ * so far, up to max, into fds and return how many were taken
+ */
+int waitInbox(Inbox* inbox, int* fds, int max);
+
+/*
+ * create the epoll instance, or the io_uring instance if useUring is set and
+ * the kernel has what it takes, and start the reactor thread
+ * return 1 if io_uring is used, in which case input is received with received
+ */
+int startReactor(WritableFunc writable, ReceiveFunc received, int useUring);
+
+/* start watching fd for owner */
+void reactorAdd(int fd, Inbox* owner);
+
+/*
+ * hand fd to a new owner, which is posted fd at once in case input arrived
+ * before the hand-off
+ */
+void reactorSetOwner(int fd, Inbox* owner);
+/* the same, posting an event of the owner's own in place of the input */
+void reactorHandOff(int fd, Inbox* owner, int type);
+
+/* post an EVENT_INPUT for fd to its owner, if it is watched */
+void reactorResume(int fd);
+
+/* receive fd's input again once its connection is no longer full, with io_uring */
+void reactorReceiveMore(int fd);
+
+/* wake the reactor thread so it sees a new timer */
+void reactorWake();
+
+/* stop watching fd, call this before closing it */
+void reactorRemove(int fd);
+
+/* the owner of fd, NULL if fd is not watched */
+Inbox* reactorOwner(int fd);
+
+/*
+ * freeze the reactor for a hot restart (see restart.h): once this returns
+ * no input is posted and no timer expires until reactorThaw, and with
+ * io_uring the sockets are no longer received from and what was received
+ * is on the connections. Descriptors may still be added meanwhile
+ */
+void reactorFreeze();
+void reactorThaw();
+
+/*
+ * return 1 if nothing posted to inbox is waiting or being handled
+ * while the reactor is frozen an inbox only gets busy again through an
+ * event posted by another that is busy, so if every inbox is found idle and
+ * reactorPosts, the events posted since the freeze, has not changed
+ * meanwhile, nothing is left to handle
+ */
+int inboxIdle(Inbox* inbox);
+long reactorPosts();
+
+#endif
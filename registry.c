@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include "registry.h"
+
+#define FDSET_INITIAL_SIZE 4
+
+void initFdSet(FdSet* set) {
+  set->fds = NULL;
+  set->len = 0;
+  set->cap = 0;
+}
+
+void freeFdSet(FdSet* set) {
+  free(set->fds);
+  initFdSet(set);
+}
+
+int addFd(FdSet* set, int fd) {
+  for(int i = 0; i < set->len; i++) {
+    if(set->fds[i] == fd) {
+      return 0;
+    }
+  }
+  if(set->len == set->cap) {
+    set->cap = set->cap ? set->cap * 2 : FDSET_INITIAL_SIZE;
+    set->fds = realloc(set->fds, sizeof(int) * set->cap);
+  }
+  set->fds[set->len++] = fd;
+  return 1;
+}
+
+int removeFd(FdSet* set, int fd) {
+  for(int i = 0; i < set->len; i++) {
+    if(set->fds[i] == fd) {
+      /* the last descriptor takes its place */
+      set->fds[i] = set->fds[--set->len];
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+/*
+ * A set of descriptors of any size, in no particular order
+ * meant for small sets such as the spectators of one game
+ */
+typedef struct FdSet {
+  int* fds;
+  int len;
+  int cap;
+} FdSet;
+
+void initFdSet(FdSet* set);
+void freeFdSet(FdSet* set);
+
+/* return 1 if fd was added, 0 if it was already there */
+int addFd(FdSet* set, int fd);
+
+/* return 1 if fd was removed, 0 if it was not there */
+int removeFd(FdSet* set, int fd);
+
+#endif
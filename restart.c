@@ -0,0 +1,286 @@
+#define _GNU_SOURCE /* MSG_CMSG_CLOEXEC */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "restart.h"
+
+#define RESTART_MAGIC 0x63616e74 /* "cant" */
+
+/* what the new process sends when it is ready, and once it holds the snapshot */
+typedef struct RestartHello {
+  int magic;
+  int version;
+} RestartHello;
+
+/* what the snapshot is sent after */
+typedef struct RestartHeader {
+  int magic;
+  int version;
+  int len; /* bytes */
+  int nfds;
+} RestartHeader;
+
+static pid_t successor = -1;
+
+void initSnapshot(Snapshot* s) {
+  memset(s, 0, sizeof(*s));
+}
+
+void freeSnapshot(Snapshot* s) {
+  free(s->data);
+  free(s->fds);
+  free(s->index);
+  initSnapshot(s);
+}
+
+/* grow buf, of elements of size bytes, to hold n more than len */
+static void grow(void* buf, int* cap, int len, int n, int size) {
+  if(len + n <= *cap) {
+    return;
+  }
+  int c = *cap ? *cap : 1024;
+  while(c < len + n) {
+    c *= 2;
+  }
+  *(void**)buf = realloc(*(void**)buf, (size_t)c * size);
+  *cap = c;
+}
+
+void putInt(Snapshot* s, long long v) {
+  grow(&s->data, &s->cap, s->len, sizeof(v), 1);
+  memcpy(s->data + s->len, &v, sizeof(v));
+  s->len += sizeof(v);
+}
+
+void putBytes(Snapshot* s, const void* buf, int len) {
+  putInt(s, len);
+  grow(&s->data, &s->cap, s->len, len, 1);
+  memcpy(s->data + s->len, buf, len);
+  s->len += len;
+}
+
+void putFd(Snapshot* s, int fd) {
+  if(fd >= s->indexCap) {
+    int cap = s->indexCap;
+    grow(&s->index, &s->indexCap, fd, 1, sizeof(int));
+    memset(s->index + cap, 0, sizeof(int) * (s->indexCap - cap));
+  }
+  if(s->index[fd] == 0) {
+    grow(&s->fds, &s->fdCap, s->nfds, 1, sizeof(int));
+    s->fds[s->nfds++] = fd;
+    s->index[fd] = s->nfds;
+  }
+  putInt(s, s->index[fd] - 1);
+}
+
+long long getInt(Snapshot* s) {
+  long long v;
+  if(s->pos + sizeof(v) > s->len) {
+    s->bad = 1;
+    return 0;
+  }
+  memcpy(&v, s->data + s->pos, sizeof(v));
+  s->pos += sizeof(v);
+  return v;
+}
+
+const char* getBytes(Snapshot* s, int* len) {
+  long long n = getInt(s);
+  if(n < 0 || n > s->len - s->pos) {
+    s->bad = 1;
+    *len = 0;
+    return s->data;
+  }
+  const char* buf = s->data + s->pos;
+  s->pos += n;
+  *len = n;
+  return buf;
+}
+
+int getFd(Snapshot* s) {
+  long long i = getInt(s);
+  if(i < 0 || i >= s->nfds) {
+    s->bad = 1;
+    return -1;
+  }
+  return s->fds[i];
+}
+
+/* send one message with nfds descriptors, return 0 or -1 */
+static int sendMessage(int sock, const void* buf, int len, const int* fds, int nfds) {
+  char control[CMSG_SPACE(sizeof(int) * RESTART_FDS)];
+  struct iovec iov = {(void*)buf, len};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if(nfds > 0) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+  }
+  ssize_t wb;
+  do {
+    wb = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while(wb < 0 && errno == EINTR);
+  return wb == len ? 0 : -1;
+}
+
+/* receive one message of exactly len bytes, return 0 or -1 */
+static int receiveMessage(int sock, void* buf, int len) {
+  ssize_t rb;
+  do {
+    rb = recv(sock, buf, len, 0);
+  } while(rb < 0 && errno == EINTR);
+  return rb == len ? 0 : -1;
+}
+
+/* the new process failed: make sure it is gone */
+static void abandonSuccessor(int sock) {
+  close(sock);
+  if(successor > 0) {
+    kill(successor, SIGKILL);
+    waitpid(successor, NULL, 0);
+    successor = -1;
+  }
+}
+
+int startSuccessor(char* argv[]) {
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+    printf("socketpair: %s\n", strerror(errno));
+    return -1;
+  }
+  /* the same options, without the -R this process may have been started with */
+  int argc = 0;
+  while(argv[argc]) {
+    argc++;
+  }
+  char** args = malloc(sizeof(char*) * (argc + 3));
+  char fd[16];
+  snprintf(fd, sizeof(fd), "%d", sv[1]);
+  int n = 0;
+  args[n++] = argv[0];
+  args[n++] = "-R";
+  args[n++] = fd;
+  for(int i = 1; i < argc; i++) {
+    if(strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+      i++;
+    } else {
+      args[n++] = argv[i];
+    }
+  }
+  args[n] = NULL;
+
+  /* nothing buffered is printed twice */
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0) {
+    /* its end of the pair is the only descriptor it inherits, besides the console */
+    fcntl(sv[1], F_SETFD, 0);
+    execvp(args[0], args);
+    _exit(127);
+  }
+  free(args);
+  close(sv[1]);
+  if(pid < 0) {
+    printf("fork: %s\n", strerror(errno));
+    close(sv[0]);
+    return -1;
+  }
+  successor = pid;
+
+  /* it is given as long as it takes to load, and to answer once it has the snapshot */
+  struct timeval tv = {RESTART_TIMEOUT_MS / 1000, (RESTART_TIMEOUT_MS % 1000) * 1000};
+  setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  RestartHello hello;
+  if(receiveMessage(sv[0], &hello, sizeof(hello)) < 0 || hello.magic != RESTART_MAGIC || hello.version != RESTART_VERSION) {
+    abandonSuccessor(sv[0]);
+    return -1;
+  }
+  return sv[0];
+}
+
+int handOver(int sock, Snapshot* s) {
+  RestartHeader h = {RESTART_MAGIC, RESTART_VERSION, s->len, s->nfds};
+  int ok = sendMessage(sock, &h, sizeof(h), NULL, 0) == 0;
+  for(int i = 0; ok && i < s->nfds; i += RESTART_FDS) {
+    int n = s->nfds - i < RESTART_FDS ? s->nfds - i : RESTART_FDS;
+    ok = sendMessage(sock, &n, sizeof(n), s->fds + i, n) == 0;
+  }
+  for(int off = 0; ok && off < s->len; off += RESTART_CHUNK) {
+    int n = s->len - off < RESTART_CHUNK ? s->len - off : RESTART_CHUNK;
+    ok = sendMessage(sock, s->data + off, n, NULL, 0) == 0;
+  }
+  RestartHello ack;
+  if(ok && receiveMessage(sock, &ack, sizeof(ack)) == 0 && ack.magic == RESTART_MAGIC) {
+    close(sock);
+    return 0;
+  }
+  abandonSuccessor(sock);
+  return -1;
+}
+
+int takeOver(int sock, Snapshot* s) {
+  initSnapshot(s);
+  RestartHello hello = {RESTART_MAGIC, RESTART_VERSION};
+  RestartHeader h;
+  if(sendMessage(sock, &hello, sizeof(hello), NULL, 0) < 0 || receiveMessage(sock, &h, sizeof(h)) < 0
+     || h.magic != RESTART_MAGIC || h.version != RESTART_VERSION || h.len < 0 || h.nfds < 0) {
+    return -1;
+  }
+  s->fds = malloc(sizeof(int) * (h.nfds + 1));
+  s->fdCap = h.nfds + 1;
+  while(s->nfds < h.nfds) {
+    int n;
+    char control[CMSG_SPACE(sizeof(int) * RESTART_FDS)];
+    struct iovec iov = {&n, sizeof(n)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    /* close-on-exec, so the next restart does not leak them */
+    ssize_t rb = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if(rb < 0 && errno == EINTR) {
+      continue;
+    }
+    struct cmsghdr* c = rb == sizeof(n) ? CMSG_FIRSTHDR(&msg) : NULL;
+    if(c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS || (msg.msg_flags & MSG_CTRUNC)
+       || n <= 0 || n > h.nfds - s->nfds || c->cmsg_len != CMSG_LEN(sizeof(int) * n)) {
+      return -1;
+    }
+    memcpy(s->fds + s->nfds, CMSG_DATA(c), sizeof(int) * n);
+    s->nfds += n;
+  }
+  s->data = malloc(h.len + 1);
+  s->cap = h.len + 1;
+  while(s->len < h.len) {
+    int n = h.len - s->len < RESTART_CHUNK ? h.len - s->len : RESTART_CHUNK;
+    if(receiveMessage(sock, s->data + s->len, n) < 0) {
+      return -1;
+    }
+    s->len += n;
+  }
+  return 0;
+}
+
+void tookOver(int sock) {
+  RestartHello ack = {RESTART_MAGIC, RESTART_VERSION};
+  sendMessage(sock, &ack, sizeof(ack), NULL, 0);
+  close(sock);
+}
@@ -0,0 +1,79 @@
+#ifndef RESTART_H
+#define RESTART_H
+
+/*
+ * Hot restart: handing the running server to a new process without closing
+ * a connection or ending a game
+ *
+ * On !restart the server starts the binary on disk again, with the same
+ * options, connected to it by a socket pair, and lets it load and start its
+ * threads while everything carries on. Only once the new process says it is
+ * ready does the old one freeze (see reactorFreeze): the accept threads
+ * stop, the reactor stops receiving input and running timers, and once
+ * nothing is left to handle nothing in the server changes any more. It then
+ * writes a Snapshot of everything the new process needs, the listening
+ * sockets, every connection with the input it has not handled and the
+ * output it has not sent, and every game that is not over with its moves,
+ * seats, spectators and clocks, and sends it over the socket pair, the
+ * descriptors with SCM_RIGHTS. The new process answers once it holds all of
+ * it, and the old one exits. The new process sets the connections and games
+ * up again, with the same game ids, while its own reactor is frozen, and
+ * starts serving them and accepting on the listening sockets it was sent.
+ *
+ * The clients see a pause of the time the snapshot takes to send, a few
+ * milliseconds for thousands of games, and queued connections wait in the
+ * listening socket's backlog meanwhile. If the new process fails before it
+ * answers, the old one kills it, thaws and carries on.
+ *
+ * A Snapshot is a buffer of integers and byte strings, read back in the
+ * order they were written, and a table of the descriptors it refers to,
+ * each sent once however often it is referred to.
+ */
+
+#define RESTART_VERSION 2 /* of the snapshot, a new process that reads another one does not take over */
+#define RESTART_FDS 253 /* descriptors sent in one message, the most the kernel takes */
+#define RESTART_CHUNK (32*1024) /* bytes of the snapshot sent in one message */
+#define RESTART_TIMEOUT_MS 10000 /* the new process must be ready and answer within this */
+
+typedef struct Snapshot {
+  char* data;
+  int len;
+  int cap;
+  int pos; /* where the next get reads */
+  int bad; /* a get ran past the end */
+  int* fds; /* by their index in the snapshot */
+  int nfds;
+  int fdCap;
+  int* index; /* while writing: the index plus one of each descriptor put, by descriptor */
+  int indexCap;
+} Snapshot;
+
+void initSnapshot(Snapshot* s);
+void freeSnapshot(Snapshot* s);
+
+void putInt(Snapshot* s, long long v);
+void putBytes(Snapshot* s, const void* buf, int len);
+/* a reference to fd, which is sent along with the snapshot */
+void putFd(Snapshot* s, int fd);
+
+/* 0 once the snapshot has run out, see bad */
+long long getInt(Snapshot* s);
+/* the next byte string, pointing into the snapshot, with its length in len */
+const char* getBytes(Snapshot* s, int* len);
+/* the descriptor this process received for the one put, -1 if there is none */
+int getFd(Snapshot* s);
+
+/*
+ * in the old process: start the new one, adding -R <descriptor> to argv,
+ * and return the socket to it once it is ready, or -1 if it failed
+ */
+int startSuccessor(char* argv[]);
+/* send the snapshot, return 0 once the new process holds it, or kill it and return -1 */
+int handOver(int sock, Snapshot* s);
+
+/* in the new process: say it is ready and receive the snapshot, return 0 or -1 */
+int takeOver(int sock, Snapshot* s);
+/* tell the old process to exit */
+void tookOver(int sock);
+
+#endif
@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include "searchpool.h"
+#include "list.h"
+
+typedef struct SearchJob {
+  void* owner;
+  EngineBoard board;
+  SearchLimits limits;
+  TransTable* tt; /* NULL to use the worker's table */
+  SearchCallback done;
+  void* ctx;
+  SearchSignals signals;
+  SearchResult result; /* kept while a finished ponder search waits for ponderHit */
+} SearchJob;
+
+typedef struct SearchPool {
+  pthread_mutex_t mtx;
+  pthread_cond_t work; /* a job may have become runnable */
+  pthread_cond_t finished; /* a running job has finished */
+  LList queue; /* SearchJob* in submission order */
+  LList parked; /* SearchJob* of ponder searches that finished before ponderHit */
+  LList idle; /* SearchSignals* of the searches of searchWhenIdle, stopped by the next job */
+  SearchJob* running[MAX_SEARCH_THREADS]; /* by worker, NULL when idle */
+  int nthreads;
+} SearchPool;
+
+static SearchPool pool;
+
+/* return 1 if a search for owner is running */
+static int ownerRunning(void* owner) {
+  for(int i = 0; i < pool.nthreads; i++) {
+    if(pool.running[i] && pool.running[i]->owner == owner) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * remove and return the oldest job whose owner is idle, NULL if there is none
+ * a ponder search is only taken when no other search can run, so pondering
+ * never holds up a move someone is waiting for
+ */
+static SearchJob* takeJob() {
+  for(int ponder = 0; ponder <= 1; ponder++) {
+    LLNode* cur = pool.queue.head;
+    for(int i = 0; cur; i++, cur = cur->next) {
+      SearchJob* job = *(SearchJob**)cur->data;
+      if(job->signals.pondering == ponder && !ownerRunning(job->owner)) {
+	removeIndex(&pool.queue, i);
+	return job;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void* searchWorker(void* data) {
+  int id = (int)(long)data;
+  /* lower this thread's priority so searches never starve the game threads */
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), SEARCH_NICE);
+  TransTable* tt = newTransTable(SEARCH_TT_BITS);
+
+  pthread_mutex_lock(&pool.mtx);
+  while(1) {
+    SearchJob* job;
+    while((job = takeJob()) == NULL) {
+      pthread_cond_wait(&pool.work, &pool.mtx);
+    }
+    pool.running[id] = job;
+    pthread_mutex_unlock(&pool.mtx);
+
+    searchBoard(&job->board, &job->limits, job->tt ? job->tt : tt, &job->signals, &job->result);
+
+    pthread_mutex_lock(&pool.mtx);
+    if(job->signals.pondering && !job->signals.stop) {
+      /*
+       * hold the result until the pondered move is played, the job leaves
+       * running as it is parked so ponderHit finds it in one place or the other
+       */
+      pushBackList(&pool.parked, &job, sizeof(SearchJob*));
+      pool.running[id] = NULL;
+      pthread_cond_broadcast(&pool.finished);
+      pthread_cond_signal(&pool.work);
+      continue;
+    }
+    pthread_mutex_unlock(&pool.mtx);
+
+    if(!job->signals.stop) {
+      job->done(job->ctx, &job->result);
+    }
+
+    pthread_mutex_lock(&pool.mtx);
+    pool.running[id] = NULL;
+    free(job);
+    pthread_cond_broadcast(&pool.finished);
+    /* another job of the same owner may now run */
+    pthread_cond_signal(&pool.work);
+  }
+  return NULL;
+}
+
+void startSearchPool(int nthreads) {
+  if(nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  }
+  if(nthreads < 1) {
+    nthreads = 1;
+  }
+  if(nthreads > MAX_SEARCH_THREADS) {
+    nthreads = MAX_SEARCH_THREADS;
+  }
+  pthread_mutex_init(&pool.mtx, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.finished, NULL);
+  initList(&pool.queue);
+  initList(&pool.parked);
+  initList(&pool.idle);
+  pool.nthreads = nthreads;
+  for(int i = 0; i < nthreads; i++) {
+    pool.running[i] = NULL;
+    pthread_t pid;
+    pthread_create(&pid, NULL, searchWorker, (void*)(long)i);
+    pthread_detach(pid);
+  }
+}
+
+static void queueJob(void* owner, EngineBoard* board, SearchLimits* limits, TransTable* tt, SearchCallback done, void* ctx, int ponder) {
+  SearchJob* job = malloc(sizeof(SearchJob));
+  job->owner = owner;
+  job->board = *board;
+  job->limits = *limits;
+  job->tt = tt;
+  job->done = done;
+  job->ctx = ctx;
+  job->signals.stop = 0;
+  job->signals.pondering = ponder;
+  if(!ponder) {
+    /* the time spent waiting for a worker counts against the limits */
+    job->limits.start = nowMs();
+  }
+
+  pthread_mutex_lock(&pool.mtx);
+  pushBackList(&pool.queue, &job, sizeof(SearchJob*));
+  /* the searches that only run while the pool is idle give way */
+  for(LLNode* cur = pool.idle.head; cur; cur = cur->next) {
+    (*(SearchSignals**)cur->data)->stop = 1;
+  }
+  pthread_cond_signal(&pool.work);
+  pthread_mutex_unlock(&pool.mtx);
+}
+
+void submitSearch(void* owner, EngineBoard* board, SearchLimits* limits, TransTable* tt, SearchCallback done, void* ctx) {
+  queueJob(owner, board, limits, tt, done, ctx, 0);
+}
+
+void submitPonder(void* owner, EngineBoard* board, SearchLimits* limits, TransTable* tt, SearchCallback done, void* ctx) {
+  queueJob(owner, board, limits, tt, done, ctx, 1);
+}
+
+/* remove and return owner's job from list (a list of SearchJob*), NULL if there is none */
+static SearchJob* removeOwnerJob(LList* list, void* owner) {
+  LLNode* cur = list->head;
+  for(int i = 0; cur; i++, cur = cur->next) {
+    SearchJob* job = *(SearchJob**)cur->data;
+    if(job->owner == owner) {
+      removeIndex(list, i);
+      return job;
+    }
+  }
+  return NULL;
+}
+
+int ponderHit(void* owner) {
+  pthread_mutex_lock(&pool.mtx);
+  /* already finished: deliver the held result */
+  SearchJob* job = removeOwnerJob(&pool.parked, owner);
+  if(job) {
+    pthread_mutex_unlock(&pool.mtx);
+    job->done(job->ctx, &job->result);
+    free(job);
+    return 1;
+  }
+
+  /* still searching: let the time limits apply from now on */
+  for(int i = 0; i < pool.nthreads; i++) {
+    if(pool.running[i] && pool.running[i]->owner == owner && pool.running[i]->signals.pondering) {
+      pool.running[i]->signals.pondering = 0;
+      pthread_mutex_unlock(&pool.mtx);
+      return 1;
+    }
+  }
+  /* not started yet: it is now a normal search, which has waited since now */
+  for(LLNode* cur = pool.queue.head; cur; cur = cur->next) {
+    job = *(SearchJob**)cur->data;
+    if(job->owner == owner && job->signals.pondering) {
+      job->signals.pondering = 0;
+      job->limits.start = nowMs();
+      pthread_mutex_unlock(&pool.mtx);
+      return 1;
+    }
+  }
+  pthread_mutex_unlock(&pool.mtx);
+  return 0;
+}
+
+void cancelSearches(void* owner) {
+  pthread_mutex_lock(&pool.mtx);
+  /* drop the queued and parked jobs */
+  SearchJob* job;
+  while((job = removeOwnerJob(&pool.queue, owner)) != NULL) {
+    free(job);
+  }
+  while((job = removeOwnerJob(&pool.parked, owner)) != NULL) {
+    free(job);
+  }
+  /* stop the running ones and wait for them */
+  for(int i = 0; i < pool.nthreads; i++) {
+    if(pool.running[i] && pool.running[i]->owner == owner) {
+      pool.running[i]->signals.stop = 1;
+    }
+  }
+  while(ownerRunning(owner)) {
+    pthread_cond_wait(&pool.finished, &pool.mtx);
+  }
+  pthread_mutex_unlock(&pool.mtx);
+}
+
+/* the pool must be locked */
+static int poolLoad() {
+  int load = pool.queue.len;
+  for(int i = 0; i < pool.nthreads; i++) {
+    load += pool.running[i] != NULL;
+  }
+  return load;
+}
+
+int searchPoolLoad() {
+  pthread_mutex_lock(&pool.mtx);
+  int load = poolLoad();
+  pthread_mutex_unlock(&pool.mtx);
+  return load;
+}
+
+int searchWhenIdle(EngineBoard* b, SearchLimits* limits, TransTable* tt, SearchResult* result) {
+  SearchSignals signals = {0, 0};
+  SearchSignals* sp = &signals;
+  pthread_mutex_lock(&pool.mtx);
+  if(poolLoad() > 0) {
+    pthread_mutex_unlock(&pool.mtx);
+    return 0;
+  }
+  pushBackList(&pool.idle, &sp, sizeof(SearchSignals*));
+  pthread_mutex_unlock(&pool.mtx);
+
+  searchBoard(b, limits, tt, &signals, result);
+
+  pthread_mutex_lock(&pool.mtx);
+  int i = 0;
+  for(LLNode* cur = pool.idle.head; cur; cur = cur->next, i++) {
+    if(*(SearchSignals**)cur->data == sp) {
+      removeIndex(&pool.idle, i);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool.mtx);
+  return !signals.stop;
+}
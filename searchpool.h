@@ -0,0 +1,67 @@
+#ifndef SEARCHPOOL_H
+#define SEARCHPOOL_H
+
+#include "engine.h"
+
+/*
+ * A shared, bounded pool of threads that runs every engine search in the
+ * server
+ *
+ * Searches are queued with an owner (usually a Game*). Workers take the
+ * oldest queued search whose owner has no search running, so one game can
+ * never hold more than one worker and every owner is served in turn. Ponder
+ * searches only get a worker no other search can use. The workers run at a
+ * lower priority than the connection handling threads and each search is
+ * bounded by its SearchLimits, whose time counts from when it was queued.
+ */
+
+#define MAX_SEARCH_THREADS 64
+#define SEARCH_NICE 10 /* niceness of the worker threads */
+#define SEARCH_TT_BITS 16 /* per-worker transposition table size */
+
+/* called from a worker thread when a search completes */
+typedef void (*SearchCallback)(void* ctx, SearchResult* result);
+
+/*
+ * start the pool with nthreads workers
+ * 0 uses one less than the number of cores (at least one)
+ */
+void startSearchPool(int nthreads);
+
+/*
+ * queue a search of a copy of board, done(ctx, result) is called when it completes
+ * tt is the owner's transposition table, or NULL to use the worker's own
+ */
+void submitSearch(void* owner, EngineBoard* board, SearchLimits* limits, TransTable* tt, SearchCallback done, void* ctx);
+
+/*
+ * queue a ponder search: it runs within the depth and node limits, but its
+ * result is held back (and the time limits do not start) until ponderHit
+ */
+void submitPonder(void* owner, EngineBoard* board, SearchLimits* limits, TransTable* tt, SearchCallback done, void* ctx);
+
+/*
+ * the move owner pondered on was played: its ponder search becomes a normal
+ * search, or delivers its result at once if it has already finished
+ * returns 0 if owner has no ponder search
+ */
+int ponderHit(void* owner);
+
+/*
+ * drop the queued searches of owner and stop its running ones
+ * when this returns no callback for owner is running or will run
+ */
+void cancelSearches(void* owner);
+
+/* number of queued and running searches */
+int searchPoolLoad();
+
+/*
+ * search b on the calling thread, but only while the pool has nothing to
+ * do: it is not started while a search is queued or running, and is
+ * stopped as soon as one is queued
+ * return 0 if it did not run to the end, result is then of no use
+ */
+int searchWhenIdle(EngineBoard* b, SearchLimits* limits, TransTable* tt, SearchResult* result);
+
+#endif
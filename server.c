@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* accept4 */
 #include <unistd.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -7,50 +8,144 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #include "game.h"
 #include "list.h"
 #include "board.h"
 #include "command.h"
-
-#define MAX_CONNECTIONS 16
-#define MAX_GAMES 8
-#define MAX_SPECTATORS 8
-
-#define TIMEOUT_S 0
-#define TIMEOUT_US 10000 /* 10 ms, 10000 us */
+#include "bitbase.h"
+#include "engine.h"
+#include "searchpool.h"
+#include "analysis.h"
+#include "annotate.h"
+#include "reactor.h"
+#include "timer.h"
+#include "registry.h"
+#include "directory.h"
+#include "matchmaking.h"
+#include "connection.h"
+#include "fanout.h"
+#include "uring.h"
+#include "shard.h"
+#include "restart.h"
+#include "journal.h"
+
+#define MAX_BOT_LEVEL 6
+#define BOT_SEAT -1 /* the descriptor of a seat taken by the engine */
+#define VACANT_SEAT -2 /* the descriptor of a seat of a recovered game no one has taken back */
+#define MAX_MINUTES 180 /* longest time control */
+#define MAX_INCREMENT 60
+/* the matchmaker's keys, one per time control, 0 for games without a clock */
+#define TIME_CONTROLS ((MAX_MINUTES + 1) * (MAX_INCREMENT + 1))
+#define MAX_HUB_THREADS 16
+#define HUB_BATCH 64 /* inputs a hub thread takes per wakeup */
+#define MAX_ACCEPTORS 16
+#define DEFAULT_BACKLOG 1024 /* connections the kernel holds until they are accepted */
+#define ACCEPT_COMPLETIONS 1024 /* accepted connections an io_uring accept thread can have waiting */
+#define DEFAULT_IDLE_MINUTES 10 /* a client in the hub room that sends nothing for this long is closed */
+#define DEFAULT_ABANDON_MINUTES 30 /* a game waiting this long for a player or, without a clock, for a move is over */
+#define JOURNAL_DIR "./journal"
 
 /* global integer */
 int debug;
 
+/* limits set on the command line, 0 for no limit */
+int maxConnections;
+int maxGames;
+int maxSpectators; /* per game */
+/* timeouts set on the command line in milliseconds, 0 for none */
+long idleTimeout;
+long abandonTimeout;
+
+/* how the server is run, set on the command line */
+int highWater; /* bytes, 0 for the default */
+int maxQueued;
+int backlog;
+int n_acceptors;
+int useUring;
+int journalInterval; /* milliseconds between the journal's syncs, 0 if no journal is kept */
+
+/* the arguments the server was started with, to start it again on a hot restart */
+char** serverArgv;
+/* the socket to the process this one takes over from, -1 unless started by a hot restart */
+int restartSock = -1;
+
+/* open client connections, changed atomically */
+volatile int n_connections;
+/* connections turned away because the server was full, changed atomically */
+long n_shed;
+
+/*
+ * the hub room is served by several threads, each of which owns the clients
+ * whose descriptor maps to it (see hubOf) and is the only one to read, close
+ * or hand on their descriptors
+ */
+typedef struct Hub {
+  Inbox inbox; /* input from the hub's clients is posted here by the reactor */
+  /* the reap epoch the thread had seen when it last held no game, LONG_MAX
+     while it sleeps (see reapGames) */
+  volatile long seen;
+} Hub;
+
+Hub hubs[MAX_HUB_THREADS];
+int n_hubs;
+
+/* counts the games taken out of the directory, changed atomically */
+long reapEpoch;
+
+/* the inbox of the hub thread that serves fd in the hub room */
+Inbox* hubOf(int fd) {
+  return &hubs[fd % n_hubs].inbox;
+}
+
 typedef struct Game {
   Position* pos;
   int status; /* WAITING, ONGOING, COMPLETED */
   int id;
   int n_players;
-  int n_spectators;
   int players[2]; /* player file descriptors */
   int white; /* white file descriptor */
   int black; /* black file descriptor */
-  int spectators[MAX_SPECTATORS]; /* spectator file descriptors */
-  pthread_mutex_t mtx; /* mutex */
-  pthread_cond_t ready; /* ready to start signal */
+  FdSet spectators; /* spectator file descriptors */
+  Audience audience; /* delivers the boards and messages to the spectators */
+  int bot; /* level of the engine in the second seat, 0 if both players are human */
+  int botPipe[2]; /* the search pool writes the engine's moves into botPipe[1] */
+  Move ponderMove; /* the reply the engine is pondering on, start is -1 if none */
+  int moves; /* half-moves played */
+  int timed; /* 1 if the game is played with a clock */
+  long clock[3]; /* remaining milliseconds by color */
+  long increment; /* milliseconds added after each move */
+  long long turnStart; /* when the player to move started thinking, or when the game started waiting */
+  Analysis* analysis; /* live analysis for the spectators, NULL until one asks */
+  LList history; /* Move, every move played so far */
+  const char* result; /* 1-0, 0-1, 1/2-1/2, or * while undecided */
+  char termination[64]; /* how the game ended */
+  /* input from the game's clients and the bot pipe, and the clients the hub
+     room hands over; the game is only touched by the worker serving it */
+  Inbox inbox;
+  Directory* directory; /* where the game's summary is published */
+  MatchEntry match; /* in the matchmaker's queue while the game waits for a player */
+  Timer timer; /* expires at the game's deadline, see gameTimeLeft */
+  long retired; /* the reap epoch the game was taken out of the directory in, 0 before */
+  int journal; /* the journal segment the game's records start in, -1 if it is not journaled */
 } Game;
 
-/*
- * initialize with extra space for the array
- */
-typedef struct ProtectedIntArray {
-  pthread_mutex_t mtx;
-  int arr[0];
-} ProtectedIntArray;
+/* the events the hub room posts to a game's inbox, besides input */
+#define GAME_START EVENT_OWNER /* the client that created the game takes the first seat */
+#define GAME_JOIN_PLAYER (EVENT_OWNER + 1) /* a client asks for the second seat */
+#define GAME_JOIN_SPECTATOR (EVENT_OWNER + 2) /* a client asks to spectate */
 
-typedef struct ProtectedGameArray {
-  pthread_mutex_t mtx;
-  Game* arr[0];
-} ProtectedGameArray;
+/* completed games, taken out of the directory by the hub room once no worker holds them */
+pthread_mutex_t finishedMtx = PTHREAD_MUTEX_INITIALIZER;
+LList finishedGames;
+
+/* the games waiting for a second player */
+Matchmaker matchmaker;
 
 void checkError(int status,int line) {
   if (status < 0) {
@@ -67,93 +162,194 @@ int logStr(char* str) {
 }
 
 
+#define SUSPENDED 3 /* recovered from the journal, until its players take their seats back */
 #define WAITING 2
 #define ONGOING 1
 #define COMPLETED 0
-/* creates a server-side socket that binds to the given port number and listens for TCP connect requests */
-int bindAndListen(int port)
+/*
+ * creates a non-blocking server-side socket that binds to the given port
+ * number and listens for TCP connect requests with the given backlog
+ * with shared set, several sockets can listen on the port, and the kernel
+ * spreads the incoming connections over them
+ * returns -1 if shared is set and the port cannot be shared
+ */
+int bindAndListen(int port, int backlog, int shared)
 {
-  int sid = socket(PF_INET,SOCK_STREAM,0);
+  int sid = socket(PF_INET,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+  checkError(sid,__LINE__);
+  int on = 1;
+  /* a restart must not wait for the last run's connections to leave TIME_WAIT */
+  setsockopt(sid, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if(shared && setsockopt(sid, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+    close(sid);
+    return -1;
+  }
   struct sockaddr_in addr;
   addr.sin_family = AF_INET;
   addr.sin_port   = htons(port);
   addr.sin_addr.s_addr = INADDR_ANY;
   int status = bind(sid,(struct sockaddr*)&addr,sizeof(addr));
   checkError(status,__LINE__);
-  status = listen(sid,10);
+  status = listen(sid,backlog);
   checkError(status,__LINE__);
   return sid;
 }
 
-typedef struct HubThreadArgs {
-  ProtectedIntArray* clients;
-  ProtectedGameArray* games;
-} HubThreadArgs;
-
-typedef struct CommandHubThreadArgs {
-  int fd;
-  ProtectedIntArray* clients;
-  ProtectedGameArray* games;
-} CommandHubThreadArgs;
+void serveGame(void* data, InboxEvent* event);
 
-Game* newGame(int id) {
+/* the game's id is set when it is added to the directory */
+Game* newGame() {
   Game* game = malloc(sizeof(Game));
   game->pos = newPosition();
   game->status = WAITING;
-  game->id = id;
+  game->id = -1;
+  game->directory = NULL;
+  initMatchEntry(&game->match);
+  game->retired = 0;
+  game->journal = -1;
   game->n_players = 0;
-  game->n_spectators = 0;
+  initFdSet(&game->spectators);
+  initAudience(&game->audience);
   game->white = game->black = 0;
-  pthread_mutex_init(&game->mtx, NULL);
-  pthread_cond_init(&game->ready, NULL);
-  for(int i = 0; i < MAX_SPECTATORS; i++) {
-    game->spectators[i] = 0;
-  }
+  game->bot = 0;
+  game->botPipe[0] = game->botPipe[1] = -1;
+  game->ponderMove.start = game->ponderMove.end = -1;
+  game->moves = 0;
+  game->timed = 0;
+  game->clock[WHITE] = game->clock[BLACK] = 0;
+  game->increment = 0;
+  game->turnStart = 0;
+  game->analysis = NULL;
+  initList(&game->history);
+  game->result = "*";
+  strcpy(game->termination, "Unterminated");
+  initInbox(&game->inbox);
+  serveInbox(&game->inbox, serveGame, game);
+  initTimer(&game->timer, &game->inbox, -1);
   return game;
 }
 
 void destroyGame(Game* game) {
   freePosition(game->pos);
   free(game->pos);
-  pthread_mutex_destroy(&game->mtx);
-  pthread_cond_destroy(&game->ready);
+  freeList(&game->history);
+  destroyInbox(&game->inbox);
+  freeFdSet(&game->spectators);
+  destroyAudience(&game->audience);
   free(game);
 }
 
-/* replace first 0 in arr with n */
-/* return 1 on success, 0 otherwise */
-int addInt(int n, int arr[]) {
-  int sz = sizeof(arr) / sizeof(*arr);
-  for(int i = 0; i < sz; i++) {
-    if(arr[i] == 0) {
-      arr[i] = n;
-      return 1;
+/* stop watching a client's connection and close it */
+void closeClient(int fd) {
+  reactorRemove(fd);
+  freeConnection(fd);
+  close(fd);
+  __sync_fetch_and_sub(&n_connections, 1);
+}
+
+/* returns 1 if there is data to read in the file descriptor fd, 0 otherwise */
+int dataToRead(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  int pollResult = poll(&pfd, 1, 0); /* a timeout of 0 ensures that poll doesn't block */
+  return pollResult > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR));
+}
+
+/* publish what the lobby sees of the game */
+void publishGame(Game* game) {
+  int players = game->n_players;
+  for(int i = 0; i < game->n_players; i++) {
+    if(game->players[i] == VACANT_SEAT) {
+      players--;
     }
   }
-  return 0;
+  GameSummary summary = {game->id, game->status, players, game->spectators.len, game->bot};
+  publishSummary(game->directory, game->id, &summary);
 }
 
-/* replace n in arr with 0 */
-/* return 1 on success, 0 otherwise */
-int removeInt(int n, int arr[]) {
-  int sz = sizeof(arr) / sizeof(*arr);
-  for(int i = 0; i < sz; i++) {
-    if(arr[i] == n) {
-      arr[i] = 0;
-      return 1;
+/* add to the reply to a player's seat, nothing is sent to the engine's seat or an empty one */
+void respondSeat(int fd, const void* buf, int len) {
+  if(fd >= 0) {
+    respond(fd, buf, len);
+  }
+}
+
+/* send the replies built for the players and spectators of a game */
+void submitGame(Game* game) {
+  for(int i = 0; i < 2; i++) {
+    if(game->players[i] >= 0) {
+      submitResponse(game->players[i]);
     }
   }
-  return 0;
+  for(int i = 0; i < game->spectators.len; i++) {
+    submitResponse(game->spectators.fds[i]);
+  }
 }
 
-/* returns 1 if there is data to read in the file descriptor fd, 0 otherwise */
-int dataToRead(int fd) {
-  fd_set fdin;
-  FD_ZERO(&fdin);
-  FD_SET(fd, &fdin);
-  struct timeval timeout = {0, 0}; /* ensure that select doesn't block */
-  int selectResult = select(fd+1, &fdin, NULL, NULL, &timeout);
-  return selectResult > 0;
+/* the board after the half-move numbered seq, in the forms it is sent in */
+typedef struct BoardUpdate {
+  int seq; /* half-moves played */
+  int moved; /* 0 before the first move */
+  int checkpoint; /* delta subscribers get the full position too */
+  unsigned char delta[6]; /* PL_DELTA payload, the PL_MOVE payload is the last two bytes */
+  unsigned char pos[5 + BOARD_PACKED]; /* PL_CHECKPOINT payload, the PL_POS payload follows the sequence number */
+  char deltaText[32]; /* the delta line of the text protocol, with its terminator */
+  int deltaTextLen;
+} BoardUpdate;
+
+void buildUpdate(Game* game, BoardUpdate* u) {
+  u->seq = game->moves;
+  u->moved = game->history.len > 0;
+  u->checkpoint = !u->moved || u->seq % DELTA_CHECKPOINT == 0;
+  for(int i = 0; i < 4; i++) {
+    u->delta[i] = u->pos[i] = u->seq >> (24 - 8*i);
+  }
+  u->pos[4] = game->pos->toMove;
+  packBoard(game->pos->board, u->pos + 5);
+  u->deltaTextLen = 0;
+  if(u->moved) {
+    Move* m = peekBackList(&game->history);
+    u->delta[4] = m->start, u->delta[5] = m->end;
+    char from[3], to[3];
+    squareToString(from, m->start);
+    squareToString(to, m->end);
+    u->deltaTextLen = snprintf(u->deltaText, sizeof(u->deltaText), "delta %d %.2s%.2s\n", u->seq, from, to) + 1;
+  }
+}
+
+/* add the position to fd's reply as a checkpoint, text is the board in fd's orientation */
+void respondPosition(int fd, char* text, BoardUpdate* u) {
+  if(connectionBinary(fd)) {
+    respondEvent(fd, PL_CHECKPOINT, u->pos, sizeof(u->pos));
+  } else {
+    respondf(fd, "position %d\n", u->seq);
+    respond(fd, text, BOARD_STRLEN);
+  }
+}
+
+/* add the board to a player's reply, in the form the player gets it */
+void respondBoard(int fd, char* text, BoardUpdate* u) {
+  if(fd < 0) {
+    return;
+  }
+  int mode = outputMode(fd);
+  if(mode & OUTPUT_DELTAS) {
+    if(u->moved && (mode & OUTPUT_BINARY)) {
+      respondEvent(fd, PL_DELTA, u->delta, sizeof(u->delta));
+    } else if(u->moved) {
+      respond(fd, u->deltaText, u->deltaTextLen);
+    }
+    if(u->checkpoint) {
+      respondPosition(fd, text, u);
+    }
+  } else if(mode & OUTPUT_BINARY) {
+    /* the move just played, if any, and the position */
+    if(u->moved) {
+      respondEvent(fd, PL_MOVE, u->delta + 4, 2);
+    }
+    respondEvent(fd, PL_POS, u->pos + 4, 1 + BOARD_PACKED);
+  } else {
+    respond(fd, text, BOARD_STRLEN);
+  }
 }
 
 /* sends the current board to players and spectators */
@@ -162,37 +358,202 @@ void sendBoard(Game* game) {
   char wbuf[BOARD_STRLEN], bbuf[BOARD_STRLEN];
   boardToBufWhite(game->pos->board, wbuf);
   boardToBufBlack(game->pos->board, bbuf);
-  write(game->white, wbuf, BOARD_STRLEN);
-  for(int i = 0; i < MAX_SPECTATORS; i++) {
-    if(game->spectators[i]) {
-      write(game->spectators[i], wbuf, BOARD_STRLEN);
-    }
+  BoardUpdate u;
+  buildUpdate(game, &u);
+
+  /* the full board, superseded by the next one */
+  char bin[2*FRAME_HEADER + 2 + 1 + BOARD_PACKED];
+  int bl = 0;
+  if(u.moved) {
+    bl += putFrame(bin, PL_MOVE, u.delta + 4, 2);
+  }
+  bl += putFrame(bin + bl, PL_POS, u.pos + 4, 1 + BOARD_PACKED);
+
+  /* the delta, which is not */
+  char text[sizeof(u.deltaText) + 32 + BOARD_STRLEN];
+  int tl = 0;
+  char deltas[2*FRAME_HEADER + sizeof(u.delta) + sizeof(u.pos)];
+  int dl = 0;
+  if(u.moved) {
+    memcpy(text, u.deltaText, u.deltaTextLen);
+    tl += u.deltaTextLen;
+    dl += putFrame(deltas, PL_DELTA, u.delta, sizeof(u.delta));
   }
-  write(game->black, bbuf, BOARD_STRLEN);
+  if(u.checkpoint) {
+    tl += snprintf(text + tl, sizeof(text) - tl, "position %d\n", u.seq);
+    memcpy(text + tl, wbuf, BOARD_STRLEN);
+    tl += BOARD_STRLEN;
+    dl += putFrame(deltas + dl, PL_CHECKPOINT, u.pos, sizeof(u.pos));
+  }
+
+  respondBoard(game->white, wbuf, &u);
+  const void* board[FORMS] = {wbuf, bin, "", ""};
+  int boardLen[FORMS] = {BOARD_STRLEN, bl, 0, 0};
+  publishForms(&game->audience, board, boardLen, 1);
+  const void* delta[FORMS] = {"", "", text, deltas};
+  int deltaLen[FORMS] = {0, 0, tl, dl};
+  publishForms(&game->audience, delta, deltaLen, 0);
+  respondBoard(game->black, bbuf, &u);
 }
 
+/* board: the current position as a checkpoint, for a client that lost track of it */
+void commandBoard(int fd, Game* game) {
+  char buf[BOARD_STRLEN];
+  if(fd == game->black) {
+    boardToBufBlack(game->pos->board, buf);
+  } else {
+    boardToBufWhite(game->pos->board, buf);
+  }
+  BoardUpdate u;
+  buildUpdate(game, &u);
+  respondPosition(fd, buf, &u);
+}
 
-#define COMMAND_BUFSIZE 16
-#define COMMANDARG_BUFSIZE 16
+/* deltas [on|off]: get boards as deltas, see command.h */
+void commandDeltas(int fd, char* args) {
+  if(strcmp(args, "on") != 0 && strcmp(args, "off") != 0 && args[0] != 0) {
+    char msg[] = "Usage: deltas [on|off]\n";
+    respond(fd, msg, sizeof(msg));
+    return;
+  }
+  int on = strcmp(args, "off") != 0;
+  setDeltas(fd, on);
+  if(on) {
+    char msg[] = "Boards are sent as deltas.\n";
+    respond(fd, msg, sizeof(msg));
+  } else {
+    char msg[] = "Boards are sent in full.\n";
+    respond(fd, msg, sizeof(msg));
+  }
+}
 
 #define CHECKMATE 0
 #define RESIGNATION 1
 #define STALEMATE 0
+#define ADJUDICATION 2 /* decided by an endgame bitbase */
+#define TIMEOUT 3 /* the loser ran out of time */
+#define ABANDONMENT 4 /* the loser did not move in time in a game without a clock */
+
+/* hands the finished game to the annotator, which archives it */
+void archiveGame(Game* game) {
+  if(game->history.len == 0) {
+    return;
+  }
+  AnnotationJob* job = malloc(sizeof(AnnotationJob));
+  job->id = game->id;
+  if(game->white == BOT_SEAT) {
+    snprintf(job->white, sizeof(job->white), "engine level %d", game->bot);
+  } else {
+    strcpy(job->white, "player");
+  }
+  if(game->black == BOT_SEAT) {
+    snprintf(job->black, sizeof(job->black), "engine level %d", game->bot);
+  } else {
+    strcpy(job->black, "player");
+  }
+  snprintf(job->result, sizeof(job->result), "%s", game->result);
+  snprintf(job->termination, sizeof(job->termination), "%s", game->termination);
+  /* the annotator takes the move list */
+  job->moves = game->history;
+  initList(&game->history);
+  queueAnnotation(job);
+}
+
+/* records the result for the archive, msg is the announcement */
+void setResult(Game* game, const char* result, const char* msg) {
+  game->result = result;
+  int len = snprintf(game->termination, sizeof(game->termination), "%s", msg);
+  /* drop the newline */
+  if(len > 0 && len < sizeof(game->termination) && game->termination[len-1] == '\n') {
+    game->termination[len-1] = 0;
+  }
+}
+
+/* write a game that has begun to the journal as it stands, see journal.h */
+void journalGame(Game* game) {
+  JournalRecord r;
+  memset(&r, 0, sizeof(r));
+  r.type = JOURNAL_BEGIN;
+  r.game = game->id;
+  r.bot = game->bot;
+  r.botWhite = game->white == BOT_SEAT;
+  r.timed = game->timed;
+  r.white = game->clock[WHITE];
+  r.black = game->clock[BLACK];
+  r.increment = game->increment;
+  game->journal = journalBegin(&r);
+  if(game->journal < 0) {
+    return;
+  }
+  r.type = JOURNAL_MOVE;
+  for(LLNode* cur = game->history.head; cur; cur = cur->next) {
+    Move* m = cur->data;
+    r.start = m->start;
+    r.end = m->end;
+    journalAppend(&r);
+  }
+}
+
+/* journal a move the game played, with the clocks after it */
+void journalMove(Game* game, Move* m) {
+  JournalRecord r;
+  memset(&r, 0, sizeof(r));
+  r.type = JOURNAL_MOVE;
+  r.game = game->id;
+  r.start = m->start;
+  r.end = m->end;
+  r.white = game->clock[WHITE];
+  r.black = game->clock[BLACK];
+  journalAppend(&r);
+}
+
+/* the journal no longer needs the game */
+void journalGameEnd(Game* game) {
+  if(game->journal < 0) {
+    return;
+  }
+  JournalRecord r;
+  memset(&r, 0, sizeof(r));
+  r.type = JOURNAL_END;
+  r.game = game->id;
+  journalEnd(&r, game->journal);
+  game->journal = -1;
+}
 
 void deconstructGame(Game* game) {
   game->status = COMPLETED;
+  cancelTimer(&game->timer);
+  publishGame(game);
+  withdrawGame(&matchmaker, &game->match);
+  archiveGame(game);
+  journalGameEnd(game);
+
+  /* make sure the engine is no longer thinking about this game */
+  if(game->bot) {
+    cancelSearches(game);
+    reactorRemove(game->botPipe[0]);
+    close(game->botPipe[0]);
+    close(game->botPipe[1]);
+  }
+  if(game->analysis) {
+    freeAnalysis(game->analysis);
+    game->analysis = NULL;
+  }
 
-  /* close the connections */
-  close(game->white);
-  close(game->black);
-  for(int i = 0; i < MAX_SPECTATORS; i++) {
-    if(game->spectators[i]) {
-      close(game->spectators[i]);
+  /* close the connections, a game that never began has one player */
+  for(int i = 0; i < game->n_players; i++) {
+    if(game->players[i] >= 0) {
+      closeClient(game->players[i]);
     }
   }
-
-  pthread_mutex_unlock(&game->mtx);
-  pthread_exit(NULL); /* kill the game thread */
+  /* the spectators once the fan-out has sent them the result */
+  closeAudience(&game->audience, closeClient);
+
+  /* the hub room removes the game once no worker holds it */
+  pthread_mutex_lock(&finishedMtx);
+  pushBackList(&finishedGames, &game, sizeof(Game*));
+  pthread_mutex_unlock(&finishedMtx);
+  /* the worker serving the game stops once it sees the game is completed */
 }
 
 /* Use to end the game when a player disconnects */
@@ -203,19 +564,43 @@ void endGameDisconnect(Game* game, int fd) {
   char msg[] = "Uh oh. Someone disconnected! The game is now over.\n";
   if(game->white != fd) {
     /* white didn't DC */
-    write(game->white, msg, sizeof(msg));
+    respondSeat(game->white, msg, sizeof(msg));
   }
   if(game->black != fd) {
     /* black didn't DC */
-    write(game->black, msg, sizeof(msg));
-  }
-  for(int i = 0; i < MAX_SPECTATORS; i++) {
-    if(game->spectators[i]) {
-      write(game->spectators[i], msg, sizeof(msg));
-    }
+    respondSeat(game->black, msg, sizeof(msg));
   }
+  publish(&game->audience, msg, sizeof(msg), NULL, 0, 0);
 
   /* deconstruct the game */
+  setResult(game, "*", "Abandoned");
+  deconstructGame(game);
+}
+
+/* Use to end a game no one joined in time */
+void endGameExpired(Game* game) {
+  char msg[] = "No one joined the game in time. The game is over.\n";
+  respond(game->players[0], msg, sizeof(msg));
+  publish(&game->audience, msg, sizeof(msg), NULL, 0, 0);
+  setResult(game, "*", "Abandoned");
+  deconstructGame(game);
+}
+
+/* Use to end a recovered game its players did not come back to in time */
+void endGameUnclaimed(Game* game) {
+  char msg[] = "The players did not come back to the game in time. The game is over.\n";
+  respondSeat(game->white, msg, sizeof(msg));
+  respondSeat(game->black, msg, sizeof(msg));
+  publish(&game->audience, msg, sizeof(msg), NULL, 0, 0);
+  setResult(game, "*", "Abandoned");
+  deconstructGame(game);
+}
+
+/* Use to end a game that never began because its player left */
+void endGameWaiting(Game* game) {
+  char msg[] = "The player waiting for an opponent has left. The game is over.\n";
+  publish(&game->audience, msg, sizeof(msg), NULL, 0, 0);
+  setResult(game, "*", "Abandoned");
   deconstructGame(game);
 }
 
@@ -226,18 +611,21 @@ void endGameWhite(Game* game, int reason) {
     wb = sprintf(buf, "White wins by %s!\n", "checkmate");
   } else if(reason == RESIGNATION) {
     wb = sprintf(buf, "White wins by %s.\n", "resignation");
+  } else if(reason == ADJUDICATION) {
+    wb = sprintf(buf, "White wins by %s.\n", "adjudication");
+  } else if(reason == TIMEOUT) {
+    wb = sprintf(buf, "White wins on %s.\n", "time");
+  } else if(reason == ABANDONMENT) {
+    wb = sprintf(buf, "White wins by %s.\n", "abandonment");
   } else {
     wb = sprintf(buf, "White wins.\n");
   }
+  setResult(game, "1-0", buf);
 
   /* announce that the game is over */
-  write(game->white, buf, wb+1);
-  write(game->black, buf, wb+1);
-  for(int i = 0; i < MAX_SPECTATORS; i++) {
-    if(game->spectators[i]) {
-      write(game->spectators[i], buf, wb+1);
-    }
-  }
+  respondSeat(game->white, buf, wb+1);
+  respondSeat(game->black, buf, wb+1);
+  publish(&game->audience, buf, wb+1, NULL, 0, 0);
 
   /* deconstruct and end the game */
   deconstructGame(game);
@@ -250,40 +638,42 @@ void endGameBlack(Game* game, int reason) {
     wb = sprintf(buf, "Black wins by %s!\n", "checkmate");
   } else if(reason == RESIGNATION) {
     wb = sprintf(buf, "Black wins by %s.\n", "resignation");
+  } else if(reason == ADJUDICATION) {
+    wb = sprintf(buf, "Black wins by %s.\n", "adjudication");
+  } else if(reason == TIMEOUT) {
+    wb = sprintf(buf, "Black wins on %s.\n", "time");
+  } else if(reason == ABANDONMENT) {
+    wb = sprintf(buf, "Black wins by %s.\n", "abandonment");
   } else {
     wb = sprintf(buf, "Black wins.\n");
   }
+  setResult(game, "0-1", buf);
 
   /* announce */
-  write(game->white, buf, wb+1);
-  write(game->black, buf, wb+1);
-  for(int i = 0; i < MAX_SPECTATORS; i++) {
-    if(game->spectators[i]) {
-      write(game->spectators[i], buf, wb+1);
-    }
-  }
+  respondSeat(game->white, buf, wb+1);
+  respondSeat(game->black, buf, wb+1);
+  publish(&game->audience, buf, wb+1, NULL, 0, 0);
 
   /* deconstruct */
   deconstructGame(game);
 }
 
 void endGameDraw(Game* game, int reason) {
-  char buf[32];
+  char buf[64];
   int wb;
   if(reason == STALEMATE) {
     wb = sprintf(buf, "The game is drawn by %s.\n", "stalemate");
+  } else if(reason == ADJUDICATION) {
+    wb = sprintf(buf, "The game is drawn by %s.\n", "adjudication");
   } else {
     wb = sprintf(buf, "The game is drawn.\n");
   }
+  setResult(game, "1/2-1/2", buf);
 
   /* announce */
-  write(game->white, buf, wb+1);
-  write(game->black, buf, wb+1);
-  for(int i = 0; i < MAX_SPECTATORS; i++) {
-    if(game->spectators[i]) {
-      write(game->spectators[i], buf, wb+1);
-    }
-  }
+  respondSeat(game->white, buf, wb+1);
+  respondSeat(game->black, buf, wb+1);
+  publish(&game->audience, buf, wb+1, NULL, 0, 0);
 
   /* deconstruct */
   deconstructGame(game);
@@ -313,149 +703,359 @@ void checkEndGame(Game* game) {
       }
     }
   }
+  if(game->status == COMPLETED) {
+    return;
+  }
+
+  /* adjudicate trivial endgames instead of letting them be played out */
+  int result = probeBitbase(game->pos);
+  if(result == BB_DRAW) {
+    endGameDraw(game, ADJUDICATION);
+  } else if(result == WHITE) {
+    endGameWhite(game, ADJUDICATION);
+  } else if(result == BLACK) {
+    endGameBlack(game, ADJUDICATION);
+  }
+}
+
+/* per-move search budgets of the engine, indexed by bot level */
+SearchLimits botLimits[MAX_BOT_LEVEL+1] = {
+  /* depth, nodes, milliseconds */
+  {0, 0, 0},
+  {1, 2000, 100},
+  {2, 10000, 250},
+  {3, 40000, 500},
+  {4, 150000, 1000},
+  {6, 500000, 2000},
+  {MAX_PLY, 2000000, 5000}
+};
+
+int botColor(Game* game) {
+  return (game->white == BOT_SEAT) ? WHITE : BLACK;
+}
+
+/* the level's budget, cut down to what the engine's clock allows */
+void botSearchLimits(Game* game, SearchLimits* limits) {
+  *limits = botLimits[game->bot];
+  if(game->timed) {
+    long soft, hard;
+    allocateTime(game->clock[botColor(game)], game->increment, game->moves / 2, &soft, &hard);
+    if(hard < limits->timeMs) {
+      limits->timeMs = hard;
+    }
+    limits->softMs = (soft < limits->timeMs) ? soft : limits->timeMs;
+  }
+}
+
+/* sends both clocks to the players and spectators */
+void sendClock(Game* game) {
+  char buf[64];
+  long w = game->clock[WHITE] / 1000, b = game->clock[BLACK] / 1000;
+  int wb = snprintf(buf, sizeof(buf), "Clock: white %ld:%02ld, black %ld:%02ld\n", w / 60, w % 60, b / 60, b % 60);
+  respondSeat(game->white, buf, wb+1);
+  respondSeat(game->black, buf, wb+1);
+  publish(&game->audience, buf, wb+1, NULL, 0, 0);
+}
+
+/* charges the player to move for their thinking time, ending the game if they flagged */
+void updateClock(Game* game) {
+  long long now = nowMs();
+  int mover = game->pos->toMove;
+  game->clock[mover] -= now - game->turnStart;
+  if(game->clock[mover] < 0) {
+    game->clock[mover] = 0;
+    if(mover == WHITE) {
+      endGameBlack(game, TIMEOUT);
+    } else {
+      endGameWhite(game, TIMEOUT);
+    }
+    return;
+  }
+  game->clock[mover] += game->increment;
+  game->turnStart = now;
+}
+
+/*
+ * milliseconds until the game's deadline: the flag of the player to move, or
+ * the end of the wait for a second player or, without a clock, for a move
+ * LONG_MAX if there is none
+ */
+long gameTimeLeft(Game* game) {
+  long elapsed = nowMs() - game->turnStart;
+  if(game->status == ONGOING && game->timed) {
+    return game->clock[game->pos->toMove] - elapsed;
+  }
+  if(abandonTimeout == 0) {
+    return LONG_MAX;
+  }
+  return abandonTimeout - elapsed;
+}
+
+/* arms the game's timer for its deadline, a flag falls once the clock is below 0 */
+void armGameTimer(Game* game) {
+  long left = gameTimeLeft(game);
+  if(left == LONG_MAX) {
+    cancelTimer(&game->timer);
+  } else {
+    armTimer(&game->timer, left + 1);
+  }
+}
+
+/* called by a game worker when the game's timer expires */
+void gameTimer(Game* game) {
+  if(game->status == COMPLETED) {
+    return;
+  }
+  if(gameTimeLeft(game) >= 0) {
+    /* the deadline moved since the timer was armed */
+    armGameTimer(game);
+  } else if(game->status == WAITING) {
+    endGameExpired(game);
+  } else if(game->status == SUSPENDED) {
+    endGameUnclaimed(game);
+  } else if(game->timed) {
+    /* charges the rest of the turn, so the flag falls */
+    updateClock(game);
+  } else if(game->pos->toMove == WHITE) {
+    endGameBlack(game, ABANDONMENT);
+  } else {
+    endGameWhite(game, ABANDONMENT);
+  }
+}
+
+/* called from a search pool thread, hands the engine's move to the game */
+void botMoveReady(void* ctx, SearchResult* result) {
+  Game* game = ctx;
+  write(game->botPipe[1], result, sizeof(SearchResult));
+}
+
+/* ask the search pool for the engine's move, the game does not wait for it */
+void requestBotMove(Game* game) {
+  EngineBoard b;
+  SearchLimits limits;
+  boardFromPosition(&b, game->pos);
+  botSearchLimits(game, &limits);
+  submitSearch(game, &b, &limits, NULL, botMoveReady, game);
+}
+
+/*
+ * while the opponent thinks, search the position after the reply the engine
+ * expects. If that reply is played the search carries on as the engine's
+ * next move (see ponderHit), so its thinking overlaps the opponent's
+ */
+void startPondering(Game* game, Move* reply) {
+  EngineBoard b;
+  SearchLimits limits;
+  boardFromPosition(&b, game->pos);
+  applyMoveToBoard(&b, reply);
+  botSearchLimits(game, &limits);
+  submitPonder(game, &b, &limits, NULL, botMoveReady, game);
+  game->ponderMove = *reply;
+
+  char buf[32];
+  squareToString(buf, reply->start);
+  squareToString(buf+2, reply->end);
+  sprintf(buf+4, " expected");
+  logStr(buf);
+}
+
+/* the engine is now on move after the opponent played m */
+void botToMove(Game* game, Move* m) {
+  if(game->ponderMove.start >= 0) {
+    int hit = game->ponderMove.start == m->start && game->ponderMove.end == m->end;
+    game->ponderMove.start = game->ponderMove.end = -1;
+    if(hit && ponderHit(game)) {
+      logStr("ponder hit");
+      return;
+    }
+    /* the opponent surprised us, throw the ponder search away */
+    cancelSearches(game);
+  }
+  requestBotMove(game);
+}
+
+/* applies a legal move, tells everyone and checks if the game is over */
+void playMove(Game* game, Move* m) {
+  if(game->timed) {
+    updateClock(game);
+    if(game->status == COMPLETED) {
+      /* the mover's flag fell */
+      return;
+    }
+  }
+  applyMoveToPosition(m, game->pos);
+  pushBackList(&game->history, m, sizeof(Move));
+  game->moves++;
+  if(game->journal >= 0) {
+    journalMove(game, m);
+  }
+  sendBoard(game);
+  if(game->timed) {
+    sendClock(game);
+  }
+  if(game->analysis) {
+    analysisNewPosition(game->analysis, game->pos);
+  }
+
+  /* check for game end conditions */
+  checkEndGame(game);
+  if(game->status == COMPLETED) {
+    return;
+  }
+  if(!game->timed) {
+    game->turnStart = nowMs();
+  }
+  armGameTimer(game);
+
+  /* it may now be the engine's turn */
+  if(game->bot && game->pos->toMove == botColor(game)) {
+    botToMove(game, m);
+  }
+}
+
+/* called by a game worker when the engine's move arrives */
+void handleBotMove(Game* game) {
+  SearchResult result;
+  if(read(game->botPipe[0], &result, sizeof(result)) != sizeof(result)) {
+    return;
+  }
+  if(game->pos->toMove != botColor(game) || result.best.start < 0 || !moveIsLegal(&result.best, game->pos)) {
+    /* a stale result, the engine is not on move */
+    return;
+  }
+  logStr("applying the engine's move");
+  playMove(game, &result.best);
+  if(game->status == COMPLETED) {
+    return;
+  }
+
+  /* use the opponent's time to think about the expected reply */
+  if(result.ponder.start >= 0 && moveIsLegal(&result.ponder, game->pos)) {
+    startPondering(game, &result.ponder);
+  }
 }
 
 /* command functions for users in a game */
 
-void commandMove(int fd, Game* game) {
+void commandMove(int fd, Game* game, char* args) {
   /* get Move object from command input */
   logStr("processing move input");
-  char buf[5];
   Move m;
-  if(dataToRead(fd)) {
-    int rb = read(fd, buf, 4);
-    buf[5] = 0;
-    if(rb < 4) {
+  if(args[0]) {
+    if(strlen(args) < 4) {
       /* there must be four characters in the input */
       char msg[] = "Could not process the given move.\n";
-      write(fd, msg, sizeof(msg));
+      respond(fd, msg, sizeof(msg));
       return;
     }
     char s1[3];
-    s1[0] = buf[0], s1[1] = buf[1], s1[2] = 0;
+    s1[0] = args[0], s1[1] = args[1], s1[2] = 0;
     char s2[3];
-    s2[0] = buf[2], s2[1] = buf[3], s2[2] = 0;
+    s2[0] = args[2], s2[1] = args[3], s2[2] = 0;
     int sq1 = squareFromString(s1);
     int sq2 = squareFromString(s2);
     if(sq1 == -1 || sq2 == -1) {
       /* at least one of the squares is invalid */
       char msg[] = "Invalid move.\n";
-      write(fd, msg, sizeof(msg));
+      respond(fd, msg, sizeof(msg));
       return;
     }
     m.start = sq1;
     m.end = sq2;
   } else {
-    /* there is no data to read from this socket */
+    /* no move was given */
     char msg[] = "Please include the move (e.g. e2e4 or g8f6).\n";
-    write(fd, msg, sizeof(msg));
+    respond(fd, msg, sizeof(msg));
     return;
   }
 
   if(game->pos->toMove == WHITE) {
     if(fd == game->white) {
       /* white is entering their move */
-      if(moveIsLegal(&m, game->pos)) {
-	applyMoveToPosition(&m, game->pos);
-      } else {
+      if(!moveIsLegal(&m, game->pos)) {
 	/* the move is not legal */
 	char msg[] = "Illegal move.\n";
-	write(fd, msg, sizeof(msg));
+	respond(fd, msg, sizeof(msg));
 	return;
       }
     } else {
       /* black is moving out of turn */
       char msg[] = "It is not your turn.\n";
-      write(fd, msg, sizeof(msg));
+      respond(fd, msg, sizeof(msg));
+      return;
     }
   } else if(game->pos->toMove == BLACK) {
     if(fd == game->black) {
       /* black is entering their move */
-      if(moveIsLegal(&m, game->pos)) {
-	applyMoveToPosition(&m, game->pos);
-      } else {
+      if(!moveIsLegal(&m, game->pos)) {
 	/* move is illegal */
 	char msg[] = "Illegal move.\n";
-	write(fd, msg, sizeof(msg));
+	respond(fd, msg, sizeof(msg));
 	return;
       }
     } else {
       /* white is moving out of turn */
       char msg[] = "It is not your turn.\n";
-      write(fd, msg, sizeof(msg));
+      respond(fd, msg, sizeof(msg));
       return;
     }
   } else {
     /* something is wrong with the game data */
     char msg[] = "Something went wrong.\n";
-    write(fd, msg, sizeof(msg));
+    respond(fd, msg, sizeof(msg));
     return;
   }
 
   /* TODO: see if boardStr functions null terminate the strings */
-  sendBoard(game);
-
-  /* check for game end conditions */
-  checkEndGame(game);
+  playMove(game, &m);
 }
 
 void commandListMoves(int fd, Game* game) {
-  char msg[] = "List of legal moves:\n";
-  write(fd, msg, sizeof(msg));
   LList* moves = genLegalMoves(game->pos);
-  char sq1[2], sq2[2];
+  if(connectionBinary(fd)) {
+    /* two bytes a move */
+    unsigned char* buf = malloc(2 * moves->len + 1);
+    int i = 0;
+    for(LLNode* cur = moves->head; cur; cur = cur->next) {
+      Move* m = cur->data;
+      buf[i++] = m->start;
+      buf[i++] = m->end;
+    }
+    respondEvent(fd, PL_MOVES, buf, i);
+    free(buf);
+    freeList(moves);
+    free(moves);
+    return;
+  }
+
+  respondf(fd, "List of legal moves:\n");
+  char from[3], to[3];
   for(int i = 0; i < moves->len; i++) {
     /* retrieve the move and get the string from that move */
     Move* m = itemAtIndex(moves, i);
-    squareToString(sq1, m->start);
-    squareToString(sq2, m->end);
-    /* write each square, then make a new line */
-    write(fd, sq1, 2);
-    write(fd, sq2, 2);
-    write(fd, (void*)"\n", 1);
-  }
-  write(fd, (void*)0, 1); /* terminate the sent string */
+    squareToString(from, m->start);
+    squareToString(to, m->end);
+    respondf(fd, "%.2s%.2s\n", from, to);
+  }
+  respond(fd, "", 1); /* terminate the sent string */
   freeList(moves); /* free the generated list */
   free(moves);
 }
 
-void commandMessage(int fd, Game* game) {
+void commandMessage(int fd, Game* game, char* args) {
   int recipient = (fd == game->white) ? game->black : game->white;
   char sender = (fd == game->white) ? 'W' : 'B';
 
-  char buf[512];
-  if(dataToRead(fd)) {
-    /* read the messsage from the client into buf */
-    char msg[512];
-    for(int i = 0; i < sizeof(buf); i++) {
-      int rb = read(fd, buf+i, 1);
-      if(rb == 0) {
-	/* EOF or closed connection */
-	/* this client is gone */
-	/* end the game */
-	endGameDisconnect(game, fd);
-      }
-      /* check for newline */
-      if(buf[i] == '\n') {
-	buf[i] = 0;
-	break;
-      }
-    }
-    buf[511] = 0;
-
+  if(args[0]) {
     /* relay the message to everyone */
-    int wb = snprintf(msg, sizeof(msg), "%c says: %s\n", sender, buf);
-    write(recipient, msg, wb); /* send to the recipient player */
+    char msg[MAX_COMMAND_LINE + 16];
+    int wb = snprintf(msg, sizeof(msg), "%c says: %s\n", sender, args);
+    respondSeat(recipient, msg, wb); /* send to the recipient player */
     /* send to the spectators */
-    for(int i = 0; i < MAX_SPECTATORS; i++) {
-      if(game->spectators[i]) {
-	write(game->spectators[i], msg, wb);
-      }
-    }
+    publish(&game->audience, msg, wb, NULL, 0, 0);
   } else {
     /* no message was provided */
     /* do nothing ! */
-    /* potential bug: what if the client EOFs after a message command? */
   }
 }
 
@@ -476,105 +1076,136 @@ void commandResign(int fd, Game* game) {
   }
 }
 
-void processCommandPlayer(int fd, char c[], Game* game) {
+void processCommandPlayer(int fd, Command* cmd, Game* game) {
+  char* c = cmd->name;
   if(strcmp(c, "move") == 0) {
     /* move command */
-    commandMove(fd, game);
+    commandMove(fd, game, cmd->args);
   } else if(strcmp(c, "listmoves") == 0) {
     /* list moves command */
     commandListMoves(fd, game);
   } else if(strcmp(c, "message") == 0) {
     /* send a message command */
-    commandMessage(fd, game);
+    commandMessage(fd, game, cmd->args);
   } else if(strcmp(c, "resign") == 0) {
     /* resign command */
     commandResign(fd, game);
+  } else if(strcmp(c, "board") == 0) {
+    /* the current position */
+    commandBoard(fd, game);
+  } else if(strcmp(c, "deltas") == 0) {
+    /* boards as deltas */
+    commandDeltas(fd, cmd->args);
   } else {
     /* unrecognized command */
     /*
     char msg[] = "Your command was not recognized.\n";
-    write(fd, msg, sizeof(msg));
+    respond(fd, msg, sizeof(msg));
     */
   }
 }
 
-void handleCommandPlayer(int fd, Game* game) {
-  char buf[COMMAND_BUFSIZE];
-  for(int i = 0; i < COMMAND_BUFSIZE; i++) {
-    int rb = read(fd, buf+i, 1); /* read one char into buf */
-
-    /* the connection is closed or there is an EOF */
-    if(rb == 0) {
-      /* this player resigns by disconnecting */
-      game->n_spectators -= removeInt(fd, game->spectators);
-      close(fd);
-      return;
-    }
+/* spectator commands */
 
-    /* stop reading if we hit a space or newline or EOF*/
-    if(buf[i] == ' ' || buf[i] == '\n' || buf[i] == EOF) {
-      buf[i] = 0;
-      break;
-    }
+/* a spectator leaves the game and the server */
+void dropSpectator(int fd, Game* game) {
+  removeFd(&game->spectators, fd);
+  publishGame(game);
+  leaveAudience(&game->audience, fd);
+  if(game->analysis) {
+    unsubscribeAnalysis(game->analysis, fd);
   }
-  /* buf must always end in a 0 */
-  buf[COMMAND_BUFSIZE-1] = 0;
-  processCommandPlayer(fd, buf, game);
-  logStr("finished processing player command");
+  closeClient(fd);
 }
 
-/* spectator commands */
 void commandDisconnectSpectator(int fd, Game* game) {
-  game->n_spectators -= removeInt(fd, game->spectators);
   char msg[] = "You have been successfully disconnected.\n"; 
-  write(fd, msg, sizeof(msg));
-  close(fd);
+  respond(fd, msg, sizeof(msg));
+  dropSpectator(fd, game);
 }
 
-void processCommandSpectator(int fd, char c[], Game* game) {
+/* analyze [on|off]: follow the game's live analysis, shared by all spectators */
+void commandAnalyze(int fd, Game* game, char* args) {
+  if(strcmp(args, "off") == 0) {
+    if(game->analysis && unsubscribeAnalysis(game->analysis, fd)) {
+      char msg[] = "Analysis stopped.\n";
+      respond(fd, msg, sizeof(msg));
+    }
+    return;
+  }
+  if(strcmp(args, "on") != 0 && args[0] != 0) {
+    char msg[] = "Usage: analyze [on|off]\n";
+    respond(fd, msg, sizeof(msg));
+    return;
+  }
+
+  /* the first spectator to ask starts the analysis, the rest join it */
+  if(game->analysis == NULL) {
+    game->analysis = newAnalysis(game->pos);
+  }
+  if(subscribeAnalysis(game->analysis, fd)) {
+    char msg[] = "Analysis started.\n";
+    respond(fd, msg, sizeof(msg));
+  }
+}
+
+void processCommandSpectator(int fd, Command* cmd, Game* game) {
+  char* c = cmd->name;
   if(strcmp(c, "disconnect") == 0) {
     /* disconnect this client from spectating */
     commandDisconnectSpectator(fd, game);
+  } else if(strcmp(c, "analyze") == 0) {
+    /* follow the live analysis */
+    commandAnalyze(fd, game, cmd->args);
+  } else if(strcmp(c, "board") == 0) {
+    /* the current position */
+    commandBoard(fd, game);
+  } else if(strcmp(c, "deltas") == 0) {
+    /* boards as deltas */
+    commandDeltas(fd, cmd->args);
   } else {
     /* unrecognized command */
     char msg[] = "Your command was not recognized.\n";
-    write(fd, msg, sizeof(msg));
+    respond(fd, msg, sizeof(msg));
   }
 }
 
-void handleCommandSpectator(int fd, Game* game) {
-  char buf[COMMAND_BUFSIZE];
-  for(int i = 0; i < COMMAND_BUFSIZE; i++) {
-    int rb = read(fd, buf+i, 1); /* read one char into buf */
-
-    /* the connection is closed or there is an EOF */
-    if(rb == 0) {
-      game->n_spectators -= removeInt(fd, game->spectators);
-      return;
+/* handles the commands a player or spectator has sent */
+void handleCommandGame(int fd, Game* game) {
+  Connection* conn = connectionOf(fd);
+  Command cmd;
+  int blocked = 0;
+  do {
+    readConnection(conn);
+    /* stop if the game ends, the client leaves it or it must read its output first */
+    while(game->status == ONGOING && reactorOwner(fd) == &game->inbox && !(blocked = outputBlocked(conn)) && nextCommand(conn, &cmd)) {
+      if(fd == game->white || fd == game->black) {
+	processCommandPlayer(fd, &cmd, game);
+	logStr("finished processing player command");
+      } else {
+	/* Handle spectator command*/
+	processCommandSpectator(fd, &cmd, game);
+      }
     }
+    /* a command that closed the connection freed conn, so check the owner first */
+  } while(!blocked && game->status == ONGOING && reactorOwner(fd) == &game->inbox && conn->pending);
 
-    /* stop reading if we hit a space or newline or EOF*/
-    if(buf[i] == ' ' || buf[i] == '\n' || buf[i] == EOF) {
-      buf[i] = 0;
-      break;
+  /* the connection is closed, there is an EOF or the client broke the protocol */
+  if(game->status == ONGOING && reactorOwner(fd) == &game->inbox && conn->closed) {
+    if(fd == game->white || fd == game->black) {
+      /* this player resigns by disconnecting */
+      endGameDisconnect(game, fd);
+    } else {
+      dropSpectator(fd, game);
     }
   }
-  /* buf must always end in a 0 */
-  buf[COMMAND_BUFSIZE-1] = 0;
-  processCommandSpectator(fd, buf, game);
 }
 
-/* receives a game pointer */
-void* gameHandler(void* data) {
-  logStr("new game handler thread");
-  pthread_detach(pthread_self());
-  Game* game = data;
-  pthread_mutex_lock(&game->mtx);
-
-  /* wait for there to be 2 players */
-  while(game->n_players < 2 && game->status != ONGOING) {
-    pthread_cond_wait(&game->ready, &game->mtx);
-  }
+/* seats the players and starts the game */
+void beginGame(Game* game) {
+  logStr("starting a game");
+  game->status = ONGOING;
+  withdrawGame(&matchmaker, &game->match);
 
   char wmsg[] = "The game has started. You have the white pieces.\n";
   char bmsg[] = "The game has started. You have the black pieces.\n";
@@ -586,471 +1217,1564 @@ void* gameHandler(void* data) {
     game->white = game->players[1];
     game->black = game->players[0];
   }
+  /* from now on the game is recovered after a crash */
+  journalGame(game);
 
   sendBoard(game);
-  write(game->white, wmsg, sizeof(wmsg));
-  write(game->black, bmsg, sizeof(bmsg));
-
-  pthread_mutex_unlock(&game->mtx);
-    
-  while(1) {
-    /* there are now 2 players and we are ready to accept input and start the game */
-    fd_set fdin;
-    FD_ZERO(&fdin);
-    /* add the players and any spectators to the set */
-    pthread_mutex_lock(&game->mtx);
-    FD_SET(game->players[0], &fdin);
-    FD_SET(game->players[1], &fdin);
-    int max_fd = (game->players[0] > game->players[1]) ? game->players[0] : game->players[1];
-
-    for(int i = 0; i < MAX_SPECTATORS; i++) {
-      if(game->spectators[i]) {
-	FD_SET(game->spectators[i], &fdin);
-	max_fd = (game->spectators[i] > max_fd) ? game->spectators[i] : max_fd;
-      }
-    }
-    pthread_mutex_unlock(&game->mtx);
-
-    struct timeval timeout = {TIMEOUT_S, TIMEOUT_US};
-    int selectResult = select(max_fd+1, &fdin, NULL, NULL, &timeout);
+  respondSeat(game->white, wmsg, sizeof(wmsg));
+  respondSeat(game->black, bmsg, sizeof(bmsg));
+  if(game->timed) {
+    sendClock(game);
+  }
+  game->turnStart = nowMs();
+  armGameTimer(game);
 
-    if(selectResult > 0) {
-      /* a client has new input for us to process */
-      pthread_mutex_lock(&game->mtx);
-      /* was the input from one of the players? */
-      if(FD_ISSET(game->white, &fdin)) {
-	handleCommandPlayer(game->white, game);
-      } else if(FD_ISSET(game->black, &fdin)) {
-	handleCommandPlayer(game->black, game);
-      }
+  /* the engine may have the first move */
+  if(game->white == BOT_SEAT) {
+    requestBotMove(game);
+  }
 
-      for(int i = 0; i < MAX_SPECTATORS; i++) {
-	int cur_fd = game->spectators[i];
-	if(FD_ISSET(cur_fd, &fdin)) {
-	  /* Handle spectator command*/
-	  handleCommandSpectator(cur_fd, game);
-	}
-      }
-      pthread_mutex_unlock(&game->mtx);
+  /* input sent while the game was waiting is handled from now on */
+  for(int i = 0; i < 2; i++) {
+    if(game->players[i] != BOT_SEAT) {
+      reactorSetOwner(game->players[i], &game->inbox);
     }
   }
-  return NULL;
+  for(int i = 0; i < game->spectators.len; i++) {
+    reactorSetOwner(game->spectators.fds[i], &game->inbox);
+  }
+  publishGame(game);
+  submitGame(game);
 }
 
-/* Command functions for users in the hub room */
+/* the pipe the engine's moves arrive on */
+void openBotPipe(Game* game) {
+  /* a hot restart starts a new pipe, the new process does not inherit this one */
+  pipe2(game->botPipe, O_CLOEXEC);
+  /* results are tiny, but the search pool must never block on them */
+  fcntl(game->botPipe[1], F_SETFL, O_NONBLOCK);
+  reactorAdd(game->botPipe[0], &game->inbox);
+}
 
-/* newgame */
-/* Searches for an empty spot or a game that is already completed */
-/* Starts a new thread to handle the game */
-void commandNewGame(int fd, ProtectedIntArray* clients, ProtectedGameArray* games) {
-  pthread_mutex_lock(&games->mtx);
-  int success = 0;
-  for(int i = 0; i < MAX_GAMES; i++) {
-    /* is this an empty spot? */
-    if(games->arr[i] == NULL) {
-      logStr("new game in empty slot");
-      /* create the new game and give it our client */
-      games->arr[i] = newGame(i);
-      games->arr[i]->players[0] = fd;
-      games->arr[i]->n_players = 1;
-      removeInt(fd, clients->arr); /* remove fd from the client list */
-
-      /* start the game thread */
-      pthread_t pid;
-      pthread_create(&pid, NULL, gameHandler, (void*)games->arr[i]);
-      success = 1;
-      break;
-    }
-
-    /* is this spot held by a game that has been completed? */
-    /* if so, destroy this game and replace it */
-    pthread_mutex_lock(&games->arr[i]->mtx);
-    if(games->arr[i]->status == COMPLETED) {
-      logStr("cleaning up dead game");
-      pthread_mutex_unlock(&games->arr[i]->mtx);
-      /* the game thread should have already died, so no one should grab this mutex */
-      destroyGame(games->arr[i]);
-
-      /* create the new game and give it our client */
-      games->arr[i] = newGame(i);
-      games->arr[i]->players[0] = fd;
-      games->arr[i]->n_players = 1;
-      removeInt(fd, clients->arr); /* remove fd from the client list */
-
-      /* start the game thread */
-      pthread_t pid;
-      pthread_create(&pid, NULL, gameHandler, (void*)games->arr[i]);
-      success = 1;
-      break;
-    }
-    pthread_mutex_unlock(&games->arr[i]->mtx);
-  }
-  pthread_mutex_unlock(&games->mtx);
-  if(!success) {
-    /* we did not successfully add a game */
-    char msg[] = "There are too many ongoing games to start a new game.\n";
-    write(fd, msg, sizeof(msg));
+/* seats the client that created the game, which begins at once against the engine */
+/* the hub room has set up the engine's seat and the clock */
+void startGame(Game* game, int fd) {
+  game->players[0] = fd;
+  game->n_players = 1;
+  if(game->bot) {
+    game->players[1] = BOT_SEAT;
+    game->n_players = 2;
+    openBotPipe(game);
+
+    char msg[64];
+    int wb = snprintf(msg, sizeof(msg), "Created a new game against the engine (level %d).\n", game->bot);
+    respond(fd, msg, wb+1);
+    beginGame(game);
   } else {
-    /* we successfully added a game */
-    char msg[] = "Created a new game. Please wait for another player to join.\n";
-    write(fd, msg, sizeof(msg));
+    game->turnStart = nowMs();
+    armGameTimer(game);
+    publishGame(game);
   }
 }
 
-void commandJoinPlay(int fd, ProtectedIntArray* clients, ProtectedGameArray* games) {
-  char buf[16];
-  int id;
+/* send a client the game turned away back to the hub room */
+void returnToHub(int fd, const char* msg, int len) {
+  respond(fd, msg, len);
+  submitResponse(fd);
+  reactorSetOwner(fd, hubOf(fd));
+}
 
-  /* can probably reduce the size of the critical section here */
-  pthread_mutex_lock(&games->mtx);
-  /* we must make sure that there is data to read in the file descriptor */
-  if(dataToRead(fd)) {
-    for(int i = 0; i < sizeof(buf); i++) {
-      int rb = read(fd, buf+i, 1);
-      if(rb == 0) {
-	/* end of file or the connection has closed */
-	/* either way, disconnect this client and do nothing */
-	removeInt(fd, clients->arr);
-	close(fd);
-	return;
-      }
-      /* we've hit a newline */
-      if(buf[i] == '\n') {
-	buf[i] = 0;
-	break;
-      }
-    }
-    buf[15] = 0;
-    id = atoi(buf);
-  } else {
-    /* no game id was provided */
-    /* pick the first game that is available */
-    for(int i = 0; i < MAX_GAMES; i++) {
-      if(games->arr[i]) {
-	pthread_mutex_lock(&games->arr[i]->mtx);
-	if(games->arr[i]->status == WAITING) {
-	  id = i;
-	  pthread_mutex_unlock(&games->arr[i]->mtx);
-	  break;
+/* every seat of a recovered game is taken again: play on from where the journal left it */
+void resumeRecoveredGame(Game* game) {
+  game->status = ONGOING;
+  char wmsg[] = "The game has resumed. You have the white pieces.\n";
+  char bmsg[] = "The game has resumed. You have the black pieces.\n";
+  sendBoard(game);
+  respondSeat(game->white, wmsg, sizeof(wmsg));
+  respondSeat(game->black, bmsg, sizeof(bmsg));
+  if(game->timed) {
+    sendClock(game);
+  }
+  /* the clocks stood still while the server was down */
+  game->turnStart = nowMs();
+  armGameTimer(game);
+  if(game->bot && game->pos->toMove == botColor(game)) {
+    requestBotMove(game);
+  }
+
+  /* input sent while the game was suspended is handled from now on */
+  for(int i = 0; i < 2; i++) {
+    if(game->players[i] >= 0) {
+      reactorSetOwner(game->players[i], &game->inbox);
+    }
+  }
+  for(int i = 0; i < game->spectators.len; i++) {
+    reactorSetOwner(game->spectators.fds[i], &game->inbox);
+  }
+  publishGame(game);
+}
+
+/* a client takes an empty seat of a recovered game, white's first */
+void takeSeatBack(Game* game, int fd) {
+  int seat = game->players[0] == VACANT_SEAT ? 0 : 1;
+  game->players[seat] = fd;
+  game->white = game->players[0];
+  game->black = game->players[1];
+  if(game->players[!seat] != VACANT_SEAT) {
+    resumeRecoveredGame(game);
+    return;
+  }
+  char msg[96];
+  int wb = snprintf(msg, sizeof(msg), "You have the %s pieces. The game resumes once your opponent is back.\n", seat == 0 ? "white" : "black");
+  respond(fd, msg, wb+1);
+  publishGame(game);
+}
+
+/* a player leaves a recovered game before it resumed, and the seat is empty again */
+void leaveSeat(Game* game, int fd) {
+  int seat = game->players[0] == fd ? 0 : 1;
+  game->players[seat] = VACANT_SEAT;
+  game->white = game->players[0];
+  game->black = game->players[1];
+  closeClient(fd);
+  publishGame(game);
+}
+
+/* a client from the hub room takes the second seat */
+void joinPlayer(Game* game, int fd) {
+  if(game->status == WAITING) {
+    /* the game must already have one player */
+    game->players[1] = fd;
+    game->n_players = 2;
+    beginGame(game);
+  } else if(game->status == SUSPENDED) {
+    takeSeatBack(game, fd);
+  } else {
+    /* this game doesn't need a player */
+    char msg[] = "This game doesn't need a player. Did you mean to join as a spectator?\n";
+    returnToHub(fd, msg, sizeof(msg));
+  }
+}
+
+/* a client from the hub room starts spectating */
+void joinSpectator(Game* game, int fd) {
+  if(game->status == COMPLETED) {
+    /* this game is already over */
+    char msg[] = "Sorry, but this game has already finished.\n";
+    returnToHub(fd, msg, sizeof(msg));
+  } else if(maxSpectators == 0 || game->spectators.len < maxSpectators) {
+    /* there is room to spectate */
+    addFd(&game->spectators, fd); /* add this fd to the spectator list */
+    joinAudience(&game->audience, fd);
+    publishGame(game);
+    /* and have what the client sent meanwhile handled */
+    reactorSetOwner(fd, &game->inbox);
+  } else {
+    /* there isn't room to spectate */
+    char msg[] = "There are already too many users spectating this game.\n";
+    returnToHub(fd, msg, sizeof(msg));
+  }
+}
+
+/* called by a game worker with each event posted to the game's inbox */
+void serveGame(void* data, InboxEvent* event) {
+  Game* game = data;
+  int fd = event->fd;
+  if(event->type == GAME_START) {
+    startGame(game, fd);
+  } else if(event->type == GAME_JOIN_PLAYER) {
+    joinPlayer(game, fd);
+  } else if(event->type == GAME_JOIN_SPECTATOR) {
+    joinSpectator(game, fd);
+  } else if(event->type == EVENT_TIMER) {
+    gameTimer(game);
+  } else if(game->bot && fd == game->botPipe[0]) {
+    /* the epoll is edge-triggered: handle everything that is waiting, unless
+       the game is not on or the descriptor was closed or handed on */
+    while(game->status == ONGOING && dataToRead(fd)) {
+      handleBotMove(game);
+    }
+  } else if(game->status == ONGOING && reactorOwner(fd) == &game->inbox) {
+    handleCommandGame(fd, game);
+  } else if(game->status == WAITING && fd == game->players[0] && reactorOwner(fd) == &game->inbox) {
+    /* commands wait for the game to begin, but a player who leaves takes the game along */
+    Connection* conn = connectionOf(fd);
+    if(!readConnection(conn)) {
+      endGameWaiting(game);
+    }
+  } else if(game->status == SUSPENDED && (fd == game->players[0] || fd == game->players[1]) && reactorOwner(fd) == &game->inbox) {
+    /* the same until the game resumes, but a player who leaves only gives the seat up */
+    Connection* conn = connectionOf(fd);
+    if(!readConnection(conn)) {
+      leaveSeat(game, fd);
+    }
+  }
+  /* a finished game's replies went out when its clients were closed */
+  if(game->status != COMPLETED) {
+    submitGame(game);
+  }
+}
+
+/* Command functions for users in the hub room */
+
+/*
+ * takes the completed games out of the directory, and frees the ones no hub
+ * thread and no worker holds any more
+ *
+ * a hub thread may have found a game in the directory just before it was
+ * taken out, so a game is only freed once every hub thread has since
+ * finished a batch or gone to sleep, each of which it does holding no game
+ */
+void reapGames(Directory* games) {
+  pthread_mutex_lock(&finishedMtx);
+  for(LLNode* cur = finishedGames.head; cur; cur = cur->next) {
+    Game* game = *(Game**)cur->data;
+    if(game->retired == 0) {
+      directoryRemove(games, game->id);
+      game->retired = __sync_add_and_fetch(&reapEpoch, 1);
+    }
+  }
+  /* read after the games were taken out, see hubRoom */
+  long seen = LONG_MAX;
+  for(int k = 0; k < n_hubs; k++) {
+    if(hubs[k].seen < seen) {
+      seen = hubs[k].seen;
+    }
+  }
+  LLNode* cur = finishedGames.head;
+  int i = 0;
+  while(cur) {
+    Game* game = *(Game**)cur->data;
+    cur = cur->next;
+    if(game->retired > seen || inboxBusy(&game->inbox) || audienceBusy(&game->audience)) {
+      i++;
+      continue;
+    }
+    logStr("cleaning up dead game");
+    removeIndex(&finishedGames, i);
+    /* no descriptors are left and no thread holds it, so nothing can reach it */
+    destroyGame(game);
+  }
+  pthread_mutex_unlock(&finishedMtx);
+}
+
+/*
+ * parses the arguments of newgame: [bot [<level>]] [<minutes>+<increment>]
+ * returns 1 on success, 0 if the arguments are invalid
+ */
+int parseNewGameArgs(char* buf, int* bot, int* minutes, int* increment) {
+  char* save;
+  char* tok = strtok_r(buf, " ", &save);
+  while(tok) {
+    if(strcmp(tok, "bot") == 0 && !*bot && !*minutes) {
+      *bot = 1;
+      tok = strtok_r(NULL, " ", &save);
+      if(tok && strchr(tok, '+') == NULL) {
+	*bot = atoi(tok);
+	if(*bot < 1 || *bot > MAX_BOT_LEVEL) {
+	  return 0;
 	}
-	pthread_mutex_unlock(&games->arr[i]->mtx);
+	tok = strtok_r(NULL, " ", &save);
       }
+      continue;
+    }
+    if(sscanf(tok, "%d+%d", minutes, increment) != 2 || *minutes < 1 || *minutes > MAX_MINUTES || *increment < 0 || *increment > MAX_INCREMENT) {
+      return 0;
     }
+    tok = strtok_r(NULL, " ", &save);
   }
+  return 1;
+}
 
-  if(id >= 0 && id < MAX_GAMES) {
-    if(games->arr[id]) {
-      pthread_mutex_lock(&games->arr[id]->mtx);
-      if(games->arr[id]->status == WAITING) {
-	/* add this fd to this game */
-	/* the game must already have one player */
-	games->arr[id]->players[1] = fd;
-	games->arr[id]->n_players = 2;
-	games->arr[id]->status = ONGOING;
-	removeInt(fd, clients->arr);
-	pthread_cond_signal(&games->arr[id]->ready); /* signal that the game is ready to start */
-      } else {
-	/* this game doesn't need a player */
-	char msg[] = "This game doesn't need a player. Did you mean to join as a spectator?\n";
-	write(fd, msg, sizeof(msg));
-      }
-      pthread_mutex_unlock(&games->arr[id]->mtx);
+/* the matchmaker's key of a time control */
+int timeControlKey(int minutes, int increment) {
+  return minutes ? minutes * (MAX_INCREMENT + 1) + increment : 0;
+}
+
+/* adds a new game with the engine level and clock to the directory, NULL if there are too many games */
+Game* createGame(Directory* games, int bot, int minutes, int increment) {
+  Game* game = newGame();
+  game->directory = games;
+  game->bot = bot;
+  if(minutes) {
+    game->timed = 1;
+    game->clock[WHITE] = game->clock[BLACK] = minutes * 60000L;
+    game->increment = increment * 1000L;
+  }
+  game->id = directoryAdd(games, game);
+  if(game->id < 0) {
+    destroyGame(game);
+    return NULL;
+  }
+  logStr("new game");
+  return game;
+}
+
+/* newgame [bot [<level>]] [<minutes>+<increment>] */
+/* Searches for an empty spot or a game that is already completed */
+/* Starts a new thread to handle the game */
+void commandNewGame(int fd, char* args, Directory* games) {
+  /* newgame bot <level> plays against the engine, and 5+3 adds a clock */
+  int bot = 0, minutes = 0, increment = 0;
+  if(args[0]) {
+    if(!parseNewGameArgs(args, &bot, &minutes, &increment)) {
+      char msg[80];
+      int wb = snprintf(msg, sizeof(msg), "Usage: newgame [bot [<level 1-%d>]] [<minutes>+<increment>]\n", MAX_BOT_LEVEL);
+      respond(fd, msg, wb+1);
+      return;
+    }
+  }
+
+  Game* game = createGame(games, bot, minutes, increment);
+  if(game == NULL) {
+    /* we did not successfully add a game */
+    char msg[] = "There are too many ongoing games to start a new game.\n";
+    respond(fd, msg, sizeof(msg));
+    return;
+  }
+  if(!bot) {
+    /* the game waits for a player, before anything can happen to it */
+    queueGame(&matchmaker, &game->match, game->id, timeControlKey(minutes, increment));
+    /* we successfully added a game */
+    char msg[] = "Created a new game. Please wait for another player to join.\n";
+    respond(fd, msg, sizeof(msg));
+  }
+  /* give the new game our client, its input goes to the game from now on */
+  reactorHandOff(fd, &game->inbox, GAME_START);
+}
+
+/* return 1 if the game with id is this process's, see shard.h */
+int ownGame(int id) {
+  return shardCount() == 0 || shardOf(id) == thisShard();
+}
+
+/*
+ * hand the client to the shard that has the game with id, which runs the
+ * command (with its binary tag) there as if the client had sent it
+ */
+void moveToShard(int fd, const char* command, int tag, int id) {
+  int shard = shardOf(id);
+  GameSummary summary;
+  if(!findSummary(shardDirectory(shard), id, &summary)) {
+    char msg[] = "There is no game with that number.\n";
+    respond(fd, msg, sizeof(msg));
+    return;
+  }
+  Connection* conn = connectionOf(fd);
+  HandOff h;
+  h.binary = conn->binary;
+  h.deltas = conn->deltas;
+  /* the command first, in the client's protocol, then what it sent after it */
+  if(conn->binary) {
+    unsigned char payload[4] = {id >> 24, id >> 16, id >> 8, id};
+    h.len = putFrame(h.input, tag, payload, sizeof(payload));
+  } else {
+    h.len = snprintf(h.input, sizeof(h.input), "%s %d\n", command, id);
+  }
+  /* nothing more is read here, and what is queued for the client goes out first */
+  reactorRemove(fd);
+  submitResponse(fd);
+  int commandLen = h.len;
+  h.len += takeUnread(conn, h.input + h.len, sizeof(h.input) - h.len);
+  if(handOffClient(shard, fd, &h) < 0) {
+    /* the client stays in the hub room, with what it sent after the command */
+    pushInput(conn, h.input + commandLen, h.len - commandLen);
+    char msg[] = "The server running that game is busy. Please try again later.\n";
+    respond(fd, msg, sizeof(msg));
+    reactorAdd(fd, hubOf(fd));
+    return;
+  }
+  /* the other shard has its own copy of the descriptor */
+  freeConnection(fd);
+  close(fd);
+  __sync_fetch_and_sub(&n_connections, 1);
+}
+
+void commandJoinPlay(int fd, char* args, Directory* games) {
+  int id;
+
+  if(args[0]) {
+    id = atoi(args);
+    if(id >= 0 && !ownGame(id)) {
+      moveToShard(fd, "joinplay", C_JOINPLAY, id);
+      return;
+    }
+  } else {
+    /* no game id was provided */
+    /* take the game that has waited longest, whatever its clock */
+    id = takeGame(&matchmaker, MATCH_ANY);
+    if(id < 0) {
+      char msg[] = "No game is waiting for a player. Start one with newgame or quickplay.\n";
+      respond(fd, msg, sizeof(msg));
+      return;
+    }
+  }
+
+  /* only the hub room removes games, so the game stays while we use it */
+  if(id >= 0) {
+    Game* game = directoryGet(games, id);
+    if(game) {
+      /* the game seats us, or sends us back if the seat is gone by then */
+      reactorHandOff(fd, &game->inbox, GAME_JOIN_PLAYER);
     } else {
       /* game with that id doesn't exist */
       char msg[] = "There is no game with that number.\n";
-      write(fd, msg, sizeof(msg));
+      respond(fd, msg, sizeof(msg));
     }
   } else {
     /* the id is invalid */
     char msg[] = "An error occurred processing the given number.\n";
-    write(fd, msg, sizeof(msg));
+    respond(fd, msg, sizeof(msg));
   }
-  pthread_mutex_unlock(&games->mtx);
 }
 
-void commandJoinSpec(int fd, ProtectedIntArray* clients, ProtectedGameArray* games) {
-  char buf[16];
+/* what quickplay needs to create a game when none is waiting */
+typedef struct QuickPlay {
+  int fd;
+  Directory* games;
+  int minutes;
+  int increment;
+  int created; /* 1 once a game was created, -1 if there were too many */
+  Game* game; /* the game created, the client is handed to it once the matchmaker is unlocked */
+} QuickPlay;
+
+/* called by the matchmaker when no game with the time control is waiting */
+MatchEntry* createQuickPlay(void* data) {
+  QuickPlay* qp = data;
+  Game* game = createGame(qp->games, 0, qp->minutes, qp->increment);
+  if(game == NULL) {
+    qp->created = -1;
+    return NULL;
+  }
+  qp->created = 1;
+  qp->game = game;
+  game->match.id = game->id;
+  return &game->match;
+}
+
+/* quickplay [<minutes>+<increment>]: join the game with this clock that has waited longest, or create one */
+void commandQuickPlay(int fd, char* args, Directory* games) {
+  int minutes = 0, increment = 0;
+  if(args[0] && (sscanf(args, "%d+%d", &minutes, &increment) != 2 || minutes < 1 || minutes > MAX_MINUTES || increment < 0 || increment > MAX_INCREMENT)) {
+    char msg[] = "Usage: quickplay [<minutes>+<increment>]\n";
+    respond(fd, msg, sizeof(msg));
+    return;
+  }
+
+  /* two players asking at once are paired, they never both create a game */
+  QuickPlay qp = {fd, games, minutes, increment, 0, NULL};
+  int id = quickMatch(&matchmaker, timeControlKey(minutes, increment), createQuickPlay, &qp);
+  if(qp.created > 0) {
+    char msg[] = "No game was waiting, so a new one was created. Please wait for another player to join.\n";
+    respond(fd, msg, sizeof(msg));
+    /* the reply is queued before the game can send anything */
+    reactorHandOff(fd, &qp.game->inbox, GAME_START);
+    return;
+  }
+  if(qp.created < 0) {
+    char msg[] = "There are too many ongoing games to start a new game.\n";
+    respond(fd, msg, sizeof(msg));
+    return;
+  }
+  /* only the hub room removes games, and a queued game has not finished */
+  Game* game = directoryGet(games, id);
+  if(game) {
+    reactorHandOff(fd, &game->inbox, GAME_JOIN_PLAYER);
+  } else {
+    char msg[] = "There is no game with that number.\n";
+    respond(fd, msg, sizeof(msg));
+  }
+}
+
+void commandJoinSpec(int fd, char* args, Directory* games) {
   int id;
-  pthread_mutex_lock(&games->mtx);
-  /* we must make sure that there is data to read in the file descriptor */
-  if(dataToRead(fd)) {
-    for(int i = 0; i < sizeof(buf); i++) {
-      int rb = read(fd, buf+i, 1);
-      if(rb == 0) {
-	/* end of file or the connection has closed */
-	/* either way, disconnect this client and do nothing */
-	removeInt(fd, clients->arr);
-	return;
-      }
-      /* we've hit a newline */
-      if(buf[i] == '\n') {
-	buf[i] = 0;
-	break;
-      }
+  if(args[0]) {
+    id = atoi(args);
+    if(id >= 0 && !ownGame(id)) {
+      moveToShard(fd, "joinspec", C_JOINSPEC, id);
+      return;
     }
-    buf[15] = 0;
-    id = atoi(buf);
   } else {
     /* no id was provided */
     char msg[] = "Please provide the ID of the game you wish to spectate.\n";
-    write(fd, msg, sizeof(msg));
-    /* return here? unlock mutex? */
-    pthread_mutex_unlock(&games->mtx);
+    respond(fd, msg, sizeof(msg));
     return;
   }
 
-  if(id >= 0 && id < MAX_GAMES) {
-    if(games->arr[id]) {
-      pthread_mutex_lock(&games->arr[id]->mtx);
-      if(games->arr[id]->status == COMPLETED) {
-	/* this game is already over */
-	char msg[] = "Sorry, but this game has already finished.\n";
-	write(fd, msg, sizeof(msg));
-      } else if(games->arr[id]->n_spectators < MAX_SPECTATORS) {
-	/* there is room to spectate */
-	addInt(fd, games->arr[id]->spectators); /* add this fd to the spectator list */
-	games->arr[id]->n_spectators += 1;
-	removeInt(fd, clients->arr); /* remove this fd from the hub room */
-      } else {
-	/* there isn't room to spectate */
-	char msg[] = "There are already too many users spectating this game.\n";
-	write(fd, msg, sizeof(msg));
-      }
-      pthread_mutex_unlock(&games->arr[id]->mtx);
+  if(id >= 0) {
+    Game* game = directoryGet(games, id);
+    if(game) {
+      /* the game adds us, or sends us back if it is over or full */
+      reactorHandOff(fd, &game->inbox, GAME_JOIN_SPECTATOR);
     } else {
       /* a game with that id does not exist */
       char msg[] = "There is no game with that number.\n";
-      write(fd, msg, sizeof(msg));
+      respond(fd, msg, sizeof(msg));
     }
   } else {
     /* the ID is invalid */
     char msg[] = "An error occurred processing the given number.\n";
-    write(fd, msg, sizeof(msg));
+    respond(fd, msg, sizeof(msg));
   }
-  pthread_mutex_unlock(&games->mtx);
 }
 
-void commandListGames(int fd, ProtectedIntArray* clients, ProtectedGameArray* games) {
-  char intro[] = "List of current games (ID: players/total, spectators/total):\n";
-  write(fd, intro, sizeof(intro));
-  char buf[32];
-  pthread_mutex_lock(&games->mtx);
-  for(int i = 0; i < MAX_GAMES; i++) {
-    if(games->arr[i]) {
-      pthread_mutex_lock(&games->arr[i]->mtx);
-      sprintf(buf, "%d: %d/2, %d/%d\n", i, games->arr[i]->n_players, games->arr[i]->n_spectators, MAX_SPECTATORS);
-      pthread_mutex_unlock(&games->arr[i]->mtx);
-      write(fd, buf, strlen(buf)+1);
+void commandListGames(int fd, Directory* games) {
+  respondf(fd, "List of current games (ID: players/total, spectators[/total]):\n");
+  /* the summaries the games publish, no game is locked, and with shards
+     every shard's directory is read */
+  GameSummary summary;
+  int n_dirs = shardCount() ? shardCount() : 1;
+  for(int k = 0; k < n_dirs; k++) {
+    Directory* d = shardCount() ? shardDirectory(k) : games;
+    int n = directorySlots(d);
+    for(int i = 0; i < n; i++) {
+      if(readSummary(d, i, &summary)) {
+	respondf(fd, "%d: %d/2, %d", summary.id, summary.players, summary.spectators);
+	if(maxSpectators) {
+	  respondf(fd, "/%d", maxSpectators);
+	}
+	if(summary.bot) {
+	  respondf(fd, " (engine level %d)", summary.bot);
+	}
+	respondf(fd, "\n");
+      }
     }
   }
-  pthread_mutex_unlock(&games->mtx);
+  respond(fd, "", 1);
 }
 
 /* disconnect a client from the server */
-void commandDisconnect(int fd, ProtectedIntArray* clients, ProtectedGameArray* games) {
-  removeInt(fd, clients->arr);
+void commandDisconnect(int fd, Directory* games) {
   char msg[] = "You have been successfully disconnected.\n";
-  write(fd, msg, sizeof(msg));
-  close(fd);
+  respond(fd, msg, sizeof(msg));
+  closeClient(fd);
 }
 
+/* binary: switch to the binary protocol described in command.h */
+void commandBinary(int fd) {
+  setBinary(fd);
+  char msg[] = "Binary protocol selected.\n";
+  respond(fd, msg, sizeof(msg));
+}
+
+/* given a command sent to the server from a client in the hub room */
+void processCommandHub(int fd, Command* cmd, Directory* games) {
+  char* c = cmd->name;
 
-/* given a command c sent to the server from a client in the hub room */
-void processCommandHub(int fd, char c[], ProtectedIntArray* clients, ProtectedGameArray* games) {
   if(strcmp(c, "newgame") == 0) {
     /* start a new game */
-    commandNewGame(fd, clients, games);
+    commandNewGame(fd, cmd->args, games);
   } else if(strcmp(c, "joinplay") == 0) {
     /* join a game as a player */
-    commandJoinPlay(fd, clients, games);
+    commandJoinPlay(fd, cmd->args, games);
+  } else if(strcmp(c, "quickplay") == 0) {
+    /* join or create a game with a time control */
+    commandQuickPlay(fd, cmd->args, games);
   } else if(strcmp(c, "joinspec") == 0) {
     /* join a game as a spectator */
-    commandJoinSpec(fd, clients, games);
+    commandJoinSpec(fd, cmd->args, games);
   } else if(strcmp(c, "listgames") == 0) {
     /* list ongoing games */
-    commandListGames(fd, clients, games);
+    commandListGames(fd, games);
   } else if(strcmp(c, "disconnect") == 0) {
     /* disconnect */
-    commandDisconnect(fd, clients, games);
+    commandDisconnect(fd, games);
+  } else if(strcmp(c, "binary") == 0) {
+    /* the binary protocol handshake */
+    commandBinary(fd);
+  } else if(strcmp(c, "deltas") == 0) {
+    /* boards as deltas, in the games the client joins */
+    commandDeltas(fd, cmd->args);
   } else {
     char msg[] = "Your command was not recognized.\n";
-    write(fd, msg, sizeof(msg));
+    respond(fd, msg, sizeof(msg));
     logStr("client sent unrecognized command");
     printf("unrecognized: %s\n", c);
     /* unrecognized command */
   }
 }
 
-/* called by the hub room thread to handle input from the clients */
-void* handleCommandHub(void* data) {
-  /* unpack arguments */
-  CommandHubThreadArgs* args = data;
-  int fd = args->fd;
-  ProtectedIntArray* clients = args->clients;
-  ProtectedGameArray* games = args->games;
-  /* detach this thread, if it is a thread */
-  //pthread_detach(pthread_self());
-  /* Extract the command */
-  char buf[COMMAND_BUFSIZE];
-  for(int i = 0; i < COMMAND_BUFSIZE; i++) {
-    int rb = read(fd, buf+i, 1); /* read one char into buf */
+/*
+ * closes a client in the hub room that has sent nothing for the idle
+ * timeout, or makes sure its idle timer is armed, which then brings the
+ * client back here (as if it had sent input) when the timeout may be up
+ */
+void checkIdle(int fd) {
+  if(idleTimeout == 0) {
+    return;
+  }
+  Connection* conn = connectionOf(fd);
+  long idle = monotonicMs() - conn->lastInput;
+  if(idle >= idleTimeout) {
+    char msg[] = "You have been idle for too long. Goodbye.\n";
+    respond(fd, msg, sizeof(msg));
+    closeClient(fd);
+  } else if(!timerArmed(&conn->idle)) {
+    /* not moved with each command: it only comes back to check */
+    armTimer(&conn->idle, idleTimeout - idle);
+  }
+}
 
-    /* the connection is closed or there is an EOF */
-    if(rb == 0) {
-      removeInt(fd, clients->arr);
-      return NULL;
+/*
+ * called by a hub thread to handle input from one of its clients
+ * a command may close the descriptor or hand it to a game, after which the
+ * number may be reused at once, so the connection is looked up again each
+ * time the hub is found to still own it
+ */
+void handleCommandHub(int fd, Inbox* hub, Directory* games) {
+  Command cmd;
+  int blocked = 0;
+  do {
+    readConnection(connectionOf(fd));
+    /* stop as soon as the client leaves the hub room, its game handles the rest,
+       or once it must read its output first */
+    while(reactorOwner(fd) == hub && !(blocked = outputBlocked(connectionOf(fd))) && nextCommand(connectionOf(fd), &cmd)) {
+      logStr("handling command");
+      processCommandHub(fd, &cmd, games);
+      submitResponse(fd);
     }
+  } while(!blocked && reactorOwner(fd) == hub && connectionOf(fd)->pending);
 
-    /* stop reading if we hit a space or newline or EOF*/
-    if(buf[i] == ' ' || buf[i] == '\n' || buf[i] == EOF) {
-      buf[i] = 0;
-      break;
-    }
+  /* the connection is closed, there is an EOF or the client broke the protocol */
+  if(reactorOwner(fd) == hub && connectionOf(fd)->closed) {
+    closeClient(fd);
+  } else if(reactorOwner(fd) == hub) {
+    checkIdle(fd);
   }
-  /* buf must always end in a 0 */
-  buf[COMMAND_BUFSIZE-1] = 0;
-  processCommandHub(fd, buf, clients, games);
-
-  return NULL;
 }
 
+typedef struct HubThreadArgs {
+  Hub* hub;
+  Directory* games;
+} HubThreadArgs;
+
 void* hubRoom(void* data) {
   HubThreadArgs* args = data;
-  ProtectedIntArray* clients = args->clients;
-  ProtectedGameArray* games = args->games;
+  Hub* hub = args->hub;
+  Directory* games = args->games;
+  int fds[HUB_BATCH];
 
   logStr("Hub thread ready");
 
-  /* the main thread adds new connections to the client list, we must listen to them */
+  /* the main thread accepts new connections and the reactor posts their input here */
   while(1) {
-    fd_set fdin;
-    FD_ZERO(&fdin);
-    int max_fd = 0;
-    /* add the active clients to the fd set */
-    pthread_mutex_lock(&clients->mtx);
-    for(int i = 0; i < MAX_CONNECTIONS; i++) {
-      int cur_fd = clients->arr[i];
-      if(cur_fd) {
-	/* this is an active client file descriptor */
-	FD_SET(cur_fd, &fdin);
-	max_fd = (cur_fd > max_fd) ? cur_fd : max_fd;
+    hub->seen = LONG_MAX;
+    __sync_synchronize();
+    int n = waitInbox(&hub->inbox, fds, HUB_BATCH);
+    /* published before the first lookup, so a game taken out of the
+       directory before that lookup is not freed while the batch runs */
+    hub->seen = *(volatile long*)&reapEpoch;
+    __sync_synchronize();
+    /* every client with input, without a lock shared with the other hub threads */
+    for(int i = 0; i < n; i++) {
+      /* the client may have left the hub room since the input was posted */
+      if(reactorOwner(fds[i]) == &hub->inbox) {
+	handleCommandHub(fds[i], &hub->inbox, games);
       }
     }
-    pthread_mutex_unlock(&clients->mtx);
-
-    /* select */
-    struct timeval timeout = {TIMEOUT_S, TIMEOUT_US}; /* wait 10 milliseconds for input */
-    int selectResult = select(max_fd+1, &fdin, NULL, NULL, &timeout);
-
-    if(selectResult > 0) {
-      logStr("New input from a client");
-      /* TODO: watch out for deadlocking during comand execution */
-      /* potential solution: count up to max_fd and don't use mutex */
-      pthread_mutex_lock(&clients->mtx);
-      for(int i = 0; i < MAX_CONNECTIONS; i++) {
-	int cur_fd = clients->arr[i];
-	if(FD_ISSET(cur_fd, &fdin)) {
-	  /* client cur_fd has new input to process */
-	  logStr("Found the ready client");
-	  /* handle the client's command */
-	  /* perhaps make a new thread to do this? */
-	  CommandHubThreadArgs args = {cur_fd, clients, games};
-	  /*
-	  pthread_t pid;
-	  pthread_create(&pid, NULL, handleCommandHub, &args);
-	  */
-
-	  /* right now, every command executed has the mutex for the client list already */
-	  logStr("handling command");
-	  handleCommandHub(&args);
-	  break;
+    /* no game found in the directory is held past this point */
+    hub->seen = *(volatile long*)&reapEpoch;
+    __sync_synchronize();
+    /* free the slots of the games that have finished since the last batch */
+    reapGames(games);
+  }
+  return NULL;
+}
+
+/* puts a new connection in the hub room, or turns it away if the server is full */
+void admitClient(int fd) {
+  int n = __sync_add_and_fetch(&n_connections, 1);
+  if(maxConnections > 0 && n > maxConnections) {
+    __sync_fetch_and_sub(&n_connections, 1);
+    /* as cheap as possible, the server is already over its budget */
+    char full[] = "We're full right now. Please try again later.\n";
+    send(fd, full, sizeof(full), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    __sync_fetch_and_add(&n_shed, 1);
+    return;
+  }
+  logStr("Accepted a new client");
+  char msg[] = "Connection accepted. Enter commands as you wish. Type \"help\" for help.\n";
+  /* the hub thread sees the connection once the reactor watches it */
+  Connection* conn = newConnection(fd);
+  initTimer(&conn->idle, hubOf(fd), fd);
+  sendClient(fd, msg, sizeof(msg));
+  reactorAdd(fd, hubOf(fd));
+  /* a client that never sends anything is timed out as well */
+  if(idleTimeout > 0) {
+    armTimer(&conn->idle, idleTimeout);
+  }
+}
+
+/* puts a client another shard handed over in the hub room, with the command that brought it here */
+void admitHandOff(int fd, HandOff* h) {
+  __sync_add_and_fetch(&n_connections, 1);
+  Connection* conn = newConnection(fd);
+  conn->binary = h->binary;
+  conn->deltas = h->deltas;
+  pushInput(conn, h->input, h->len);
+  initTimer(&conn->idle, hubOf(fd), fd);
+  reactorAdd(fd, hubOf(fd));
+  /* its input is on the connection already, not on the socket */
+  reactorResume(fd);
+  if(idleTimeout > 0) {
+    armTimer(&conn->idle, idleTimeout);
+  }
+}
+
+typedef struct Acceptor {
+  int sid; /* the listening socket, shared with the other acceptors unless SO_REUSEPORT is used */
+  int spare; /* a descriptor given up to turn a connection away when none are left */
+} Acceptor;
+
+Acceptor acceptors[MAX_ACCEPTORS];
+
+/*
+ * the accept threads stop while the server is frozen for a hot restart:
+ * each one stops once the pipe is readable, and waits until the thaw has
+ * emptied it, while the connections wait in the backlog
+ */
+typedef struct AcceptFreeze {
+  pthread_mutex_t mtx;
+  pthread_cond_t changed;
+  int on;
+  int stopped; /* accept threads waiting for the thaw */
+  int pipe[2];
+} AcceptFreeze;
+
+AcceptFreeze acceptFreeze = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0, {-1, -1}};
+
+/* called by an accept thread that found the server frozen, returns at the thaw */
+void stopAccepting() {
+  pthread_mutex_lock(&acceptFreeze.mtx);
+  acceptFreeze.stopped++;
+  pthread_cond_broadcast(&acceptFreeze.changed);
+  while(acceptFreeze.on) {
+    pthread_cond_wait(&acceptFreeze.changed, &acceptFreeze.mtx);
+  }
+  acceptFreeze.stopped--;
+  pthread_mutex_unlock(&acceptFreeze.mtx);
+}
+
+/* out of descriptors: take a connection with the spare and close it,
+   rather than leave it in the backlog to wake us again */
+void shedWithSpare(Acceptor* a) {
+  close(a->spare);
+  int fd = accept4(a->sid, NULL, NULL, SOCK_CLOEXEC);
+  if(fd >= 0) {
+    close(fd);
+    __sync_fetch_and_add(&n_shed, 1);
+  }
+  a->spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+/* an accept thread: sleeps until connections are pending and accepts all of them */
+void* acceptClients(void* data) {
+  Acceptor* a = data;
+  while(1) {
+    struct pollfd pfds[2] = {{a->sid, POLLIN, 0}, {acceptFreeze.pipe[0], POLLIN, 0}};
+    if(poll(pfds, 2, -1) < 0) {
+      continue;
+    }
+    if(pfds[1].revents & POLLIN) {
+      stopAccepting();
+      continue;
+    }
+    while(1) {
+      /* output is queued rather than waited for, see connection.h */
+      int fd = accept4(a->sid, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if(fd >= 0) {
+	admitClient(fd);
+      } else if(errno == EINTR || errno == ECONNABORTED) {
+	continue;
+      } else if((errno == EMFILE || errno == ENFILE) && a->spare >= 0) {
+	shedWithSpare(a);
+      } else {
+	/* EAGAIN, the backlog is empty */
+	break;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* the user data of an io_uring accept thread's operations */
+#define ACCEPT_DATA 0
+#define FREEZE_DATA 1 /* the poll of the freeze pipe */
+#define CANCEL_DATA 2
+
+/* an accept thread on io_uring: one multishot accept completes once for every connection */
+void* acceptClientsUring(void* data) {
+  Acceptor* a = data;
+  Ring ring;
+  if(initRing(&ring, 8, ACCEPT_COMPLETIONS) < 0) {
+    return acceptClients(data);
+  }
+  int armed = 0, watching = 0, stopping = 0;
+  while(1) {
+    if(stopping && !armed) {
+      /* the accept has ended, nothing is accepted until the thaw */
+      stopAccepting();
+      stopping = 0;
+    }
+    if(!armed) {
+      struct io_uring_sqe* sqe = ringSqe(&ring);
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = a->sid;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+      sqe->user_data = ACCEPT_DATA;
+      armed = 1;
+    }
+    if(!watching && !stopping) {
+      struct io_uring_sqe* sqe = ringSqe(&ring);
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = acceptFreeze.pipe[0];
+      sqe->poll32_events = POLLIN;
+      sqe->user_data = FREEZE_DATA;
+      watching = 1;
+    }
+    ringSubmit(&ring);
+    ringWait(&ring, -1);
+    struct io_uring_cqe* cqe;
+    while((cqe = ringPeek(&ring))) {
+      unsigned long long user = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      ringSeen(&ring);
+      if(user == FREEZE_DATA) {
+	watching = 0;
+	if(res > 0 && armed) {
+	  /* the accept is cancelled, and what it accepted first is admitted */
+	  struct io_uring_sqe* sqe = ringSqe(&ring);
+	  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	  sqe->addr = ACCEPT_DATA;
+	  sqe->user_data = CANCEL_DATA;
 	}
+	stopping = res > 0;
+	continue;
+      }
+      if(user == CANCEL_DATA) {
+	continue;
+      }
+      if(!(flags & IORING_CQE_F_MORE)) {
+	/* it stopped, after an error, when the completions overflowed or it was cancelled */
+	armed = 0;
+      }
+      if(res >= 0) {
+	admitClient(res);
+      } else if((res == -EMFILE || res == -ENFILE) && a->spare >= 0) {
+	shedWithSpare(a);
       }
-      pthread_mutex_unlock(&clients->mtx);
     }
   }
   return NULL;
 }
 
-int main(int argc, char* argv[]) {
-  /* set up logging */
-  if(argc > 1) {
-    /* debug mode on */
-    debug = 1;
-    logStr("debug mode on!");
+/*
+ * return 1 if nothing is left to handle once the accept threads and the
+ * reactor are frozen: no hub thread, game or fan-out is busy, and nothing
+ * was posted while they were looked at (see inboxIdle)
+ */
+int serverIdle(Directory* games) {
+  long posts = reactorPosts();
+  for(int k = 0; k < n_hubs; k++) {
+    if(!inboxIdle(&hubs[k].inbox)) {
+      return 0;
+    }
+  }
+  /* the hub room is idle, so no game is added or taken out meanwhile */
+  int slots = directorySlots(games);
+  for(int slot = 0; slot < slots; slot++) {
+    GameSummary summary;
+    Game* game = readSummary(games, slot, &summary) ? directoryGet(games, summary.id) : NULL;
+    if(game && (!inboxIdle(&game->inbox) || audienceBusy(&game->audience))) {
+      return 0;
+    }
+  }
+  /* the spectators of a finished game are closed by the fan-out */
+  int idle = 1;
+  pthread_mutex_lock(&finishedMtx);
+  for(LLNode* cur = finishedGames.head; cur && idle; cur = cur->next) {
+    Game* game = *(Game**)cur->data;
+    idle = inboxIdle(&game->inbox) && !audienceBusy(&game->audience);
+  }
+  pthread_mutex_unlock(&finishedMtx);
+  return idle && reactorPosts() == posts;
+}
+
+/* stop accepting, receiving and handling anything, see restart.h */
+void freezeServer(Directory* games) {
+  pthread_mutex_lock(&acceptFreeze.mtx);
+  acceptFreeze.on = 1;
+  write(acceptFreeze.pipe[1], "", 1);
+  while(acceptFreeze.stopped < n_acceptors) {
+    pthread_cond_wait(&acceptFreeze.changed, &acceptFreeze.mtx);
+  }
+  pthread_mutex_unlock(&acceptFreeze.mtx);
+  reactorFreeze();
+  while(!serverIdle(games)) {
+    usleep(100);
+  }
+  /* the journal is left whole for the new process */
+  flushJournal();
+}
+
+/* carry on after a hot restart failed */
+void thawServer() {
+  reactorThaw();
+  pthread_mutex_lock(&acceptFreeze.mtx);
+  char c;
+  read(acceptFreeze.pipe[0], &c, 1);
+  acceptFreeze.on = 0;
+  pthread_cond_broadcast(&acceptFreeze.changed);
+  pthread_mutex_unlock(&acceptFreeze.mtx);
+}
+
+/* a seat, which the engine may have or which may be empty */
+void saveSeat(Snapshot* s, int fd) {
+  putInt(s, fd < 0 ? fd : 0);
+  if(fd >= 0) {
+    putFd(s, fd);
+  }
+}
+
+int restoreSeat(Snapshot* s) {
+  int seat = getInt(s);
+  return seat < 0 ? seat : getFd(s);
+}
+
+/* what the new process of a hot restart needs of a game that is not over, see restoreGame */
+void saveGame(Snapshot* s, Game* game) {
+  putInt(s, game->id);
+  putInt(s, game->status);
+  putInt(s, game->bot);
+  putInt(s, game->timed);
+  putInt(s, game->clock[WHITE]);
+  putInt(s, game->clock[BLACK]);
+  putInt(s, game->increment);
+  /* the clock it is measured on is the same in every process */
+  putInt(s, game->turnStart);
+  putInt(s, game->match.queued ? game->match.key : -1);
+  putInt(s, game->n_players);
+  for(int i = 0; i < game->n_players; i++) {
+    saveSeat(s, game->players[i]);
+  }
+  putInt(s, game->status != WAITING && game->white != game->players[0]);
+  /* the position is played again from the moves */
+  putInt(s, game->history.len);
+  for(LLNode* cur = game->history.head; cur; cur = cur->next) {
+    Move* m = cur->data;
+    putInt(s, m->start);
+    putInt(s, m->end);
+  }
+  putInt(s, game->spectators.len);
+  for(int i = 0; i < game->spectators.len; i++) {
+    putFd(s, game->spectators.fds[i]);
+  }
+}
+
+/*
+ * set up a game saveGame wrote, which nothing can reach yet
+ * its matchmaker key is left in match.key, -1 if it was not queued
+ */
+Game* restoreGame(Snapshot* s, Directory* games) {
+  Game* game = newGame();
+  game->directory = games;
+  game->id = getInt(s);
+  game->status = getInt(s);
+  game->bot = getInt(s);
+  game->timed = getInt(s);
+  game->clock[WHITE] = getInt(s);
+  game->clock[BLACK] = getInt(s);
+  game->increment = getInt(s);
+  game->turnStart = getInt(s);
+  game->match.key = getInt(s);
+  game->n_players = getInt(s);
+  for(int i = 0; i < game->n_players; i++) {
+    game->players[i] = restoreSeat(s);
+  }
+  if(game->status != WAITING) {
+    int swapped = getInt(s);
+    game->white = game->players[swapped];
+    game->black = game->players[!swapped];
   } else {
-    debug = 0;
+    getInt(s);
+  }
+  int moves = getInt(s);
+  for(int i = 0; i < moves; i++) {
+    Move m;
+    m.start = getInt(s);
+    m.end = getInt(s);
+    applyMoveToPosition(&m, game->pos);
+    pushBackList(&game->history, &m, sizeof(Move));
+    game->moves++;
+  }
+  int spectators = getInt(s);
+  for(int i = 0; i < spectators; i++) {
+    int fd = getFd(s);
+    addFd(&game->spectators, fd);
+    joinAudience(&game->audience, fd);
+  }
+  return game;
+}
+
+/* hand a restored game its descriptors and start its clock and the engine again */
+void resumeGame(Game* game) {
+  publishGame(game);
+  if(game->bot) {
+    openBotPipe(game);
+  }
+  for(int i = 0; i < game->n_players; i++) {
+    if(game->players[i] >= 0) {
+      reactorAdd(game->players[i], &game->inbox);
+    }
+  }
+  for(int i = 0; i < game->spectators.len; i++) {
+    reactorAdd(game->spectators.fds[i], &game->inbox);
   }
+  armGameTimer(game);
+  /* the old process's search was lost with it */
+  if(game->status == ONGOING && game->bot && game->pos->toMove == botColor(game)) {
+    requestBotMove(game);
+  }
+}
 
-  /* create thread-safe arrays in which to keep the clients and games */
-  ProtectedIntArray* clients = malloc(sizeof(ProtectedIntArray) + sizeof(int)*MAX_CONNECTIONS);
-  ProtectedGameArray* games = malloc(sizeof(ProtectedGameArray) + sizeof(Game)*MAX_GAMES);
-  for(int i = 0; i < MAX_CONNECTIONS; i++) {
-    clients->arr[i] = 0;
+/* forEachConnection: add a client to the snapshot */
+void saveClient(Connection* conn, void* data) {
+  Snapshot* s = data;
+  putInt(s, 1);
+  putFd(s, conn->fd);
+  saveConnection(conn, s);
+}
+
+/*
+ * write what the new process of a hot restart needs: the listening
+ * sockets, the games that are not over and every client, while the server
+ * is frozen
+ * return the number of games
+ */
+int saveServer(Snapshot* s, Directory* games) {
+  putInt(s, n_acceptors);
+  for(int k = 0; k < n_acceptors; k++) {
+    putFd(s, acceptors[k].sid);
   }
-  for(int i = 0; i < MAX_GAMES; i++) {
-    games->arr[i] = NULL;
+  /* the games keep their ids, and the ids handed out before stay stale */
+  int slots = directorySlots(games);
+  int* gens = directoryGenerations(games);
+  putBytes(s, gens, sizeof(int) * slots);
+  free(gens);
+  int n = 0;
+  for(int slot = 0; slot < slots; slot++) {
+    GameSummary summary;
+    Game* game = readSummary(games, slot, &summary) ? directoryGet(games, summary.id) : NULL;
+    if(game && game->status != COMPLETED) {
+      putInt(s, 1);
+      saveGame(s, game);
+      n++;
+    }
   }
-  pthread_mutex_init(&clients->mtx, NULL);
-  pthread_mutex_init(&games->mtx, NULL);
+  putInt(s, 0);
+  forEachConnection(saveClient, s);
+  putInt(s, 0);
+  return n;
+}
 
-  /* create the hub room thread */
-  printf("Creating Hub Room thread\n");
-  HubThreadArgs args = {clients, games};
-  pthread_t hub;
-  pthread_create(&hub, NULL, hubRoom, &args);
-  int sid = bindAndListen(PORT_NUMBER);
+/* the games read back from the journal, by slot */
+typedef struct Recovery {
+  Game** games;
+  int* gens; /* above that of every id read in the slot, so none is handed out again */
+  int slots;
+} Recovery;
+
+/* readJournal: play each record on the game it is about */
+void replayRecord(JournalRecord* r, void* data) {
+  Recovery* rec = data;
+  if(r->game < 0) {
+    return;
+  }
+  int slot = r->game & (DIRECTORY_MAX_SLOTS - 1);
+  if(slot >= rec->slots) {
+    int slots = rec->slots ? rec->slots : DIRECTORY_PAGE;
+    while(slots <= slot) {
+      slots *= 2;
+    }
+    rec->games = realloc(rec->games, sizeof(Game*) * slots);
+    memset(rec->games + rec->slots, 0, sizeof(Game*) * (slots - rec->slots));
+    rec->gens = realloc(rec->gens, sizeof(int) * slots);
+    memset(rec->gens + rec->slots, 0, sizeof(int) * (slots - rec->slots));
+    rec->slots = slots;
+  }
+  int gen = (r->game >> DIRECTORY_SLOT_BITS) + 1;
+  if(gen > rec->gens[slot]) {
+    rec->gens[slot] = gen;
+  }
+  Game* game = rec->games[slot];
+  if(r->type == JOURNAL_BEGIN) {
+    /* a game written again after a restart replaces what was read of it */
+    if(game) {
+      destroyGame(game);
+    }
+    game = newGame();
+    game->id = r->game;
+    game->status = SUSPENDED;
+    game->bot = r->bot;
+    game->timed = r->timed;
+    game->increment = r->increment;
+    game->clock[WHITE] = r->white;
+    game->clock[BLACK] = r->black;
+    /* the players are gone, white's seat is the first */
+    game->n_players = 2;
+    game->players[0] = r->bot && r->botWhite ? BOT_SEAT : VACANT_SEAT;
+    game->players[1] = r->bot && !r->botWhite ? BOT_SEAT : VACANT_SEAT;
+    game->white = game->players[0];
+    game->black = game->players[1];
+    rec->games[slot] = game;
+    return;
+  }
+  if(game == NULL || game->id != r->game) {
+    /* it began in a segment that was deleted */
+    return;
+  }
+  Move m = {r->start, r->end};
+  if(r->type == JOURNAL_END || (r->type == JOURNAL_MOVE && !moveIsLegal(&m, game->pos))) {
+    /* over, or the journal lost some of its moves */
+    destroyGame(game);
+    rec->games[slot] = NULL;
+  } else if(r->type == JOURNAL_MOVE) {
+    applyMoveToPosition(&m, game->pos);
+    pushBackList(&game->history, &m, sizeof(Move));
+    game->moves++;
+    game->clock[WHITE] = r->white;
+    game->clock[BLACK] = r->black;
+  }
+}
 
-  char buf[16];
-  while(1) {
+/*
+ * set up the games in the journal that had not ended, with the ids they
+ * had, to wait for their players to take their seats back (see joinPlayer)
+ * return how many there are
+ */
+int recoverGames(Directory* games) {
+  Recovery rec = {NULL, NULL, 0};
+  int records = readJournal(JOURNAL_DIR, replayRecord, &rec);
+  int* ids = malloc(sizeof(int) * (rec.slots + 1));
+  void** items = malloc(sizeof(void*) * (rec.slots + 1));
+  int n = 0;
+  for(int slot = 0; slot < rec.slots; slot++) {
+    Game* game = rec.games[slot];
+    if(game && numberLegalMoves(game->pos) == 0) {
+      /* the last move ended it, but its end was not written */
+      destroyGame(game);
+      game = NULL;
+    }
+    if(game) {
+      ids[n] = game->id;
+      items[n] = game;
+      n++;
+    }
+  }
+  /* the games set up again keep their ids, the other slots start above the ids they had */
+  restoreDirectory(games, rec.gens, rec.slots, items, ids, n);
+  for(int i = 0; i < n; i++) {
+    Game* game = items[i];
+    game->directory = games;
+    publishGame(game);
+    if(game->bot) {
+      openBotPipe(game);
+    }
+    /* abandoned if no one comes back in time */
+    game->turnStart = nowMs();
+    armGameTimer(game);
+  }
+  if(records > 0) {
+    printf("Recovered %d games from %d journal records\n", n, records);
+  }
+  free(rec.gens);
+  free(ids);
+  free(items);
+  free(rec.games);
+  return n;
+}
 
-    fd_set fdin;
-    FD_ZERO(&fdin);
-    FD_SET(0, &fdin);
-    FD_SET(sid, &fdin);
-
-    int selectResult = select(sid+1, &fdin, NULL, NULL, NULL);
-
-    if(selectResult > 0) {
-      if(FD_ISSET(0, &fdin)) {
-	int rb = read(0, buf, 16);
-	if(strncmp("!exit", buf, 5) == 0) {
-	  /* exit the server */
-	  printf("Received kill command, terminating all threads...\n");
-	  close(sid);
-	  exit(0);
-	}
-      } else if(FD_ISSET(sid, &fdin)) {
-	/* a new connection is incoming */
-	struct sockaddr_in cli;
-	socklen_t cliSize = (socklen_t)sizeof(struct sockaddr_in);
-	int fd = accept(sid, (struct sockaddr*)&cli, &cliSize);
-	/* we've accepted a new connection, find a slot for it in the clients array */
-	int accepted = 0;
-	pthread_mutex_lock(&clients->mtx);
-	for(int i = 0; i < MAX_CONNECTIONS; i++) {
-	  if(clients->arr[i] == 0) {
-	    clients->arr[i] = fd;
-	    printf("Accepted a new client with descriptor %d in slot %d\n", fd, i);
-	    char msg[] = "Connection accepted. Enter commands as you wish. Type \"help\" for help.\n";
-	    write(fd, msg, sizeof(msg));
-	    accepted = 1;
-	    break;
-	  }
-	}
-	if(!accepted) {
-	  printf("Couldn't fit a client in with descriptor %d. Closing socket...\n", fd);
-	  char full[] = "We're full right now. Please try again later.\n";
-	  write(fd, full, sizeof(full));
-	  close(fd);
-	}
-	pthread_mutex_unlock(&clients->mtx);
+/*
+ * start the journal, with the games that have begun written to it again so
+ * the segments read back can go, while none of them can change
+ */
+void startJournaling(Directory* games) {
+  int held = startJournal(JOURNAL_DIR, journalInterval);
+  if(held < 0) {
+    printf("The games are not journaled\n");
+    return;
+  }
+  int slots = directorySlots(games);
+  for(int slot = 0; slot < slots; slot++) {
+    GameSummary summary;
+    Game* game = readSummary(games, slot, &summary) ? directoryGet(games, summary.id) : NULL;
+    if(game && game->status != WAITING && game->status != COMPLETED) {
+      journalGame(game);
+    }
+  }
+  releaseJournal(held);
+}
+
+/* for qsort: the game that has waited longest first */
+int compareWaiting(const void* a, const void* b) {
+  long long x = (*(Game**)a)->turnStart, y = (*(Game**)b)->turnStart;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * set up what saveServer wrote in the new process, with the reactor frozen
+ * so nothing is handled before everything is in place, and put the
+ * listening sockets in acceptors
+ * return how many listening sockets there were
+ */
+int restoreServer(Snapshot* s, Directory* games) {
+  reactorFreeze();
+  int sockets = getInt(s);
+  for(int k = 0; k < sockets; k++) {
+    int sid = getFd(s);
+    if(k < MAX_ACCEPTORS) {
+      acceptors[k].sid = sid;
+    }
+  }
+  int len;
+  const char* buf = getBytes(s, &len);
+  int slots = len / sizeof(int);
+  int* gens = malloc(sizeof(int) * (slots + 1));
+  memcpy(gens, buf, sizeof(int) * slots);
+
+  Game** restored = NULL;
+  int n = 0, cap = 0;
+  while(getInt(s)) {
+    if(n == cap) {
+      cap = cap ? cap * 2 : 64;
+      restored = realloc(restored, sizeof(Game*) * cap);
+    }
+    restored[n++] = restoreGame(s, games);
+  }
+  int* ids = malloc(sizeof(int) * (n + 1));
+  void** items = malloc(sizeof(void*) * (n + 1));
+  for(int i = 0; i < n; i++) {
+    ids[i] = restored[i]->id;
+    items[i] = restored[i];
+  }
+  restoreDirectory(games, gens, slots, items, ids, n);
+  free(gens);
+  free(ids);
+  free(items);
+
+  int* fds = NULL;
+  int clients = 0, fdCap = 0;
+  while(getInt(s)) {
+    int fd = getFd(s);
+    Connection* conn = restoreConnection(fd, s);
+    initTimer(&conn->idle, hubOf(fd), fd);
+    if(clients == fdCap) {
+      fdCap = fdCap ? fdCap * 2 : 64;
+      fds = realloc(fds, sizeof(int) * fdCap);
+    }
+    fds[clients++] = fd;
+  }
+  n_connections = clients;
+  if(s->bad) {
+    printf("The snapshot ended early, some clients or games may be missing\n");
+  }
+
+  /* the games wait for a player in the order they did */
+  qsort(restored, n, sizeof(Game*), compareWaiting);
+  for(int i = 0; i < n; i++) {
+    Game* game = restored[i];
+    int key = game->match.key;
+    if(game->status == WAITING && key >= 0) {
+      queueGame(&matchmaker, &game->match, game->id, key);
+    }
+    resumeGame(game);
+  }
+  /* every client no game took is in the hub room */
+  long long now = monotonicMs();
+  for(int i = 0; i < clients; i++) {
+    if(reactorOwner(fds[i]) == NULL) {
+      reactorAdd(fds[i], hubOf(fds[i]));
+      if(idleTimeout > 0) {
+	long left = idleTimeout - (now - connectionOf(fds[i])->lastInput);
+	armTimer(&connectionOf(fds[i])->idle, left > 0 ? left : 1);
       }
     }
   }
-  return 0;
+  /* they are journaled by this process from now on */
+  if(journalInterval > 0) {
+    startJournaling(games);
+  }
+  reactorThaw();
+  /* the input that came with them is handled first, then what arrives */
+  for(int i = 0; i < clients; i++) {
+    reactorResume(fds[i]);
+  }
+  printf("Took over %d games and %d connections\n", n, clients);
+  free(fds);
+  free(restored);
+  return sockets < MAX_ACCEPTORS ? sockets : MAX_ACCEPTORS;
 }
 
+/*
+ * hand the server to a new process started from the binary on disk with
+ * the same options (see restart.h) and exit, or carry on if it does not
+ * take over
+ */
+void restartServer(Directory* games) {
+  printf("Starting a new process to hand the server to...\n");
+  int sock = startSuccessor(serverArgv);
+  if(sock < 0) {
+    printf("The new process did not start, carrying on\n");
+    return;
+  }
+  long long start = monotonicMs();
+  freezeServer(games);
+  Snapshot s;
+  initSnapshot(&s);
+  int n = saveServer(&s, games);
+  if(handOver(sock, &s) == 0) {
+    printf("Handed %d games and %d connections over in %lld ms, exiting\n", n, n_connections, monotonicMs() - start);
+    exit(0);
+  }
+  freeSnapshot(&s);
+  thawServer();
+  printf("The new process failed to take over, carrying on\n");
+}
+
+/*
+ * run the server, as the whole server or as one of the shards (see shard.h),
+ * the console is only read by the whole server
+ */
+void runServer(int shard) {
+  /* create the directory in which to keep the games */
+  Directory* games;
+  if(shard >= 0) {
+    /* set up by startShards, in the lobby every shard reads */
+    games = shardDirectory(shard);
+  } else {
+    games = malloc(sizeof(Directory));
+    initDirectory(games, maxGames);
+  }
+  initList(&finishedGames);
+  initMatchmaker(&matchmaker, TIME_CONTROLS);
+  setOutputLimits(highWater, maxQueued);
+
+  /* endgame bitbases are optional, generate them with cantibb */
+  int nbb = loadBitbases("./bitbases");
+  printf("Loaded %d endgame bitbases\n", nbb);
+
+  /* the shared pool that runs every engine search */
+  int searchers = 0;
+  if(shard >= 0) {
+    /* the shards share the cores */
+    searchers = (sysconf(_SC_NPROCESSORS_ONLN) - 1) / shardCount();
+    if(searchers < 1) {
+      searchers = 1;
+    }
+  }
+  startSearchPool(searchers);
+
+  /* finished games are annotated in the background and archived */
+  startAnnotator("./archive");
 
+  /* the reactor watches every client connection, and the games are run by a pool of workers */
+  int uring = startReactor(flushConnection, receiveInput, useUring);
+  useReceivedInput(uring);
+  startGameWorkers(0);
 
+  /* and the boards and messages the games broadcast are sent to their spectators by the fan-out */
+  startFanout(0);
 
+  /* create the hub room threads, one per two cores unless given */
+  if(n_hubs <= 0) {
+    n_hubs = (sysconf(_SC_NPROCESSORS_ONLN) + 1) / 2;
+  }
+  if(n_hubs < 1) {
+    n_hubs = 1;
+  }
+  if(n_hubs > MAX_HUB_THREADS) {
+    n_hubs = MAX_HUB_THREADS;
+  }
+  printf("Creating %d Hub Room threads\n", n_hubs);
+  HubThreadArgs args[MAX_HUB_THREADS];
+  for(int k = 0; k < n_hubs; k++) {
+    initInbox(&hubs[k].inbox);
+    hubs[k].seen = LONG_MAX;
+    args[k].hub = &hubs[k];
+    args[k].games = games;
+    pthread_t hub;
+    pthread_create(&hub, NULL, hubRoom, &args[k]);
+  }
+
+  /* clients other shards hand over join the hub room like accepted ones */
+  if(shard >= 0) {
+    startHandOffs(admitHandOff);
+  }
+
+  /* the accept threads, each with a socket of its own if the port can be shared */
+  if(n_acceptors < 1) {
+    n_acceptors = 1;
+  }
+  if(n_acceptors > MAX_ACCEPTORS) {
+    n_acceptors = MAX_ACCEPTORS;
+  }
+  if(backlog < 1) {
+    backlog = DEFAULT_BACKLOG;
+  }
+  pipe2(acceptFreeze.pipe, O_NONBLOCK | O_CLOEXEC);
+
+  /* on a hot restart the old process's clients, games and listening sockets are taken over */
+  int inherited = 0;
+  if(restartSock >= 0) {
+    Snapshot s;
+    if(takeOver(restartSock, &s) < 0) {
+      printf("Could not take over from the old process\n");
+      exit(-1);
+    }
+    /* the old process exits, and everything is served from here on */
+    tookOver(restartSock);
+    inherited = restoreServer(&s, games);
+    freeSnapshot(&s);
+  } else if(journalInterval > 0) {
+    /* the games a crash ended are set up again before anyone can connect */
+    recoverGames(games);
+    startJournaling(games);
+  }
+
+  for(int k = 0; k < n_acceptors; k++) {
+    int sid = k < inherited ? acceptors[k].sid : -1;
+    if(sid < 0 && (n_acceptors > 1 || shard >= 0)) {
+      sid = bindAndListen(PORT_NUMBER, backlog, 1);
+      if(sid < 0 && shard >= 0) {
+	printf("Shard %d cannot share port %d\n", shard, PORT_NUMBER);
+	exit(-1);
+      }
+    }
+    if(sid < 0) {
+      sid = k == 0 ? bindAndListen(PORT_NUMBER, backlog, 0) : acceptors[0].sid;
+    }
+    acceptors[k].sid = sid;
+    acceptors[k].spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    pthread_t pid;
+    pthread_create(&pid, NULL, uring ? acceptClientsUring : acceptClients, &acceptors[k]);
+  }
+  printf("Accepting connections on port %d with %d threads\n", PORT_NUMBER, n_acceptors);
+
+  if(shard >= 0) {
+    /* the supervisor has the console */
+    while(1) {
+      pause();
+    }
+  }
+
+  /* the console */
+  char buf[16];
+  int rb;
+  while((rb = read(0, buf, 16)) > 0) {
+    if(strncmp("!exit", buf, 5) == 0) {
+      /* exit the server */
+      printf("Received kill command, terminating all threads...\n");
+      exit(0);
+    } else if(strncmp("!restart", buf, 8) == 0) {
+      /* returns only if the new process did not take over */
+      restartServer(games);
+    } else if(strncmp("!stats", buf, 6) == 0) {
+      OutputStats stats;
+      outputStats(&stats);
+      printf("%d connected, %ld turned away, %ld bytes queued, %ld frames superseded, %ld slow clients disconnected\n",
+	     n_connections, n_shed, stats.queued, stats.dropped, stats.shut);
+    }
+  }
+  /* no console, serve until killed */
+  while(1) {
+    pause();
+  }
+}
+
+int main(int argc, char* argv[]) {
+  /* limits, all unlimited unless given */
+  int opt;
+  int n_shards = 0;
+  highWater = maxQueued = 0;
+  backlog = DEFAULT_BACKLOG;
+  n_acceptors = 1;
+  useUring = 0;
+  n_hubs = 0;
+  idleTimeout = DEFAULT_IDLE_MINUTES * 60000L;
+  abandonTimeout = DEFAULT_ABANDON_MINUTES * 60000L;
+  while((opt = getopt(argc, argv, "c:g:s:w:q:l:b:a:i:t:up:j:R:")) != -1) {
+    if(opt == 'c') {
+      maxConnections = atoi(optarg);
+    } else if(opt == 'g') {
+      maxGames = atoi(optarg);
+    } else if(opt == 's') {
+      maxSpectators = atoi(optarg);
+    } else if(opt == 'w') {
+      highWater = atoi(optarg) * 1024;
+    } else if(opt == 'q') {
+      maxQueued = atoi(optarg) * 1024;
+    } else if(opt == 'l') {
+      n_hubs = atoi(optarg);
+    } else if(opt == 'b') {
+      backlog = atoi(optarg);
+    } else if(opt == 'a') {
+      n_acceptors = atoi(optarg);
+    } else if(opt == 'i') {
+      idleTimeout = atof(optarg) * 60000L;
+    } else if(opt == 't') {
+      abandonTimeout = atof(optarg) * 60000L;
+    } else if(opt == 'u') {
+      useUring = 1;
+    } else if(opt == 'p') {
+      n_shards = atoi(optarg);
+    } else if(opt == 'j') {
+      journalInterval = atoi(optarg);
+    } else if(opt == 'R') {
+      /* given by the process this one takes over from, see restart.h */
+      restartSock = atoi(optarg);
+    } else {
+      printf("Usage: %s [-c <connections>] [-g <games>] [-s <spectators per game>] [-w <high-water KiB>] [-q <output limit KiB>] [-l <hub threads>] [-b <backlog>] [-a <accept threads>] [-i <idle minutes>] [-t <abandon minutes>] [-u] [-p <processes>] [-j <sync milliseconds>] [debug]\n", argv[0]);
+      exit(-1);
+    }
+  }
+
+  serverArgv = argv;
+
+  /* set up logging */
+  if(optind < argc) {
+    /* debug mode on */
+    debug = 1;
+    logStr("debug mode on!");
+  } else {
+    debug = 0;
+  }
+
+  if(n_shards > 1 && journalInterval > 0) {
+    printf("The games are not journaled with -p\n");
+    journalInterval = 0;
+  }
+  if(n_shards > 1) {
+    /* the shards are forked before any thread is started, and this process only watches them */
+    startShards(n_shards, maxGames, runServer);
+    char buf[16];
+    int rb;
+    while(waitShards(0) && (rb = read(0, buf, 16)) > 0) {
+      if(strncmp("!exit", buf, 5) == 0) {
+	printf("Received kill command, terminating all shards...\n");
+	stopShards();
+	exit(0);
+      } else if(strncmp("!stats", buf, 6) == 0) {
+	printShards();
+      }
+    }
+    /* no console, keep restarting them until killed */
+    while(waitShards(-1)) {
+    }
+    return 0;
+  }
+  runServer(-1);
+  return 0;
+}
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "shard.h"
+#include "timer.h"
+
+#define RESTART_DELAY_MS 1000 /* a shard that dies sooner than this after starting is restarted this much later */
+
+typedef struct Shard {
+  pid_t pid;
+  int pidfd; /* readable once the process has exited, -1 if none */
+  int handOff[2]; /* [0] is read by the shard, [1] written by the others */
+  long long started; /* see monotonicMs */
+  int restarts;
+} Shard;
+
+typedef struct Shards {
+  int n; /* 0 if the server is one process */
+  int self; /* -1 in the supervisor */
+  int bits; /* of a game id that are the shard */
+  int gameLimit;
+  char* lobby; /* the directories, in shared memory */
+  size_t dirSize;
+  ShardFunc run;
+  AdmitFunc admit;
+  Shard shards[MAX_SHARDS];
+} Shards;
+
+static Shards shards = {0, -1};
+
+int shardCount() {
+  return shards.n;
+}
+
+int thisShard() {
+  return shards.self;
+}
+
+int shardOf(int id) {
+  return id & ((1 << shards.bits) - 1);
+}
+
+Directory* shardDirectory(int shard) {
+  return (Directory*)(shards.lobby + shard * shards.dirSize);
+}
+
+/* fork shard k, which never returns here */
+static void forkShard(int k) {
+  Shard* s = &shards.shards[k];
+  /* nothing buffered is printed twice */
+  fflush(stdout);
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if(pid < 0) {
+    printf("fork: %s\n", strerror(errno));
+    return;
+  }
+  if(pid == 0) {
+    /* a shard does not outlive the supervisor */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if(getppid() != parent) {
+      exit(0);
+    }
+    shards.self = k;
+    initSharedDirectory(shardDirectory(k), shards.gameLimit, k, shards.bits);
+    shards.run(k);
+    exit(0);
+  }
+  s->pid = pid;
+  s->pidfd = syscall(SYS_pidfd_open, pid, 0);
+  s->started = monotonicMs();
+}
+
+void startShards(int n, int gameLimit, ShardFunc run) {
+  if(n > MAX_SHARDS) {
+    n = MAX_SHARDS;
+  }
+  shards.n = n;
+  shards.bits = 0;
+  while((1 << shards.bits) < n) {
+    shards.bits++;
+  }
+  shards.gameLimit = gameLimit;
+  shards.run = run;
+  shards.dirSize = sharedDirectorySize(shards.bits);
+  /* only the pages that are used take memory */
+  shards.lobby = mmap(NULL, n * shards.dirSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(shards.lobby == MAP_FAILED) {
+    printf("mmap: %s\n", strerror(errno));
+    exit(-1);
+  }
+  for(int k = 0; k < n; k++) {
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, shards.shards[k].handOff) < 0) {
+      printf("socketpair: %s\n", strerror(errno));
+      exit(-1);
+    }
+    shards.shards[k].restarts = 0;
+  }
+  for(int k = 0; k < n; k++) {
+    forkShard(k);
+  }
+  printf("Started %d shards\n", n);
+}
+
+int waitShards(int fd) {
+  while(1) {
+    struct pollfd pfds[MAX_SHARDS + 1];
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    for(int k = 0; k < shards.n; k++) {
+      pfds[k + 1].fd = shards.shards[k].pidfd;
+      pfds[k + 1].events = POLLIN;
+    }
+    if(poll(pfds, shards.n + 1, -1) < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      return 0;
+    }
+    for(int k = 0; k < shards.n; k++) {
+      if(!(pfds[k + 1].revents & POLLIN)) {
+	continue;
+      }
+      Shard* s = &shards.shards[k];
+      int status;
+      waitpid(s->pid, &status, 0);
+      close(s->pidfd);
+      s->pidfd = -1;
+      printf("Shard %d (pid %d) exited with status %d, restarting it\n", k, s->pid, status);
+      long long lived = monotonicMs() - s->started;
+      if(lived < RESTART_DELAY_MS) {
+	/* do not spin on a shard that cannot start */
+	usleep((RESTART_DELAY_MS - lived) * 1000);
+      }
+      s->restarts++;
+      forkShard(k);
+    }
+    if(pfds[0].revents) {
+      return 1;
+    }
+  }
+}
+
+void stopShards() {
+  for(int k = 0; k < shards.n; k++) {
+    kill(shards.shards[k].pid, SIGTERM);
+  }
+}
+
+void printShards() {
+  for(int k = 0; k < shards.n; k++) {
+    Directory* d = shardDirectory(k);
+    printf("shard %d: pid %d, %d games, restarted %d times\n", k, shards.shards[k].pid,
+	   *(volatile int*)&d->len, shards.shards[k].restarts);
+  }
+}
+
+/* receives the clients handed to this shard */
+static void* handOffThread(void* data) {
+  int sock = shards.shards[shards.self].handOff[0];
+  while(1) {
+    HandOff h;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&h, sizeof(h)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t rb = recvmsg(sock, &msg, 0);
+    if(rb < 0) {
+      if(errno != EINTR) {
+	printf("hand-off: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    if(c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    if(rb < offsetof(HandOff, input) || h.len < 0 || h.len > rb - offsetof(HandOff, input)) {
+      /* not sent by a shard */
+      close(fd);
+      continue;
+    }
+    shards.admit(fd, &h);
+  }
+  return NULL;
+}
+
+void startHandOffs(AdmitFunc admit) {
+  shards.admit = admit;
+  pthread_t pid;
+  pthread_create(&pid, NULL, handOffThread, NULL);
+  pthread_detach(pid);
+}
+
+int handOffClient(int shard, int fd, HandOff* handOff) {
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  /* only the input there is is sent */
+  struct iovec iov = {handOff, offsetof(HandOff, input) + handOff->len};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  ssize_t wb;
+  do {
+    wb = sendmsg(shards.shards[shard].handOff[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  } while(wb < 0 && errno == EINTR);
+  return wb < 0 ? -1 : 0;
+}
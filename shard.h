@@ -0,0 +1,75 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "directory.h"
+#include "connection.h"
+
+/*
+ * Running the server as several processes (shards) on one port
+ *
+ * The process the server is started as only supervises: it maps the lobby,
+ * the shards' game directories, in memory shared with its children, makes
+ * one hand-off socket per shard and forks the shards. Each shard is a whole
+ * server of its own, with its own listening socket bound with SO_REUSEPORT,
+ * so the kernel spreads the connections over them, and its own games, whose
+ * ids carry its number (see directory.h). A shard that crashes takes only
+ * its own games and clients with it: the supervisor notices through its
+ * pidfd, forks it again and the new one sets up its directory again.
+ *
+ * Every shard reads every directory, so listing the games shows them all.
+ * A client asking to join or spectate a game of another shard is handed to
+ * it: its descriptor is sent over the owning shard's hand-off socket with
+ * SCM_RIGHTS, together with the command and whatever input the client sent
+ * after it, and the owning shard puts the client in its hub room and runs
+ * the command as if the client had sent it there. The hand-off sockets are
+ * made before the first fork and held by the supervisor, so a client handed
+ * to a shard that is being restarted waits in the socket for it.
+ *
+ * Players are only paired within a shard (joinplay without an id and
+ * quickplay), and the limits (-c, -g) apply to each shard.
+ */
+
+#define MAX_SHARDS 16
+
+/* what a shard sends with a client it hands over */
+typedef struct HandOff {
+  int binary; /* speaks the binary protocol */
+  int deltas; /* gets boards as deltas */
+  int len; /* bytes of input */
+  char input[CONN_INPUT_SIZE]; /* the command, then the rest of the client's unread input */
+} HandOff;
+
+/* run a shard, in its own process */
+typedef void (*ShardFunc)(int shard);
+/* called by a shard for each client handed to it */
+typedef void (*AdmitFunc)(int fd, HandOff* handOff);
+
+/*
+ * map the lobby, make the hand-off sockets and fork n shards, each of which
+ * sets up its directory with room for gameLimit games and calls run
+ * call this before any thread is started
+ */
+void startShards(int n, int gameLimit, ShardFunc run);
+
+/* in the supervisor: restart the shards that exit until fd has input, return 0 if it failed */
+int waitShards(int fd);
+/* in the supervisor: end every shard */
+void stopShards();
+/* in the supervisor: print a line about each shard */
+void printShards();
+
+/* the number of shards, 0 if the server is one process */
+int shardCount();
+/* the shard this process is, -1 in the supervisor or if the server is one process */
+int thisShard();
+/* the shard that owns the game with id */
+int shardOf(int id);
+/* a shard's directory, which this shard may only read unless it is its own */
+Directory* shardDirectory(int shard);
+
+/* receive the clients handed to this shard on a thread of their own */
+void startHandOffs(AdmitFunc admit);
+/* send the client of fd to shard, return 0 or -1 if its socket is full; fd stays open here */
+int handOffClient(int shard, int fd, HandOff* handOff);
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include "timer.h"
+
+#define TIMER_RANGE (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS)) /* ticks the wheel reaches */
+
+typedef struct Wheel {
+  pthread_mutex_t mtx; /* protects everything below, and the timers on the wheel */
+  Timer slots[TIMER_LEVELS][TIMER_SLOTS]; /* the heads of circular lists, set up on first use */
+  int ready;
+  unsigned long long base; /* the next tick to expire */
+  int armed; /* timers on the wheel */
+  unsigned long long wakeAt; /* the tick the reactor sleeps until, see timerTimeout */
+} Wheel;
+
+static Wheel wheel = {PTHREAD_MUTEX_INITIALIZER, .wakeAt = ~0ULL};
+
+long long monotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* wheel.mtx must be held */
+static void setUpWheel() {
+  for(int l = 0; l < TIMER_LEVELS; l++) {
+    for(int i = 0; i < TIMER_SLOTS; i++) {
+      wheel.slots[l][i].prev = wheel.slots[l][i].next = &wheel.slots[l][i];
+    }
+  }
+  wheel.base = monotonicMs() / TIMER_TICK_MS;
+  wheel.ready = 1;
+}
+
+/* put t in the slot for its expiry, wheel.mtx must be held */
+static void linkTimer(Timer* t) {
+  if(t->expires < wheel.base) {
+    t->expires = wheel.base;
+  }
+  unsigned long long delta = t->expires - wheel.base;
+  unsigned long long e = t->expires;
+  if(delta >= TIMER_RANGE) {
+    /* out of reach, it is cascaded into the last level again when it comes up */
+    delta = TIMER_RANGE - 1;
+    e = wheel.base + delta;
+  }
+  int level = 0;
+  while(delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1)))) {
+    level++;
+  }
+  Timer* head = &wheel.slots[level][(e >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static void unlinkTimer(Timer* t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = NULL;
+}
+
+/* move the timers in a slot of an upper level down to the levels below */
+static void cascade(int level, int index) {
+  Timer* head = &wheel.slots[level][index];
+  if(head->next == head) {
+    return;
+  }
+  Timer* t = head->next;
+  head->prev->next = NULL;
+  head->prev = head->next = head;
+  while(t) {
+    Timer* next = t->next;
+    linkTimer(t);
+    t = next;
+  }
+}
+
+void initTimer(Timer* t, Inbox* inbox, int fd) {
+  t->prev = t->next = NULL;
+  t->expires = 0;
+  t->inbox = inbox;
+  t->fd = fd;
+}
+
+void armTimer(Timer* t, long ms) {
+  long long due = monotonicMs() + (ms > 0 ? ms : 0);
+  pthread_mutex_lock(&wheel.mtx);
+  if(!wheel.ready) {
+    setUpWheel();
+  }
+  if(t->prev) {
+    unlinkTimer(t);
+    wheel.armed--;
+  }
+  int wake = 0;
+  if(wheel.armed == 0) {
+    /* the reactor stopped advancing the wheel, so it starts from now */
+    wheel.base = monotonicMs() / TIMER_TICK_MS;
+    wake = 1;
+  }
+  /* the first tick that starts once ms have passed */
+  t->expires = (due + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  linkTimer(t);
+  wheel.armed++;
+  if(t->expires < wheel.wakeAt) {
+    /* due before the reactor would wake */
+    wheel.wakeAt = t->expires;
+    wake = 1;
+  }
+  pthread_mutex_unlock(&wheel.mtx);
+  if(wake) {
+    /* the reactor may be asleep without a timeout */
+    reactorWake();
+  }
+}
+
+void cancelTimer(Timer* t) {
+  pthread_mutex_lock(&wheel.mtx);
+  if(t->prev) {
+    unlinkTimer(t);
+    wheel.armed--;
+  }
+  pthread_mutex_unlock(&wheel.mtx);
+}
+
+int timerArmed(Timer* t) {
+  /* no lock: its event is on the way if it is expiring */
+  return *(Timer* volatile*)&t->prev != NULL;
+}
+
+/*
+ * the first tick from base on at which runTimers has something to do: a
+ * timer of the first level expires, or a slot of a level above is cascaded,
+ * which is never later than its timers expire
+ * wheel.mtx must be held
+ */
+static unsigned long long nextTick() {
+  unsigned long long next = ~0ULL;
+  for(int i = 0; i < TIMER_SLOTS; i++) {
+    Timer* head = &wheel.slots[0][(wheel.base + i) & (TIMER_SLOTS - 1)];
+    if(head->next != head) {
+      next = wheel.base + i;
+      break;
+    }
+  }
+  for(int l = 1; l < TIMER_LEVELS; l++) {
+    int shift = TIMER_SLOT_BITS * l;
+    /* the first tick the level cascades at, which may be base itself */
+    unsigned long long turn = (wheel.base + (1ULL << shift) - 1) >> shift;
+    for(int j = 0; j < TIMER_SLOTS; j++) {
+      unsigned long long tick = (turn + j) << shift;
+      if(tick >= next) {
+	break;
+      }
+      Timer* head = &wheel.slots[l][(turn + j) & (TIMER_SLOTS - 1)];
+      if(head->next != head) {
+	next = tick;
+	break;
+      }
+    }
+  }
+  return next;
+}
+
+int timerTimeout() {
+  pthread_mutex_lock(&wheel.mtx);
+  int timeout = -1;
+  wheel.wakeAt = ~0ULL;
+  if(wheel.armed > 0) {
+    /* sleep until a timer is due, not tick by tick */
+    wheel.wakeAt = nextTick();
+    long long wait = (long long)wheel.wakeAt * TIMER_TICK_MS - monotonicMs();
+    timeout = wait <= 0 ? 0 : wait < INT_MAX ? wait : INT_MAX;
+  }
+  pthread_mutex_unlock(&wheel.mtx);
+  return timeout;
+}
+
+void runTimers() {
+  unsigned long long now = monotonicMs() / TIMER_TICK_MS;
+  pthread_mutex_lock(&wheel.mtx);
+  while(wheel.armed > 0 && wheel.base <= now) {
+    /* each time a level has gone round, the next slot of the one above comes down */
+    for(int l = 1; l < TIMER_LEVELS; l++) {
+      if((wheel.base & ((1ULL << (TIMER_SLOT_BITS * l)) - 1)) != 0) {
+	break;
+      }
+      cascade(l, (wheel.base >> (TIMER_SLOT_BITS * l)) & (TIMER_SLOTS - 1));
+    }
+    Timer* head = &wheel.slots[0][wheel.base & (TIMER_SLOTS - 1)];
+    wheel.base++;
+    while(head->next != head) {
+      Timer* t = head->next;
+      unlinkTimer(t);
+      wheel.armed--;
+      /* under the lock, so a cancelled timer never posts */
+      postEvent(t->inbox, EVENT_TIMER, t->fd);
+    }
+  }
+  pthread_mutex_unlock(&wheel.mtx);
+}
@@ -0,0 +1,65 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "reactor.h"
+
+/*
+ * Timers, kept on a hashed hierarchical timer wheel advanced by the reactor
+ *
+ * The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots. A slot of the
+ * first level holds the timers that expire in one tick of TIMER_TICK_MS, a
+ * slot of the second the ones that expire in one turn of the first level,
+ * and so on. Each slot is a list of timers, so arming and cancelling a timer
+ * is a constant number of pointer changes however many are armed. Each time
+ * the first level has gone round, the next slot of the level above is
+ * emptied into the levels below (cascaded), so a timer is moved at most
+ * TIMER_LEVELS - 1 times before it expires.
+ *
+ * The reactor thread advances the wheel whenever it wakes, and sleeps
+ * until the first tick at which a timer expires or a slot is cascaded, so
+ * an idle server with thousands of far-off timers armed hardly ever wakes.
+ * Arming a timer that is due sooner wakes it. A timer that expires posts an
+ * EVENT_TIMER for its descriptor to its inbox, where it is handled in turn
+ * with the owner's other events, so the owner needs no lock of its own.
+ *
+ * A timer may be cancelled after it has expired and before its event is
+ * served, so an owner checks that what the timer was for is still due when
+ * the event arrives, and arms it again if not. That also makes re-arming
+ * lazy: an owner whose deadline keeps moving, like a connection's idle
+ * timeout, only arms its timer again once it expires.
+ */
+
+#define TIMER_TICK_MS 10
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4 /* 2^24 ticks, about 46 hours, a later timer is cascaded again */
+
+typedef struct Timer {
+  struct Timer* prev; /* in the wheel's slot, NULL while not armed */
+  struct Timer* next;
+  unsigned long long expires; /* tick */
+  Inbox* inbox; /* where the event is posted */
+  int fd; /* the event's descriptor */
+} Timer;
+
+/* set up a timer that posts EVENT_TIMER for fd to inbox */
+void initTimer(Timer* t, Inbox* inbox, int fd);
+
+/* have the timer expire in ms milliseconds, moving it if it was armed */
+void armTimer(Timer* t, long ms);
+
+/* the timer does not post its event any more, unless it already did */
+void cancelTimer(Timer* t);
+
+/* only exact for whoever arms the timer, which may see it armed as it expires */
+int timerArmed(Timer* t);
+
+/* milliseconds on the clock the timers use */
+long long monotonicMs();
+
+/* called by the reactor: milliseconds to sleep at most, -1 while no timer is armed */
+int timerTimeout();
+/* called by the reactor: expire every timer that is due */
+void runTimers();
+
+#endif
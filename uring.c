@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include "uring.h"
+
+static int uringSetup(unsigned entries, struct io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t argSize) {
+  return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argSize);
+}
+
+static int uringRegister(int fd, unsigned op, void* arg, unsigned n) {
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+int initRing(Ring* r, unsigned entries, unsigned completions) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  if(completions > 0) {
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = completions;
+  }
+  r->fd = uringSetup(entries, &p);
+  if(r->fd < 0) {
+    return -errno;
+  }
+  if(!(p.features & IORING_FEAT_EXT_ARG)) {
+    close(r->fd);
+    return -ENOSYS;
+  }
+
+  r->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    /* both rings are in one mapping */
+    if(r->cqMapLen > r->sqMapLen) {
+      r->sqMapLen = r->cqMapLen;
+    }
+    r->cqMapLen = 0;
+  }
+  r->sqMap = mmap(NULL, r->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sqMap == MAP_FAILED) {
+    int err = errno;
+    close(r->fd);
+    return -err;
+  }
+  r->cqMap = r->sqMap;
+  if(r->cqMapLen > 0) {
+    r->cqMap = mmap(NULL, r->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+  }
+  r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->cqMap == MAP_FAILED || r->sqes == MAP_FAILED) {
+    int err = errno;
+    munmap(r->sqMap, r->sqMapLen);
+    if(r->cqMapLen > 0 && r->cqMap != MAP_FAILED) {
+      munmap(r->cqMap, r->cqMapLen);
+    }
+    close(r->fd);
+    return -err;
+  }
+
+  char* sq = r->sqMap;
+  r->sqHead = (unsigned*)(sq + p.sq_off.head);
+  r->sqTail = (unsigned*)(sq + p.sq_off.tail);
+  r->sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+  r->sqEntries = p.sq_entries;
+  r->sqArray = (unsigned*)(sq + p.sq_off.array);
+  r->sqTaken = *r->sqTail;
+  char* cq = r->cqMap;
+  r->cqHead = (unsigned*)(cq + p.cq_off.head);
+  r->cqTail = (unsigned*)(cq + p.cq_off.tail);
+  r->cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  pthread_mutex_init(&r->mtx, NULL);
+  return 0;
+}
+
+void freeRing(Ring* r) {
+  munmap(r->sqes, r->sqesLen);
+  if(r->cqMapLen > 0) {
+    munmap(r->cqMap, r->cqMapLen);
+  }
+  munmap(r->sqMap, r->sqMapLen);
+  close(r->fd);
+  pthread_mutex_destroy(&r->mtx);
+}
+
+struct io_uring_sqe* ringSqe(Ring* r) {
+  while(r->sqTaken - *(volatile unsigned*)r->sqHead >= r->sqEntries) {
+    /* full: hand the kernel what is there to make room */
+    int n = ringSubmit(r);
+    if(n < 0 && n != -EINTR && n != -EAGAIN && n != -EBUSY) {
+      return NULL;
+    }
+  }
+  unsigned i = r->sqTaken & r->sqMask;
+  struct io_uring_sqe* sqe = &r->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sqArray[i] = i;
+  r->sqTaken++;
+  return sqe;
+}
+
+int ringSubmit(Ring* r) {
+  unsigned submit = r->sqTaken - *r->sqTail;
+  if(submit == 0) {
+    return 0;
+  }
+  /* the kernel sees the entries before the tail that covers them */
+  __sync_synchronize();
+  *(volatile unsigned*)r->sqTail = r->sqTaken;
+  int n = uringEnter(r->fd, submit, 0, 0, NULL, 0);
+  return n < 0 ? -errno : n;
+}
+
+void ringWait(Ring* r, int timeoutMs) {
+  if(ringPeek(r)) {
+    return;
+  }
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if(timeoutMs >= 0) {
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+    arg.ts = (unsigned long)&ts;
+  }
+  /* an error is ETIME or EINTR, the caller looks at what is there either way */
+  uringEnter(r->fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+struct io_uring_cqe* ringPeek(Ring* r) {
+  unsigned head = *r->cqHead;
+  if(head == *(volatile unsigned*)r->cqTail) {
+    return NULL;
+  }
+  /* the entry is read after the tail that covers it */
+  __sync_synchronize();
+  return &r->cqes[head & r->cqMask];
+}
+
+void ringSeen(Ring* r) {
+  __sync_synchronize();
+  *(volatile unsigned*)r->cqHead = *r->cqHead + 1;
+}
+
+int initBufferRing(Ring* r, BufferRing* b, int group, int count, int size) {
+  size_t ringLen = count * sizeof(struct io_uring_buf);
+  b->br = mmap(NULL, ringLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(b->br == MAP_FAILED) {
+    return -errno;
+  }
+  b->data = malloc((size_t)count * size);
+  b->count = count;
+  b->size = size;
+  b->group = group;
+  b->tail = 0;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)b->br;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if(uringRegister(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    int err = errno;
+    munmap(b->br, ringLen);
+    free(b->data);
+    return -err;
+  }
+  for(int i = 0; i < count; i++) {
+    recycleBuffer(b, i);
+  }
+  return 0;
+}
+
+void freeBufferRing(BufferRing* b) {
+  munmap(b->br, b->count * sizeof(struct io_uring_buf));
+  free(b->data);
+}
+
+char* bufferData(BufferRing* b, int id) {
+  return b->data + (size_t)id * b->size;
+}
+
+void recycleBuffer(BufferRing* b, int id) {
+  struct io_uring_buf* buf = &b->br->bufs[b->tail & (b->count - 1)];
+  buf->addr = (unsigned long)bufferData(b, id);
+  buf->len = b->size;
+  buf->bid = id;
+  b->tail++;
+  /* the kernel sees the buffer before the tail that covers it */
+  __sync_synchronize();
+  *(volatile unsigned short*)&b->br->tail = b->tail;
+}
+
+int uringSupported() {
+  /* try what the reactor does: a multishot receive from a provided buffer ring */
+  Ring r;
+  if(initRing(&r, 8, 0) < 0) {
+    return 0;
+  }
+  BufferRing b;
+  int haveBuffers = initBufferRing(&r, &b, 0, 8, 64) == 0;
+  int ok = 0;
+  int sv[2] = {-1, -1};
+  if(haveBuffers && socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+    struct io_uring_sqe* sqe = ringSqe(&r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sv[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    ringSubmit(&r);
+    write(sv[1], "x", 1);
+    ringWait(&r, 1000);
+    struct io_uring_cqe* cqe = ringPeek(&r);
+    ok = cqe && cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) && (cqe->flags & IORING_CQE_F_BUFFER);
+    close(sv[0]);
+    close(sv[1]);
+  }
+  /* closing the ring cancels the receive */
+  freeRing(&r);
+  if(haveBuffers) {
+    freeBufferRing(&b);
+  }
+  return ok;
+}
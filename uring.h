@@ -0,0 +1,84 @@
+#ifndef URING_H
+#define URING_H
+
+#include <pthread.h>
+#include <linux/io_uring.h>
+
+/*
+ * A thin wrapper around the io_uring system calls, which the reactor and the
+ * accept threads can use in place of epoll (see reactor.h)
+ *
+ * A Ring is one io_uring instance. Submission entries are taken with
+ * ringSqe, filled in and submitted together with ringSubmit, so a batch of
+ * operations costs one system call. One thread waits for completions with
+ * ringWait and reads them with ringPeek and ringSeen, without any system
+ * call for the completions that are already there.
+ *
+ * A BufferRing is a ring of provided buffers: a receive that selects its
+ * buffer from the group is given one by the kernel when data arrives, so a
+ * multishot receive needs no memory of its own while the client is idle.
+ * Whoever consumes the data gives the buffer back with recycleBuffer.
+ *
+ * Nothing here is used unless uringSupported finds that the kernel has
+ * everything the reactor needs.
+ */
+
+typedef struct Ring {
+  int fd;
+  pthread_mutex_t mtx; /* held by whoever takes and submits entries, if several threads do */
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqArray;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned sqTaken; /* the tail including the entries taken and not submitted */
+  struct io_uring_sqe* sqes;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+  void* sqMap; /* the mappings, to free them */
+  size_t sqMapLen;
+  void* cqMap;
+  size_t cqMapLen;
+  size_t sqesLen;
+} Ring;
+
+typedef struct BufferRing {
+  struct io_uring_buf_ring* br;
+  char* data; /* count buffers of size bytes */
+  int count; /* a power of two */
+  int size;
+  int group;
+  unsigned short tail;
+} BufferRing;
+
+/* return 1 if the kernel has multishot receive and accept, provided buffer rings and wait timeouts */
+int uringSupported();
+
+/* set up a ring with room for entries submissions and completions more, return 0 or -errno */
+int initRing(Ring* r, unsigned entries, unsigned completions);
+void freeRing(Ring* r);
+
+/* a cleared submission entry, submitting what was taken so far if the queue is full */
+struct io_uring_sqe* ringSqe(Ring* r);
+
+/* submit the entries taken so far, return the number submitted or -errno */
+int ringSubmit(Ring* r);
+
+/* wait until a completion is ready, at most timeoutMs (-1 to wait as long as it takes) */
+void ringWait(Ring* r, int timeoutMs);
+
+/* the next completion, NULL if there is none; ringSeen consumes it */
+struct io_uring_cqe* ringPeek(Ring* r);
+void ringSeen(Ring* r);
+
+/* register count buffers of size bytes as the group, return 0 or -errno */
+int initBufferRing(Ring* r, BufferRing* b, int group, int count, int size);
+/* once the ring it was registered with is freed */
+void freeBufferRing(BufferRing* b);
+char* bufferData(BufferRing* b, int id);
+/* give a buffer back to the kernel, only from one thread */
+void recycleBuffer(BufferRing* b, int id);
+
+#endif